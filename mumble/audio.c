@@ -8,6 +8,10 @@
 #include "audio.h"
 #include "util.h"
 #include "log.h"
+#include "mix.h"
+#include "oggopus.h"
+#include "framecache.h"
+#include "audiopool.h"
 
 static inline bool sound_try_pin(AudioStream *sound) {
 	// Don't pin if we are being reclaimed
@@ -305,6 +309,7 @@ void audiostream_reset_playback_state(AudioStream *sound) {
 	sound->fade_frames = 0;
 	sound->fade_frames_left = 0;
 	sound->fade_stop = false;
+	sound->fresh = true;
 
 	// Clear the buffer
 	atomic_store_explicit(&sound->used, 0, memory_order_relaxed);
@@ -320,9 +325,62 @@ void audiostream_reset_playback_state(AudioStream *sound) {
 	}
 
 	// Rewind
+	sound->clip_position = 0;
 	if (sound->file) {
 		sf_seek(sound->file, 0, SEEK_SET);
 	}
+
+	if (sound->opus) {
+		// Every play starts out sending the original packets, until something needs mixing
+		oggopus_rewind(sound->opus);
+		sound->opus->scratch_length = 0;
+		sound->opus->pending_length = 0;
+		sound->opus->ahead = 0;
+		sound->passthrough = true;
+	}
+
+	if (sound->replay) {
+		mumble_framecache_release(sound->replay);
+		sound->replay = NULL;
+	}
+	sound->replay_packet = 0;
+	sound->replay_offset = 0;
+}
+
+static void audio_passthrough_stop_locked(AudioStream *sound) {
+	sf_count_t position;
+
+	if (sound->replay) {
+		// Carry on decoding right after the last recorded frame that was sent
+		position = (sf_count_t) sound->replay_packet * sound->replay->frame_size;
+		mumble_framecache_release(sound->replay);
+		sound->replay = NULL;
+	} else if (sound->passthrough) {
+		// Carry on decoding from where the sent packets left off, the decoder delay at the start isn't part of the decoded audio
+		position = sound->opus->position - sound->opus->pre_skip;
+		if (position < 0) {
+			position = 0;
+		}
+		sound->passthrough = false;
+	} else {
+		return;
+	}
+
+	if (position > 0) {
+		sound->fresh = false;
+	}
+
+	if (sound->clip) {
+		sound->clip_position = position;
+	} else {
+		sf_seek(sound->file, position * sound->info.samplerate / AUDIO_SAMPLE_RATE, SEEK_SET);
+	}
+}
+
+void audio_passthrough_stop(AudioStream *sound) {
+	uv_mutex_lock(&sound->mutex);
+	audio_passthrough_stop_locked(sound);
+	uv_mutex_unlock(&sound->mutex);
 }
 
 static void audio_transmission_unreference_locked(lua_State *l, AudioStream *sound) {
@@ -357,51 +415,31 @@ void audio_transmission_unreference(lua_State *l, AudioStream *sound) {
 	uv_mutex_unlock(&sound->mutex);
 }
 
-float* convert_mono_to_multi(const float* input_buffer, sf_count_t frames_read, int channels) {
-	float *multi_buffer = (float *)malloc(frames_read * channels * sizeof(float));
-	if (!multi_buffer) return NULL;
-
+void convert_mono_to_multi(const float* input_buffer, float* output_buffer, sf_count_t frames_read, int channels) {
+	if (channels == 2) {
+		mix_mono_to_stereo(output_buffer, input_buffer, frames_read);
+		return;
+	}
 	for (int i = 0; i < frames_read; i++) {
 		for (int ch = 0; ch < channels; ch++) {
-			multi_buffer[i * channels + ch] = input_buffer[i];
+			output_buffer[i * channels + ch] = input_buffer[i];
 		}
 	}
-	return multi_buffer;
 }
 
-float* downmix_to_stereo(const float* input_buffer, sf_count_t frames_read, int input_channels) {
-	float *stereo_buffer = (float *)malloc(frames_read * 2 * sizeof(float));
-	if (!stereo_buffer) return NULL;
-
-	for (sf_count_t i = 0; i < frames_read; i++) {
-		float left = 0.0f, right = 0.0f;
-		for (int ch = 0; ch < input_channels; ch++) {
-			if (ch % 2 == 0)
-				left += input_buffer[i * input_channels + ch];
-			else
-				right += input_buffer[i * input_channels + ch];
-		}
-		stereo_buffer[i * 2] = left / (input_channels / 2.0f);
-		stereo_buffer[i * 2 + 1] = right / (input_channels / 2.0f);
-	}
-	return stereo_buffer;
+void downmix_to_stereo(const float* input_buffer, float* output_buffer, sf_count_t frames_read, int input_channels) {
+	mix_downmix_to_stereo(output_buffer, input_buffer, frames_read, input_channels);
 }
 
-int resample_audio(SRC_STATE *src_state, const float *input_buffer, float **output_buffer, sf_count_t input_frames, sf_count_t output_frames, double resample_ratio, bool end_of_input) {
-	*output_buffer = (float *)malloc(output_frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
-
-	if (!*output_buffer) {
-		return -1;
-	}
-
+int resample_audio(SRC_STATE *src_state, const float *input_buffer, float *output_buffer, sf_count_t input_frames, sf_count_t output_frames, double resample_ratio, bool end_of_input) {
 	if (resample_ratio == 1.0) {
-		memcpy(*output_buffer, input_buffer, input_frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
+		memcpy(output_buffer, input_buffer, input_frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
 		return input_frames;
 	}
 
 	SRC_DATA src_data = {
 		.data_in = input_buffer,
-		.data_out = *output_buffer,
+		.data_out = output_buffer,
 		.input_frames = input_frames,
 		.output_frames = output_frames,
 		.end_of_input = end_of_input,
@@ -411,8 +449,6 @@ int resample_audio(SRC_STATE *src_state, const float *input_buffer, float **outp
 	int error = src_process(src_state, &src_data);
 	if (error != 0) {
 		mumble_log(LOG_ERROR, "error resampling audio: %s", src_strerror(error));
-		free(*output_buffer);
-		*output_buffer = NULL;
 		return -1;
 	}
 
@@ -420,8 +456,6 @@ int resample_audio(SRC_STATE *src_state, const float *input_buffer, float **outp
 		error = src_reset(src_state);
 		if (error != 0) {
 			mumble_log(LOG_ERROR, "error resetting audio file resampler state: %s", src_strerror(error));
-			free(*output_buffer);
-			*output_buffer = NULL;
 			return -1;
 		}
 	}
@@ -429,7 +463,8 @@ int resample_audio(SRC_STATE *src_state, const float *input_buffer, float **outp
 	return src_data.output_frames_gen;
 }
 
-int process_audio(AudioStream* sound, float **output_data, size_t available_space, size_t *frames_out, bool *eof_out) {
+int process_audio(AudioStream* sound, Arena *arena, float **output_data, size_t available_space, size_t *frames_out, bool *eof_out) {
+	*output_data = NULL;
 	*frames_out = 0;
 	*eof_out = false;
 	int input_rate = sound->info.samplerate;
@@ -443,45 +478,38 @@ int process_audio(AudioStream* sound, float **output_data, size_t available_spac
 	sf_count_t input_frames = (sf_count_t)((double)available_output_frames / resample_ratio);
 	// How many frames we estimate will be output after resampling to 48k
 
-	float *input_buffer = (float *)malloc(input_frames * input_channels * sizeof(float));
+	// Everything from the last call has already been copied into the ring
+	arena_reset(arena);
+
+	float *input_buffer = arena_alloc(arena, input_frames * input_channels * sizeof(float));
 	if (!input_buffer) return -1;
 
 	sf_count_t frames_read = sf_readf_float(sound->file, input_buffer, input_frames);
 
 	if (frames_read <= 0) {
 		*eof_out = true;
-		free(input_buffer);
 		return 0;
 	}
 
 	if (input_channels == 1) {
-		float *stereo_buffer = convert_mono_to_multi(input_buffer, frames_read, AUDIO_PLAYBACK_CHANNELS);
-		if (!stereo_buffer) {
-			free(input_buffer);
-			return -1;
-		}
-		free(input_buffer);
+		float *stereo_buffer = arena_alloc(arena, frames_read * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
+		if (!stereo_buffer) return -1;
+		convert_mono_to_multi(input_buffer, stereo_buffer, frames_read, AUDIO_PLAYBACK_CHANNELS);
 		input_buffer = stereo_buffer;
 	} else if (input_channels > 2) {
-		float *stereo_buffer = downmix_to_stereo(input_buffer, frames_read, input_channels);
-		if (!stereo_buffer) {
-			free(input_buffer);
-			return -1;
-		}
-		free(input_buffer);
+		float *stereo_buffer = arena_alloc(arena, frames_read * 2 * sizeof(float));
+		if (!stereo_buffer) return -1;
+		downmix_to_stereo(input_buffer, stereo_buffer, frames_read, input_channels);
 		input_buffer = stereo_buffer;
 	}
 
 	sf_count_t actual_output_frames = (sf_count_t)ceil((double)frames_read * resample_ratio);
 
-	bool flush = (frames_read > 0) && (frames_read < input_frames);
-	int resampled_frames = resample_audio(sound->src_state, input_buffer, output_data, frames_read, actual_output_frames, resample_ratio, flush);
-	if (!*output_data) {
-		free(input_buffer);
-		return -1;
-	}
+	*output_data = arena_alloc(arena, actual_output_frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
+	if (!*output_data) return -1;
 
-	free(input_buffer);
+	bool flush = (frames_read > 0) && (frames_read < input_frames);
+	int resampled_frames = resample_audio(sound->src_state, input_buffer, *output_data, frames_read, actual_output_frames, resample_ratio, flush);
 	if (resampled_frames < 0) {
 		return -1;
 	}
@@ -496,86 +524,265 @@ int process_audio(AudioStream* sound, float **output_data, size_t available_spac
 	return 0;
 }
 
-void mumble_audio_buffer_thread(void *arg) {
+void audio_buffer_wake(MumbleClient *client) {
+	if (client->audio_shared) {
+		// Queue up a refill, unless every one we're allowed is already queued or running
+		for (int i = 0; i < AUDIO_BUFFER_THREADS; i++) {
+			bool expected = false;
+			if (atomic_compare_exchange_strong(&client->audio_buffer_tasks[i].queued, &expected, true)) {
+				mumble_audiopool_submit(&client->audio_buffer_tasks[i]);
+				return;
+			}
+		}
+		return;
+	}
+
+	uv_mutex_lock(&client->audio_buffer_mutex);
+	client->audio_buffer_pending++;
+	uv_cond_signal(&client->audio_buffer_cond);
+	uv_mutex_unlock(&client->audio_buffer_mutex);
+}
+
+static inline bool audio_buffer_low(const AudioStream *sound) {
+	return ring_count(sound) < sound->buffer_size / 2;
+}
+
+// Whether the stream is low and nobody is refilling it yet, must be called with inner_mutex held
+static inline bool audio_buffer_wanted(const AudioStream *sound) {
+	// Cached clips are already decoded, and streams sent as already encoded packets are never decoded, so there is nothing to buffer for them
+	if (!sound || sound->clip != NULL || !sound->playing || sound->end || sound->passthrough || sound->replay != NULL) return false;
+	return !atomic_load_explicit(&sound->refilling, memory_order_acquire) && audio_buffer_low(sound);
+}
+
+// Checks for a low stream without claiming it
+static bool audio_buffer_any_wanted(MumbleClient *client) {
+	bool wanted = false;
+
+	uv_mutex_lock(&client->inner_mutex);
+	for (LinkNode *current = client->stream_list; current != NULL && !wanted; current = current->next) {
+		wanted = audio_buffer_wanted(current->data);
+	}
+	uv_mutex_unlock(&client->inner_mutex);
+
+	return wanted;
+}
+
+// Claims the stream that is closest to running out of audio, or returns NULL when every stream has enough buffered
+static AudioStream *audio_buffer_next(MumbleClient *client) {
+	while (true) {
+		AudioStream *best = NULL;
+		size_t best_used = 0;
+
+		uv_mutex_lock(&client->inner_mutex);
+		for (LinkNode *current = client->stream_list; current != NULL; current = current->next) {
+			AudioStream *sound = current->data;
+
+			if (!audio_buffer_wanted(sound)) continue;
+
+			size_t used = ring_count(sound);
+			if (best == NULL || used < best_used) {
+				best = sound;
+				best_used = used;
+			}
+		}
+
+		if (best != NULL && !sound_try_pin(best)) {
+			best = NULL;
+		}
+		uv_mutex_unlock(&client->inner_mutex);
+
+		if (best == NULL) {
+			return NULL;
+		}
+
+		bool expected = false;
+		if (atomic_compare_exchange_strong(&best->refilling, &expected, true)) {
+			return best;
+		}
+
+		// Another worker got to it first
+		sound_unpin_schedule_unref_if_needed(best);
+	}
+}
+
+// Returns false if nothing could be added to the ring
+static bool audio_buffer_refill(MumbleClient *client, AudioStream *sound, Arena *arena) {
+	uv_mutex_lock(&sound->mutex);
+	bool wanted = sound->playing && !sound->end && !sound->passthrough && sound->replay == NULL;
+	uv_mutex_unlock(&sound->mutex);
+
+	if (!wanted) {
+		return true;
+	}
+
+	uint64_t start = uv_hrtime();
+	size_t frames_read = 0;
+	float *output_audio = NULL;
+	bool eof = false;
+
+	int rc = process_audio(sound, arena, &output_audio,
+	                       ring_space(sound) * sizeof(float),
+	                       &frames_read, &eof);
+
+	float ms = (uv_hrtime() - start) / 1e6;
+	if (ms > AUDIO_BUFFER_SIZE) {
+		// A stutter will occur, so show a warning
+		mumble_log(LOG_WARN,
+		           "audio processing took %.3f ms (buffer size is %d ms)",
+		           ms, AUDIO_BUFFER_SIZE);
+	} else {
+		mumble_log(LOG_CODE, "audio processing took %.3f ms", ms);
+	}
+
+	if (rc == 0 && output_audio && frames_read > 0) {
+		size_t copy_samples = frames_read * AUDIO_PLAYBACK_CHANNELS;
+		ring_write(sound, output_audio, copy_samples);
+	}
+
+	if (eof) {
+		uv_mutex_lock(&sound->mutex);
+		sound->end = true;
+		uv_mutex_unlock(&sound->mutex);
+	}
+
+	return rc == 0 && (frames_read > 0 || eof);
+}
+
+static void audio_buffer_release(AudioStream *sound) {
+	atomic_store_explicit(&sound->refilling, false, memory_order_release);
+	sound_unpin_schedule_unref_if_needed(sound);
+}
+
+// Refills streams until none of them are low, streams that failed to read anything are left claimed in the failed list
+static void audio_buffer_drain(MumbleClient *client, Arena *arena, AudioStream **failed) {
+	// Streams that run low while we are busy wake up another worker, so a slow decode only holds up its own stream
+	AudioStream *sound;
+	while ((sound = audio_buffer_next(client)) != NULL) {
+		if (audio_buffer_refill(client, sound, arena)) {
+			audio_buffer_release(sound);
+		} else {
+			// Keep it claimed so we move on to the other low streams, instead of spinning on this one
+			sound->refill_failed = *failed;
+			*failed = sound;
+		}
+	}
+}
+
+// Lets go of the streams that failed, they wait for playback to ask for them again
+static void audio_buffer_release_failed(AudioStream *failed) {
+	while (failed != NULL) {
+		AudioStream *next = failed->refill_failed;
+		failed->refill_failed = NULL;
+		audio_buffer_release(failed);
+		failed = next;
+	}
+}
+
+static void mumble_audio_buffer_thread(void *arg) {
 	pthread_setname_np(pthread_self(), "buffer");
 
-	MumbleClient* client = (MumbleClient*) arg;
+	MumbleBufferWorker *worker = (MumbleBufferWorker*) arg;
+	MumbleClient *client = worker->client;
 
 	while (true) {
-		uv_mutex_lock(&client->main_mutex);
-		bool running = client->audio_buffer_thread_running;
-		uv_mutex_unlock(&client->main_mutex);
+		// Sleep until a stream runs low, rather than checking on every stream all the time
+		uv_mutex_lock(&client->audio_buffer_mutex);
+		while (client->audio_buffer_running && client->audio_buffer_pending == 0) {
+			uv_cond_wait(&client->audio_buffer_cond, &client->audio_buffer_mutex);
+		}
+		bool running = client->audio_buffer_running;
+		client->audio_buffer_pending = 0;
+		uv_mutex_unlock(&client->audio_buffer_mutex);
+
 		if (!running) break;
 
-		uv_mutex_lock(&client->inner_mutex);
-		LinkNode *current = client->stream_list;
+		AudioStream *failed = NULL;
+		audio_buffer_drain(client, &worker->arena, &failed);
+		audio_buffer_release_failed(failed);
+	}
+}
 
-		while (current) {
-			AudioStream *sound = current->data;
+static void audio_buffer_task(MumbleAudioTask *task, Arena *arena) {
+	MumbleClient *client = task->client;
+	AudioStream *failed = NULL;
+	bool expected;
 
-			if (sound && sound_try_pin(sound)) {
-				uv_mutex_unlock(&client->inner_mutex);
+	do {
+		audio_buffer_drain(client, arena, &failed);
+		atomic_store_explicit(&task->queued, false, memory_order_release);
 
-				uv_mutex_lock(&sound->mutex);
-				bool playing = sound->playing;
-				bool end     = sound->end;
-				size_t bsz   = sound->buffer_size;
-				uv_mutex_unlock(&sound->mutex);
+		// A stream that ran low after our last scan, but before we were done, couldn't queue us again, so check once more
+		expected = false;
+	} while (audio_buffer_any_wanted(client) && atomic_compare_exchange_strong(&task->queued, &expected, true));
 
-				if (playing && !end) {
-					size_t used_samples  = ring_count(sound);
-					size_t space_samples = ring_space(sound);
-
-					if (used_samples < (bsz / 2)) {
-						uint64_t start = uv_hrtime();
-						size_t frames_read = 0;
-						float *output_audio = NULL;
-						bool eof = false;
-
-						int rc = process_audio(sound, &output_audio,
-						                       space_samples * sizeof(float),
-						                       &frames_read, &eof);
-
-						float ms = (uv_hrtime() - start) / 1e6;
-						if (ms > AUDIO_BUFFER_SIZE) {
-							// A stutter will occur, so show a warning
-							mumble_log(LOG_WARN,
-							           "audio processing took %.3f ms (buffer size is %d ms)",
-							           ms, AUDIO_BUFFER_SIZE);
-						} else {
-							mumble_log(LOG_CODE, "audio processing took %.3f ms", ms);
-						}
-
-						if (rc == 0 && output_audio && frames_read > 0) {
-							size_t copy_samples = frames_read * AUDIO_PLAYBACK_CHANNELS;
-							ring_write(sound, output_audio, copy_samples);
-						}
-						if (output_audio) free(output_audio);
-
-						if (eof) {
-							uv_mutex_lock(&sound->mutex);
-							sound->end = true;
-							uv_mutex_unlock(&sound->mutex);
-						}
-					}
-				}
-
-				sound_unpin_schedule_unref_if_needed(sound);
-
-				uv_mutex_lock(&client->inner_mutex);
-				LinkNode *n = client->stream_list;
-				while (n && n->data != sound) n = n->next;
-				current = n ? n->next : client->stream_list;
-				continue;
-			}
+	audio_buffer_release_failed(failed);
+}
 
-			current = current->next;
+void mumble_audio_buffer_start(MumbleClient *client) {
+	uv_mutex_init(&client->audio_buffer_mutex);
+	uv_cond_init(&client->audio_buffer_cond);
+	client->audio_buffer_pending = 0;
+	client->audio_buffer_running = true;
+
+	if (client->audio_shared) {
+		// Refills run on the shared workers instead
+		for (int i = 0; i < AUDIO_BUFFER_THREADS; i++) {
+			MumbleAudioTask *task = &client->audio_buffer_tasks[i];
+			task->run = audio_buffer_task;
+			task->client = client;
+			task->next = NULL;
+			atomic_init(&task->queued, false);
 		}
+		return;
+	}
 
-		uv_mutex_unlock(&client->inner_mutex);
+	for (int i = 0; i < AUDIO_BUFFER_THREADS; i++) {
+		MumbleBufferWorker *worker = &client->audio_buffer_workers[i];
+		worker->client = client;
+		arena_init(&worker->arena, AUDIO_ARENA_SIZE);
+		uv_thread_create(&worker->thread, mumble_audio_buffer_thread, worker);
+	}
+}
+
+void mumble_audio_buffer_shutdown(MumbleClient *client) {
+	uv_mutex_lock(&client->audio_buffer_mutex);
+	client->audio_buffer_running = false;
+	uv_cond_broadcast(&client->audio_buffer_cond);
+	uv_mutex_unlock(&client->audio_buffer_mutex);
+
+	for (int i = 0; i < AUDIO_BUFFER_THREADS && !client->audio_shared; i++) {
+		MumbleBufferWorker *worker = &client->audio_buffer_workers[i];
+		uv_thread_join(&worker->thread);
+		arena_free(&worker->arena);
+	}
+
+	uv_cond_destroy(&client->audio_buffer_cond);
+	uv_mutex_destroy(&client->audio_buffer_mutex);
+}
+
+// Triggers the main thread when a frame is due, returns when the next one is due
+uint64_t mumble_audio_playback_tick(MumbleClient *client, uint64_t now) {
+	if (now >= client->audio_playback_next) {
+		uint64_t last_us = (now - client->audio_playback_last) / 1000;
+		client->audio_playback_last = now;
+
+		mumble_log(LOG_CODE, "last audio event: %.3f ms ago", (double)last_us / 1000);
+
+		if (client->connected) {
+			client->audio_playback_async_pending = true;
+			// Signal main thread that we're ready for playback
+			uv_async_send(&client->audio_playback_async);
+		}
+
+		// Increment audio_playback_next in discrete steps to prevent falling behind
+		uint64_t frame_interval_ns = client->audio_frames * 1000000;
 
-		uv_sleep(client->audio_frames);
+		while (now >= client->audio_playback_next) {
+			client->audio_playback_next += frame_interval_ns;
+		}
 	}
+
+	return client->audio_playback_next;
 }
 
 void mumble_audio_playback_thread(void* arg) {
@@ -591,31 +798,9 @@ void mumble_audio_playback_thread(void* arg) {
 
 		if (!running) break; // shutdown
 
-		uint64_t now = uv_hrtime();
-
-		if (now >= client->audio_playback_next) {
-			uint64_t last_us = (now - client->audio_playback_last) / 1000;
-			client->audio_playback_last = now;
-
-			mumble_log(LOG_CODE, "last audio event: %.3f ms ago", (double)last_us / 1000);
-
-			if (client->connected) {
-				client->audio_playback_async_pending = true;
-				// Signal main thread that we're ready for playback
-				uv_async_send(&client->audio_playback_async);
-			}
-
-			// Increment audio_playback_next in discrete steps to prevent falling behind
-			uint64_t frame_interval_ns = client->audio_frames * 1000000;
-
-			while (now >= client->audio_playback_next) {
-				client->audio_playback_next += frame_interval_ns;
-			}
-		}
-
 		// Sleep until client->audio_playback_next
 		struct timespec ts;
-		uint64_t wake_time = client->audio_playback_next;
+		uint64_t wake_time = mumble_audio_playback_tick(client, uv_hrtime());
 		ts.tv_sec = wake_time / 1000000000;
 		ts.tv_nsec = wake_time % 1000000000;
 
@@ -624,7 +809,18 @@ void mumble_audio_playback_thread(void* arg) {
 }
 
 static void handle_audio_stream_end(lua_State *l, MumbleClient *client, AudioStream *sound, bool *didLoop) {
-	sf_seek(sound->file, 0, SEEK_SET);
+	mumble_framecache_record_finish(client, sound);
+
+	if (sound->replay) {
+		sound->replay_packet = 0;
+		sound->replay_offset = 0;
+	} else if (sound->passthrough) {
+		oggopus_rewind(sound->opus);
+	} else if (sound->clip) {
+		sound->clip_position = 0;
+	} else {
+		sf_seek(sound->file, 0, SEEK_SET);
+	}
 	sound->end = false;
 	if (sound->looping) {
 		*didLoop = true;
@@ -633,7 +829,7 @@ static void handle_audio_stream_end(lua_State *l, MumbleClient *client, AudioStr
 		sound->loop_count--;
 	} else {
 		mumble_registry_pushref(l, client->audio_streams, sound->refrence);
-		mumble_hook_call(client, "OnAudioStreamEnd", 1);
+		mumble_hook_call(client, HOOK_ON_AUDIO_STREAM_END, 1);
 		audio_transmission_unreference_locked(l, sound);
 	}
 }
@@ -649,55 +845,82 @@ static void process_audio_file(lua_State *l, MumbleClient *client, AudioStream *
 	}
 
 	float input_buffer[PCM_BUFFER];
+	const float *input = input_buffer;
 
-	// Calculate available frames from the lock-free ring
-	size_t samples_avail = ring_count(sound);
-	sf_count_t frames_available = (sf_count_t)(samples_avail / AUDIO_PLAYBACK_CHANNELS);
+	sf_count_t read = 0;
 
-	// Cap by requested sample_size
-	sf_count_t frames_to_read = (frames_available < (sf_count_t)sample_size)
-	                            ? frames_available
-	                            : (sf_count_t)sample_size;
+	if (sound->clip) {
+		// Cached clips are mixed straight out of the shared decoded samples
+		AudioClip *clip = sound->clip;
+		sf_count_t remaining = clip->frames - sound->clip_position;
 
-	sf_count_t read = 0;
+		read = remaining < (sf_count_t)sample_size ? remaining : (sf_count_t)sample_size;
+		if (read < 0) {
+			read = 0;
+		}
 
-	if (frames_to_read > 0) {
-		// Convert frames to samples and cap to input_buffer capacity
-		size_t samples_to_read = (size_t)frames_to_read * AUDIO_PLAYBACK_CHANNELS;
-		if (samples_to_read > PCM_BUFFER) {
-			samples_to_read = PCM_BUFFER;
+		input = clip->pcm + sound->clip_position * AUDIO_PLAYBACK_CHANNELS;
+		sound->clip_position += read;
+
+		if (sound->clip_position >= clip->frames) {
+			sound->end = true;
 		}
+	} else {
+		// Calculate available frames from the lock-free ring
+		size_t samples_avail = ring_count(sound);
+		sf_count_t frames_available = (sf_count_t)(samples_avail / AUDIO_PLAYBACK_CHANNELS);
+
+		// Cap by requested sample_size
+		sf_count_t frames_to_read = (frames_available < (sf_count_t)sample_size)
+		                            ? frames_available
+		                            : (sf_count_t)sample_size;
+
+		if (frames_to_read > 0) {
+			// Convert frames to samples and cap to input_buffer capacity
+			size_t samples_to_read = (size_t)frames_to_read * AUDIO_PLAYBACK_CHANNELS;
+			if (samples_to_read > PCM_BUFFER) {
+				samples_to_read = PCM_BUFFER;
+			}
 
-		// Pull from the ring directly into input_buffer (lock-free)
-		size_t got = ring_read(sound, input_buffer, samples_to_read);
+			// Pull from the ring directly into input_buffer (lock-free)
+			size_t got = ring_read(sound, input_buffer, samples_to_read);
 
-		// Convert samples actually read to frames actually read
-		read = (sf_count_t)(got / AUDIO_PLAYBACK_CHANNELS);
+			// Convert samples actually read to frames actually read
+			read = (sf_count_t)(got / AUDIO_PLAYBACK_CHANNELS);
+		}
 	}
 
+	if (read > 0) {
+		sound->fresh = false;
+	}
+
+	float* output = (float*) client->audio_output;
+	float volume = sound->volume * client->volume;
+
 	if (sound->fade_frames > 0) {
-		// Sound has a volume fade adjustment
-		for (int i = 0; i < read; i++) {
-			if (sound->fade_frames_left > 0) {
-				sound->fade_frames_left = sound->fade_frames_left - 1;
-				sound->fade_volume = sound->fade_to_volume + (sound->fade_from_volume - sound->fade_to_volume) * ((float) sound->fade_frames_left / sound->fade_frames);
-			} else if (sound->fade_stop) {
+		// Sound has a volume fade adjustment, ramp linearly over the frames left in the fade
+		sf_count_t ramp = read < sound->fade_frames_left ? read : sound->fade_frames_left;
+		if (ramp > 0) {
+			float range = sound->fade_from_volume - sound->fade_to_volume;
+			float start = sound->fade_to_volume + range * ((float) (sound->fade_frames_left - 1) / sound->fade_frames);
+			float step = -range / sound->fade_frames;
+			mix_add_ramp(output, input, ramp, volume * start, volume * step);
+			sound->fade_frames_left -= ramp;
+			sound->fade_volume = sound->fade_to_volume + range * ((float) sound->fade_frames_left / sound->fade_frames);
+		}
+
+		if (ramp < read) {
+			if (sound->fade_stop) {
 				// Fake end of stream
 				sound->fade_volume = 0.0f;
 				sound->end = true;
+			} else {
+				mix_add_gain(output + ramp * 2, input + ramp * 2, (read - ramp) * 2, volume * sound->fade_volume);
 			}
-
-			float volume = sound->volume * client->volume * sound->fade_volume;
-			client->audio_output[i].l += input_buffer[i * 2] * volume;
-			client->audio_output[i].r += input_buffer[i * 2 + 1] * volume;
 		}
 	} else {
 		// No fade needed, just adjust volume levels
-		for (int i = 0; i < read; i++) {
-			float volume = sound->volume * client->volume;
-			client->audio_output[i].l += input_buffer[i * 2] * volume;
-			client->audio_output[i].r += input_buffer[i * 2 + 1] * volume;
-		}
+		mix_add_gain(output, input, read * 2, volume);
 	}
 
 	if (sound->end && read < sample_size) {
@@ -709,6 +932,12 @@ static void process_audio_file(lua_State *l, MumbleClient *client, AudioStream *
 		handle_audio_stream_end(l, client, sound, didLoop);
 	}
 
+	if (sound->playing && sound->clip == NULL && !sound->end && audio_buffer_low(sound) &&
+	    !atomic_load_explicit(&sound->refilling, memory_order_acquire)) {
+		// Running low, so get a buffer worker to decode some more
+		audio_buffer_wake(client);
+	}
+
 	if (read > *biggest_read) {
 		*biggest_read = read;
 	}
@@ -802,117 +1031,205 @@ static void send_protobuf_audio(MumbleClient *client, uint8_t *encoded, opus_int
 }
 
 void mumble_audio_queue_init(audio_queue_t *q) {
-	q->front = NULL;
-	q->rear = NULL;
-	uv_mutex_init(&q->mutex);
-	uv_cond_init(&q->cond);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	uv_sem_init(&q->wakeup, 0);
 }
 
-static void audio_queue_push(audio_queue_t *q, audio_work_t *work) {
-	audio_queue_node_t *node = malloc(sizeof(audio_queue_node_t));
-	if (!node) {
-		mumble_log(LOG_ERROR, "failed to allocate audio queue node");
-		return;
+static bool audio_queue_push(audio_queue_t *q, audio_work_t *work) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head - tail >= AUDIO_QUEUE_SIZE) {
+		// Full
+		return false;
 	}
-	node->work = work;
-	node->next = NULL;
 
-	uv_mutex_lock(&q->mutex);
+	q->items[head & (AUDIO_QUEUE_SIZE - 1)] = work;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return true;
+}
+
+static audio_work_t *audio_queue_pop(audio_queue_t *q) {
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
 
-	if (q->rear == NULL) {
+	if (tail == head) {
 		// Empty
-		q->front = node;
-		q->rear = node;
-	} else {
-		q->rear->next = node;
-		q->rear = node;
+		return NULL;
 	}
 
-	uv_cond_signal(&q->cond);
-	uv_mutex_unlock(&q->mutex);
+	audio_work_t *work = q->items[tail & (AUDIO_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return work;
 }
 
-static audio_work_t *audio_queue_pop(audio_queue_t *q, bool *running_flag) {
-	uv_mutex_lock(&q->mutex);
+void mumble_audio_work_pool_init(MumbleClient *client) {
+	client->audio_work_free = NULL;
+	client->audio_work_inflight = 0;
+	client->audio_work_pool = malloc(sizeof(audio_work_t) * AUDIO_WORK_POOL_SIZE);
 
-	while (q->front == NULL && *running_flag) {
-		uv_cond_wait(&q->cond, &q->mutex);
+	if (!client->audio_work_pool) {
+		mumble_log(LOG_WARN, "failed to allocate audio work pool");
+		return;
 	}
 
-	if (!*running_flag && q->front == NULL) {
-		// Shutdown and queue empty: no more work
-		uv_mutex_unlock(&q->mutex);
+	for (int i = 0; i < AUDIO_WORK_POOL_SIZE; i++) {
+		audio_work_t *work = &client->audio_work_pool[i];
+		work->pooled = true;
+		work->next = client->audio_work_free;
+		client->audio_work_free = work;
+	}
+}
+
+// Only ever called from the main thread
+static audio_work_t *audio_work_acquire(MumbleClient *client) {
+	if (client->audio_work_inflight >= AUDIO_QUEUE_SIZE) {
+		// Both queues could be full, so there would be nowhere to put this frame
 		return NULL;
 	}
 
-	// Pop node as usual
-	audio_queue_node_t *node = q->front;
-	audio_work_t *work = node->work;
-	q->front = node->next;
-	if (q->front == NULL) {
-		q->rear = NULL;
+	audio_work_t *work = client->audio_work_free;
+
+	if (work != NULL) {
+		client->audio_work_free = work->next;
+	} else {
+		// Pool is exhausted, encoding must be falling behind
+		work = malloc(sizeof(audio_work_t));
+		if (!work) {
+			return NULL;
+		}
+		work->pooled = false;
 	}
-	free(node);
-	uv_mutex_unlock(&q->mutex);
+
+	client->audio_work_inflight++;
 	return work;
 }
 
-static audio_work_t *audio_queue_pop_nonblocking(audio_queue_t *q) {
-	uv_mutex_lock(&q->mutex);
+static void audio_work_release(MumbleClient *client, audio_work_t *work) {
+	client->audio_work_inflight--;
 
-	if (q->front == NULL) {
-		uv_mutex_unlock(&q->mutex);
-		return NULL;
+	if (work->pooled) {
+		work->next = client->audio_work_free;
+		client->audio_work_free = work;
+	} else {
+		free(work);
 	}
+}
 
-	audio_queue_node_t *node = q->front;
-	audio_work_t *work = node->work;
-	q->front = node->next;
-	if (q->front == NULL) {
-		q->rear = NULL;
+static void audio_queue_cleanup(MumbleClient *client, audio_queue_t *q) {
+	audio_work_t *work;
+	while ((work = audio_queue_pop(q)) != NULL) {
+		audio_work_release(client, work);
+	}
+
+	uv_sem_destroy(&q->wakeup);
+}
+
+void mumble_audio_queue_shutdown(MumbleClient *client) {
+	if (!client->audio_shared) {
+		// Signal encode thread to stop
+		atomic_store(&client->audio_encode_thread_running, false);
+		uv_sem_post(&client->audio_encode_queue.wakeup);
+
+		// Join encode thread
+		uv_thread_join(&client->audio_encode_thread);
+	}
+
+	// Cleanup encode and send queues
+	audio_queue_cleanup(client, &client->audio_encode_queue);
+	audio_queue_cleanup(client, &client->audio_send_queue);
+
+	free(client->audio_work_pool);
+	client->audio_work_pool = NULL;
+	client->audio_work_free = NULL;
+}
+
+static void audio_encode_work(MumbleClient *client, audio_work_t *work) {
+	if (!work->passthrough) {
+		uint64_t start = uv_hrtime();
+
+		// Encode audio
+		work->encoded_len = opus_encode_float(client->encoder,
+		                                      (float *)work->pcm,
+		                                      work->frame_size,
+		                                      work->encoded,
+		                                      PAYLOAD_SIZE_MAX);
+
+		work->encode_time = (uv_hrtime() - start) / 1e6;
+
+		mumble_log(LOG_CODE, "audio encode: %.3f ms", work->encode_time);
+	}
+
+	// Push to send queue and wake the main thread to send it right away
+	audio_queue_push(&client->audio_send_queue, work);
+
+	if (client->connected) {
+		uv_async_send(&client->audio_send_async);
 	}
-	free(node);
-	uv_mutex_unlock(&q->mutex);
-	return work;
 }
 
-static void audio_queue_cleanup(audio_queue_t *q) {
-	// Lock the queue to safely walk it
-	uv_mutex_lock(&q->mutex);
+void mumble_audio_encode_thread(void *arg) {
+	pthread_setname_np(pthread_self(), "encode");
+
+	MumbleClient *client = (MumbleClient *)arg;
+
+	while (true) {
+		// Block until there is work or we are shutting down
+		uv_sem_wait(&client->audio_encode_queue.wakeup);
 
-	audio_queue_node_t *node = q->front;
-	while (node) {
-		audio_queue_node_t *next = node->next;
-		if (node->work) {
-			free(node->work);
+		if (!atomic_load(&client->audio_encode_thread_running)) {
+			break;
+		}
+
+		audio_work_t *work = audio_queue_pop(&client->audio_encode_queue);
+		if (!work) {
+			continue;
 		}
-		free(node);
-		node = next;
+
+		audio_encode_work(client, work);
 	}
+}
 
-	q->front = NULL;
-	q->rear = NULL;
+static void audio_encode_task(MumbleAudioTask *task, Arena *arena) {
+	MumbleClient *client = task->client;
 
-	uv_mutex_unlock(&q->mutex);
+	// Only one task per client is ever queued or running, so frames are still encoded one at a time and in order
+	do {
+		audio_work_t *work;
+		while ((work = audio_queue_pop(&client->audio_encode_queue)) != NULL) {
+			audio_encode_work(client, work);
+		}
+		atomic_store_explicit(&task->queued, false, memory_order_release);
+		// A frame queued after we ran out, but before we said so, would be left waiting for the next one
+	} while (atomic_load_explicit(&client->audio_encode_queue.head, memory_order_acquire) !=
+	         atomic_load_explicit(&client->audio_encode_queue.tail, memory_order_acquire) &&
+	         !atomic_exchange(&task->queued, true));
+}
 
-	// Destroy mutex and cond
-	uv_mutex_destroy(&q->mutex);
-	uv_cond_destroy(&q->cond);
+static void audio_encode_wake(MumbleClient *client) {
+	if (client->audio_shared) {
+		if (!atomic_exchange(&client->audio_encode_task.queued, true)) {
+			mumble_audiopool_submit(&client->audio_encode_task);
+		}
+	} else {
+		uv_sem_post(&client->audio_encode_queue.wakeup);
+	}
 }
 
-void mumble_audio_queue_shutdown(MumbleClient *client) {
-	// Signal encode thread to stop
-	uv_mutex_lock(&client->audio_encode_queue.mutex);
-	client->audio_encode_thread_running = false;
-	uv_cond_signal(&client->audio_encode_queue.cond);
-	uv_mutex_unlock(&client->audio_encode_queue.mutex);
+void mumble_audio_encode_start(MumbleClient *client) {
+	client->audio_encode_thread_running = true;
 
-	// Join encode thread
-	uv_thread_join(&client->audio_encode_thread);
+	if (client->audio_shared) {
+		// Encodes run on the shared workers instead
+		client->audio_encode_task.run = audio_encode_task;
+		client->audio_encode_task.client = client;
+		client->audio_encode_task.next = NULL;
+		atomic_init(&client->audio_encode_task.queued, false);
+		return;
+	}
 
-	// Cleanup encode and send queues
-	audio_queue_cleanup(&client->audio_encode_queue);
-	audio_queue_cleanup(&client->audio_send_queue);
+	uv_thread_create(&client->audio_encode_thread, mumble_audio_encode_thread, client);
 }
 
 static void encode_audio(MumbleClient *client, sf_count_t frame_size, bool end_frame) {
@@ -921,50 +1238,234 @@ static void encode_audio(MumbleClient *client, sf_count_t frame_size, bool end_f
 		return;
 	}
 
-	audio_work_t *work = malloc(sizeof(audio_work_t));
+	audio_work_t *work = audio_work_acquire(client);
 	if (!work) {
-		mumble_log(LOG_ERROR, "failed to allocate audio work");
+		mumble_log(LOG_WARN, "dropping %zu frames of audio, encoding is falling behind", frame_size);
+		// A recording with a frame missing wouldn't play back the same
+		mumble_framecache_record_abort(client);
 		return;
 	}
 
 	work->client = client;
 	work->frame_size = frame_size;
 	work->end_frame = end_frame;
+	work->passthrough = false;
+	work->record = mumble_framecache_record_tag(client);
 	work->audio_sequence = client->audio_sequence++;
 	memcpy(work->pcm, client->audio_output, frame_size * sizeof(AudioFrame));
 
+	// Can't fail, since there are never more frames in flight than the queue can hold
 	audio_queue_push(&client->audio_encode_queue, work);
+	audio_encode_wake(client);
 	mumble_log(LOG_CODE, "queued %zu frames of audio for encoding", frame_size);
 }
 
-void mumble_audio_encode_thread(void *arg) {
-	pthread_setname_np(pthread_self(), "encode");
+static void queue_passthrough_audio(MumbleClient *client, audio_work_t *work, sf_count_t frame_size) {
+	work->client = client;
+	work->frame_size = frame_size;
+	work->end_frame = false;
+	work->passthrough = true;
+	work->record = 0;
+	work->encode_time = 0;
+	work->audio_sequence = client->audio_sequence++;
 
-	MumbleClient *client = (MumbleClient *)arg;
+	// Goes through the encode queue too, so it can never overtake audio that is still being encoded
+	audio_queue_push(&client->audio_encode_queue, work);
+	audio_encode_wake(client);
+	mumble_log(LOG_CODE, "queued %zu frames of already encoded audio", frame_size);
+}
 
-	while (client->audio_encode_thread_running) {
-		// Block and pop from encode queue
-		audio_work_t *work = audio_queue_pop(&client->audio_encode_queue, &client->audio_encode_thread_running);
-		if (!work) {
-			// Only will happen on shutdown
+// Returns the stream to send without encoding, if there is one, and drops every other stream back to being decoded.
+// solo is set to the stream playing on its own, when nothing else would be mixed into it.
+static AudioStream *audio_passthrough_select(MumbleClient *client, AudioStream **solo) {
+	AudioStream *only = NULL;
+	int playing = 0;
+
+	uv_mutex_lock(&client->inner_mutex);
+	for (LinkNode *current = client->stream_list; current != NULL; current = current->next) {
+		AudioStream *sound = current->data;
+		if (sound && sound->playing && !atomic_load_explicit(&sound->reclaimed, memory_order_acquire)) {
+			only = sound;
+			playing++;
+		}
+	}
+	uv_mutex_unlock(&client->inner_mutex);
+
+	// A second source, or any change to the audio, means it has to be decoded and mixed after all
+	bool alone = playing == 1 && client->audio_pipes == NULL && !mumble_hook_active(client, HOOK_ON_AUDIO_STREAM) &&
+	             only->fade_frames_left == 0 && only->fade_volume == 1.0f;
+	bool untouched = alone && only->passthrough && only->volume == 1.0f && client->volume == 1.0;
+	bool recorded = alone && only->replay != NULL && mumble_framecache_matches(client, only->replay, only);
+
+	AudioStream *keep = untouched || recorded ? only : NULL;
+	*solo = alone ? only : NULL;
+
+	uv_mutex_lock(&client->inner_mutex);
+	LinkNode *current = client->stream_list;
+
+	while (current != NULL) {
+		AudioStream *sound = current->data;
+		current = current->next;
+		if (sound && sound != keep && sound->playing && (sound->passthrough || sound->replay) && sound_try_pin(sound)) {
+			uv_mutex_unlock(&client->inner_mutex);
+			audio_passthrough_stop(sound);
+			sound_unpin_schedule_unref_if_needed(sound);
+			uv_mutex_lock(&client->inner_mutex);
+		}
+	}
+
+	uv_mutex_unlock(&client->inner_mutex);
+	return keep;
+}
+
+// Queues the packets merged so far as a single packet, returns false when the stream had to stop being passed through
+static bool audio_passthrough_flush(MumbleClient *client, AudioStream *sound, sf_count_t collected) {
+	OggOpusReader *reader = sound->opus;
+	audio_work_t *work = audio_work_acquire(client);
+
+	if (!work) {
+		mumble_log(LOG_WARN, "dropping %zu frames of opus audio, sending is falling behind", collected);
+		return true;
+	}
+
+	work->encoded_len = opus_repacketizer_out(reader->repacketizer, work->encoded, PAYLOAD_SIZE_MAX);
+
+	if (work->encoded_len < 0) {
+		mumble_log(LOG_WARN, "error repacketizing opus audio: %s", opus_strerror(work->encoded_len));
+		audio_work_release(client, work);
+		return true;
+	}
+
+	if (client->max_bandwidth > 0 && (uint64_t) work->encoded_len * 8 * AUDIO_SAMPLE_RATE / collected > client->max_bandwidth) {
+		// Sent as is, the file would go over what the server allows us, so encode it ourselves instead
+		mumble_log(LOG_DEBUG, "opus audio is above the servers bandwidth limit, no longer passing it through");
+		audio_work_release(client, work);
+		reader->position -= collected;
+		audio_passthrough_stop_locked(sound);
+		return false;
+	}
+
+	queue_passthrough_audio(client, work, collected);
+	return true;
+}
+
+// Sends enough of the streams original opus packets to cover one frame, merging them when they are shorter than a frame
+static void audio_passthrough_event(lua_State *l, MumbleClient *client, AudioStream *sound, sf_count_t output_frames) {
+	OggOpusReader *reader = sound->opus;
+
+	if (reader->ahead >= output_frames) {
+		// What we already sent still covers this frame
+		reader->ahead -= output_frames;
+		return;
+	}
+
+	opus_repacketizer_init(reader->repacketizer);
+	reader->scratch_length = 0;
+
+	sf_count_t sent = 0;
+	sf_count_t collected = 0;
+	bool eof = false;
+	bool looped = false;
+
+	while (reader->ahead + sent + collected < output_frames) {
+		const uint8_t *packet;
+		size_t length;
+
+		if (reader->pending_length > 0) {
+			packet = reader->pending;
+			length = reader->pending_length;
+			reader->pending_length = 0;
+		} else if (!oggopus_next_packet(reader, &packet, &length)) {
+			if (!looped && (sound->looping || sound->loop_count > 0)) {
+				// Loop straight into the next packet, so there's no gap
+				bool didLoop = false;
+				handle_audio_stream_end(l, client, sound, &didLoop);
+				looped = true;
+				continue;
+			}
+			eof = true;
 			break;
 		}
 
-		uint64_t start = uv_hrtime();
+		int samples = opus_packet_get_nb_samples(packet, length, AUDIO_SAMPLE_RATE);
+		if (samples <= 0 || length > sizeof(reader->pending)) {
+			// Not something we can send, so skip it
+			continue;
+		}
 
-		// Encode audio
-		work->encoded_len = opus_encode_float(client->encoder,
-		                                      (float *)work->pcm,
-		                                      work->frame_size,
-		                                      work->encoded,
-		                                      PAYLOAD_SIZE_MAX);
+		// The repacketizer only keeps pointers to each packet, so they have to stay put until we are done
+		bool fits = reader->scratch_length + length <= sizeof(reader->scratch);
+		if (fits) {
+			memcpy(reader->scratch + reader->scratch_length, packet, length);
+		}
 
-		work->encode_time = (uv_hrtime() - start) / 1e6;
+		if (!fits || opus_repacketizer_cat(reader->repacketizer, reader->scratch + reader->scratch_length, length) != OPUS_OK) {
+			if (collected == 0) {
+				continue;
+			}
 
-		mumble_log(LOG_CODE, "audio encode: %.3f ms", work->encode_time);
+			// Can't be merged with what we have, so send that on its own and start a new packet with this one
+			if (packet != reader->pending) {
+				memcpy(reader->pending, packet, length);
+			}
+			reader->pending_length = length;
+
+			if (!audio_passthrough_flush(client, sound, collected)) {
+				return;
+			}
+
+			sent += collected;
+			collected = 0;
+			opus_repacketizer_init(reader->repacketizer);
+			reader->scratch_length = 0;
+			continue;
+		}
+
+		reader->scratch_length += length;
+		reader->position += samples;
+		collected += samples;
+	}
+
+	if (collected > 0) {
+		if (!audio_passthrough_flush(client, sound, collected)) {
+			return;
+		}
+		sent += collected;
+	}
+
+	// Only falls short of the frame at the end of the file
+	reader->ahead += sent - output_frames;
+	if (reader->ahead < 0) {
+		reader->ahead = 0;
+	}
+
+	if (eof) {
+		bool didLoop = false;
+		handle_audio_stream_end(l, client, sound, &didLoop);
+	}
+}
+
+// Sends the next frame recorded in the encoded frame cache, which always covers exactly one frame
+static void audio_replay_event(lua_State *l, MumbleClient *client, AudioStream *sound) {
+	EncodedClip *frames = sound->replay;
+	uint16_t length = frames->lengths[sound->replay_packet];
+
+	audio_work_t *work = audio_work_acquire(client);
 
-		// Push to send queue
-		audio_queue_push(&client->audio_send_queue, work);
+	if (!work) {
+		mumble_log(LOG_WARN, "dropping %u frames of recorded audio, sending is falling behind", frames->frame_size);
+	} else {
+		memcpy(work->encoded, frames->data + sound->replay_offset, length);
+		work->encoded_len = length;
+		queue_passthrough_audio(client, work, frames->frame_size);
+	}
+
+	sound->replay_offset += length;
+	sound->replay_packet++;
+
+	if (sound->replay_packet >= frames->packets) {
+		bool didLoop = false;
+		handle_audio_stream_end(l, client, sound, &didLoop);
 	}
 }
 
@@ -976,6 +1477,28 @@ static void audio_encode_event(lua_State *l, MumbleClient *client) {
 
 	bool didLoop = false;
 
+	AudioStream *solo;
+	AudioStream *passthrough = audio_passthrough_select(client, &solo);
+
+	if (passthrough != NULL) {
+		// Nothing to mix, so skip decoding and encoding altogether
+		if (sound_try_pin(passthrough)) {
+			uv_mutex_lock(&passthrough->mutex);
+			if (passthrough->replay) {
+				audio_replay_event(l, client, passthrough);
+			} else {
+				audio_passthrough_event(l, client, passthrough, output_frames);
+			}
+			uv_mutex_unlock(&passthrough->mutex);
+			sound_unpin_schedule_unref_if_needed(passthrough);
+		}
+		lua_stackguard_exit(l);
+		return;
+	}
+
+	// A stream playing on its own from the start gets its encoded frames recorded, when the client has a frame cache
+	mumble_framecache_record_begin(client, solo);
+
 	// clear the mix buffer for this frame
 	memset(client->audio_output, 0, sizeof(client->audio_output));
 
@@ -1004,7 +1527,7 @@ static void audio_encode_event(lua_State *l, MumbleClient *client) {
 	lua_pushinteger(l, AUDIO_SAMPLE_RATE);
 	lua_pushinteger(l, AUDIO_PLAYBACK_CHANNELS);
 	lua_pushinteger(l, output_frames);
-	mumble_hook_call(client, "OnAudioStream", 3);
+	mumble_hook_call(client, HOOK_ON_AUDIO_STREAM, 3);
 
 	// Get our list of audio pipes
 	uv_mutex_lock(&client->inner_mutex);
@@ -1038,10 +1561,12 @@ static void audio_encode_event(lua_State *l, MumbleClient *client) {
 			continue;
 		}
 
-		float* input_buffer = malloc(sizeof(float) * client->audio_frames * context->samplerate / 1000 * context->channels);
+		// Scratch memory from the last pipe is no longer needed
+		arena_reset(&client->audio_mix_arena);
+
+		float* input_buffer = arena_alloc(&client->audio_mix_arena, sizeof(float) * client->audio_frames * context->samplerate / 1000 * context->channels);
 
 		if (!input_buffer) {
-			mumble_log(LOG_WARN, "failed to create audio input buffer: %s", strerror(errno));
 			continue;
 		}
 
@@ -1059,34 +1584,31 @@ static void audio_encode_event(lua_State *l, MumbleClient *client) {
 		}
 
 		if (context->channels == 1) {
-			float *stereo_buffer = convert_mono_to_multi(input_buffer, input_frames, AUDIO_PLAYBACK_CHANNELS);
+			float *stereo_buffer = arena_alloc(&client->audio_mix_arena, input_frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
 			if (!stereo_buffer) {
-				free(input_buffer);
 				continue;
 			}
-			free(input_buffer);
+			convert_mono_to_multi(input_buffer, stereo_buffer, input_frames, AUDIO_PLAYBACK_CHANNELS);
 			input_buffer = stereo_buffer;
 		} else if (context->channels > 2) {
-			float *stereo_buffer = downmix_to_stereo(input_buffer, input_frames, context->channels);
+			float *stereo_buffer = arena_alloc(&client->audio_mix_arena, input_frames * 2 * sizeof(float));
 			if (!stereo_buffer) {
-				free(input_buffer);
 				continue;
 			}
-			free(input_buffer);
+			downmix_to_stereo(input_buffer, stereo_buffer, input_frames, context->channels);
 			input_buffer = stereo_buffer;
 		}
 
-		float *resampled_audio = NULL;
 		sf_count_t actual_output_frames = (sf_count_t)ceil((double)input_frames * resample_ratio);
-		int resampled_frames = resample_audio(context->src_state, input_buffer, &resampled_audio, input_frames, actual_output_frames, resample_ratio, false);
-		free(input_buffer);
+		float *resampled_audio = arena_alloc(&client->audio_mix_arena, actual_output_frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
+		if (!resampled_audio) {
+			continue;
+		}
+
+		int resampled_frames = resample_audio(context->src_state, input_buffer, resampled_audio, input_frames, actual_output_frames, resample_ratio, false);
 		if (resampled_frames > 0) {
 			streamed_audio = true;
-			for (int i = 0; i < resampled_frames; i++) {
-				client->audio_output[i].l += resampled_audio[i * 2];
-				client->audio_output[i].r += resampled_audio[i * 2 + 1];
-			}
-			free(resampled_audio);
+			mix_add_gain((float*) client->audio_output, resampled_audio, resampled_frames * AUDIO_PLAYBACK_CHANNELS, 1.0f);
 		}
 
 		// Update biggest_read if necessary
@@ -1109,16 +1631,23 @@ static void audio_encode_event(lua_State *l, MumbleClient *client) {
 		encode_audio(client, output_frames, end_frame);
 	}
 
+	mumble_framecache_record_end(client, biggest_read, output_frames);
+
 	client->audio_stream_active = streamed_audio;
 
 	lua_stackguard_exit(l);
 }
 
 static void audio_send_event(MumbleClient *client) {
-	audio_work_t *work = audio_queue_pop_nonblocking(&client->audio_send_queue);
+	audio_work_t *work;
+
+	// Wakeups can be coalesced, so send everything that is ready.
+	// There is only one encode thread, so the queue is already in sequence order.
+	while ((work = audio_queue_pop(&client->audio_send_queue)) != NULL) {
+		if (work->record != 0) {
+			mumble_framecache_record_packet(client, work);
+		}
 
-	if (work != NULL) {
-		// We have something to send
 		if (client->legacy) {
 			send_legacy_audio(client, work->encoded, work->encoded_len,
 			                  work->end_frame, work->audio_sequence);
@@ -1126,8 +1655,8 @@ static void audio_send_event(MumbleClient *client) {
 			send_protobuf_audio(client, work->encoded, work->encoded_len,
 			                    work->end_frame, work->audio_sequence);
 		}
-		// We can finally free our work
-		free(work);
+		// We can finally return our work to the pool
+		audio_work_release(client, work);
 	}
 }
 
@@ -1143,12 +1672,19 @@ void mumble_audio_playback_async(uv_async_t* handle) {
 		if (client->connected) {
 			// Encode audio if we can
 			audio_encode_event(client->l, client);
-			// Send audio if we can
-			audio_send_event(client);
 		}
 	}
 }
 
+void mumble_audio_send_async(uv_async_t* handle) {
+	MumbleClient* client = (MumbleClient*)handle->data;
+
+	// Called by the encode thread whenever encoded audio is ready
+	if (client->connected) {
+		audio_send_event(client);
+	}
+}
+
 /*
 	General info on how this all works.
 	Lua and opus encoding is not thread safe.
@@ -1156,8 +1692,9 @@ void mumble_audio_playback_async(uv_async_t* handle) {
 	eventually handing off the results back to our main thread.
 
 	mumble_audio_buffer_thread
-		- Reads 2 seconds of PCM data from any playing audio file
-		- Resamples PCM data to 48000hz, and converts to stereo if needed
+		- A few per client, sleeping until a playing stream runs below half of its buffer
+		- Refills whichever stream is closest to running out first, so one slow file doesn't hold up the others
+		- Reads PCM data from the audio file, resamples it to 48000hz, and converts to stereo if needed
 		- Saves PCM data in a circular buffer on the AudioStream struct
 
 	mumble_audio_playback_thread
@@ -1168,10 +1705,13 @@ void mumble_audio_playback_async(uv_async_t* handle) {
 		- Ran on our main thread, so Lua is safe to be only be called from here
 		- audio_encode_event
 			* Loops through all active audio sources and queues up 20ms of PCM audio to be encoded
-		- audio_send_event
-			* Pops a single chunk of encoded audio from our send queue, then transmits it
 
 	mumble_audio_encode_thread
 		- Encodes PCM data sent to the queue from mumble_audio_playback_async
-		- Queues it up to be sent in mumble_audio_playback_async
+		- Queues it up to be sent and triggers "mumble_audio_send_async"
+
+	mumble_audio_send_async
+		- Ran on our main thread as soon as encoded audio is ready
+		- audio_send_event
+			* Pops every chunk of encoded audio from our send queue in order, then transmits them
 */
\ No newline at end of file
@@ -5,6 +5,9 @@
 void audio_transmission_reference(lua_State *l, AudioStream *sound);
 void audio_transmission_unreference(lua_State*l, AudioStream *sound);
 void audiostream_reset_playback_state(AudioStream *sound);
+void audio_passthrough_stop(AudioStream *sound);
+void audio_buffer_wake(MumbleClient *client);
+int resample_audio(SRC_STATE *src_state, const float *input_buffer, float *output_buffer, sf_count_t input_frames, sf_count_t output_frames, double resample_ratio, bool end_of_input);
 
 uint8_t util_set_varint_size(const uint64_t value);
 uint8_t util_set_varint(uint8_t buffer[], const uint64_t value);
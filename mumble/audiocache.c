@@ -0,0 +1,356 @@
+#include "mumble.h"
+
+#include "audio.h"
+#include "audiocache.h"
+#include "mix.h"
+#include "util.h"
+#include "log.h"
+
+#include <math.h>
+
+/*
+ * Short clips that get played over and over are decoded and resampled once, and shared by every client in the process.
+ * Clips are kept in a hash table for lookups, and a list from most to least recently used for evictions.
+ * A clip evicted while something is still playing it stays alive until the last stream lets go of it.
+ */
+
+static uv_once_t audiocache_once = UV_ONCE_INIT;
+static uv_mutex_t audiocache_mutex;
+
+static AudioClip* audiocache_buckets[AUDIO_CACHE_BUCKETS];
+static AudioClip* audiocache_head;
+static AudioClip* audiocache_tail;
+static size_t audiocache_bytes = 0;
+static size_t audiocache_count = 0;
+static size_t audiocache_capacity = AUDIO_CACHE_SIZE;
+
+static void audiocache_init(void) {
+	uv_mutex_init(&audiocache_mutex);
+}
+
+static uint32_t audiocache_hash(const char* path, int quality) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const char* c = path; *c != '\0'; c++) {
+		hash ^= (uint8_t) *c;
+		hash *= 16777619u;
+	}
+	hash ^= (uint32_t) quality;
+	hash *= 16777619u;
+	return hash;
+}
+
+static void audiocache_free(AudioClip* clip) {
+	for (int i = 0; i <= SF_STR_COMMENT; i++) {
+		free(clip->strings[i]);
+	}
+	free(clip->path);
+	free(clip->pcm);
+	free(clip);
+}
+
+static void audiocache_lru_unlink(AudioClip* clip) {
+	if (clip->prev != NULL) {
+		clip->prev->next = clip->next;
+	} else {
+		audiocache_head = clip->next;
+	}
+
+	if (clip->next != NULL) {
+		clip->next->prev = clip->prev;
+	} else {
+		audiocache_tail = clip->prev;
+	}
+
+	clip->prev = NULL;
+	clip->next = NULL;
+}
+
+static void audiocache_lru_push(AudioClip* clip) {
+	clip->prev = NULL;
+	clip->next = audiocache_head;
+
+	if (audiocache_head != NULL) {
+		audiocache_head->prev = clip;
+	} else {
+		audiocache_tail = clip;
+	}
+
+	audiocache_head = clip;
+}
+
+
+static void audiocache_insert(AudioClip* clip) {
+	AudioClip** bucket = &audiocache_buckets[clip->hash & (AUDIO_CACHE_BUCKETS - 1)];
+	clip->hash_next = *bucket;
+	*bucket = clip;
+
+	audiocache_lru_push(clip);
+	audiocache_bytes += clip->bytes;
+	audiocache_count++;
+	clip->cached = true;
+}
+
+static void audiocache_evict(AudioClip* clip) {
+	AudioClip** link = &audiocache_buckets[clip->hash & (AUDIO_CACHE_BUCKETS - 1)];
+	while (*link != NULL && *link != clip) {
+		link = &(*link)->hash_next;
+	}
+	if (*link == clip) {
+		*link = clip->hash_next;
+	}
+	clip->hash_next = NULL;
+
+	audiocache_lru_unlink(clip);
+	audiocache_bytes -= clip->bytes;
+	audiocache_count--;
+	clip->cached = false;
+
+	mumble_log(LOG_DEBUG, "evicted audio clip: %s", clip->path);
+
+	if (clip->refs == 0) {
+		audiocache_free(clip);
+	}
+}
+
+static AudioClip* audiocache_find(uint32_t hash, const char* path, int quality, const FileStamp* stamp) {
+	AudioClip* clip = audiocache_buckets[hash & (AUDIO_CACHE_BUCKETS - 1)];
+	while (clip != NULL) {
+		AudioClip* next = clip->hash_next;
+		if (clip->hash == hash && clip->quality == quality && strcmp(clip->path, path) == 0) {
+			if (file_stamp_equal(&clip->stamp, stamp)) {
+				return clip;
+			}
+			// The file changed since it was decoded, streams still playing the old audio keep it until they are done
+			audiocache_evict(clip);
+		}
+		clip = next;
+	}
+	return NULL;
+}
+
+static void audiocache_trim(size_t capacity) {
+	while (audiocache_bytes > capacity && audiocache_tail != NULL) {
+		audiocache_evict(audiocache_tail);
+	}
+}
+
+// Converts the whole file to 48 kHz stereo, replacing the samples it was given
+static float* audiocache_convert(SF_INFO* info, float* input, sf_count_t frames, int quality, sf_count_t* frames_out) {
+	float* stereo = input;
+
+	if (info->channels != AUDIO_PLAYBACK_CHANNELS) {
+		stereo = malloc(frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
+		if (stereo == NULL) {
+			free(input);
+			return NULL;
+		}
+		if (info->channels == 1) {
+			mix_mono_to_stereo(stereo, input, frames);
+		} else {
+			mix_downmix_to_stereo(stereo, input, frames, info->channels);
+		}
+		free(input);
+	}
+
+	if (info->samplerate == AUDIO_SAMPLE_RATE) {
+		*frames_out = frames;
+		return stereo;
+	}
+
+	double ratio = (double) AUDIO_SAMPLE_RATE / info->samplerate;
+	sf_count_t output_frames = (sf_count_t) ceil(frames * ratio);
+
+	float* output = malloc(output_frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float));
+
+	int error;
+	SRC_STATE* src_state = src_new(quality, AUDIO_PLAYBACK_CHANNELS, &error);
+
+	if (output == NULL || src_state == NULL) {
+		if (src_state == NULL) {
+			mumble_log(LOG_ERROR, "failed creating audio resampler: %s", src_strerror(error));
+		} else {
+			src_delete(src_state);
+		}
+		free(output);
+		free(stereo);
+		return NULL;
+	}
+
+	int resampled = resample_audio(src_state, stereo, output, frames, output_frames, ratio, true);
+	src_delete(src_state);
+	free(stereo);
+
+	if (resampled < 0) {
+		free(output);
+		return NULL;
+	}
+
+	*frames_out = resampled;
+	return output;
+}
+
+static AudioClip* audiocache_decode(const char* path, int quality, size_t capacity, const char** error) {
+	SF_INFO info;
+	memset(&info, 0, sizeof(SF_INFO));
+
+	SNDFILE* file = sf_open(path, SFM_READ, &info);
+	if (file == NULL) {
+		*error = sf_strerror(NULL);
+		return NULL;
+	}
+
+	double ratio = (double) AUDIO_SAMPLE_RATE / info.samplerate;
+	size_t bytes = (size_t) ceil(info.frames * ratio) * AUDIO_PLAYBACK_CHANNELS * sizeof(float);
+
+	if (info.frames <= 0 || bytes > capacity) {
+		// Too big to share, so it gets streamed from disk like any other file
+		sf_close(file);
+		return NULL;
+	}
+
+	AudioClip* clip = calloc(1, sizeof(AudioClip));
+	float* input = malloc(info.frames * info.channels * sizeof(float));
+	char* clip_path = strdup(path);
+
+	if (clip == NULL || input == NULL || clip_path == NULL) {
+		*error = strerror(errno);
+		sf_close(file);
+		free(clip);
+		free(input);
+		free(clip_path);
+		return NULL;
+	}
+
+	clip->path = clip_path;
+	clip->quality = quality;
+	clip->info = info;
+	clip->bytes = bytes;
+
+	for (int i = SF_STR_TITLE; i <= SF_STR_COMMENT; i++) {
+		const char* string = sf_get_string(file, i);
+		if (string != NULL) {
+			clip->strings[i] = strdup(string);
+		}
+	}
+
+	sf_count_t frames = sf_readf_float(file, input, info.frames);
+	sf_close(file);
+
+	if (frames <= 0) {
+		*error = "file contains no audio";
+		free(input);
+		audiocache_free(clip);
+		return NULL;
+	}
+
+	clip->pcm = audiocache_convert(&info, input, frames, quality, &clip->frames);
+	if (clip->pcm == NULL) {
+		*error = "failed converting audio to 48 kHz stereo";
+		audiocache_free(clip);
+		return NULL;
+	}
+
+	return clip;
+}
+
+AudioClip* mumble_audiocache_acquire(const char* path, int quality, const char** error) {
+	uv_once(&audiocache_once, audiocache_init);
+
+	*error = NULL;
+
+	FileStamp stamp;
+	int err = file_stamp(path, &stamp);
+	if (err != 0) {
+		*error = uv_strerror(err);
+		return NULL;
+	}
+
+	uint32_t hash = audiocache_hash(path, quality);
+
+	uv_mutex_lock(&audiocache_mutex);
+	AudioClip* clip = audiocache_find(hash, path, quality, &stamp);
+	if (clip != NULL) {
+		audiocache_lru_unlink(clip);
+		audiocache_lru_push(clip);
+		clip->refs++;
+		uv_mutex_unlock(&audiocache_mutex);
+		return clip;
+	}
+	size_t capacity = audiocache_capacity;
+	uv_mutex_unlock(&audiocache_mutex);
+
+	// Decode without holding the lock, so other clients can keep using the cache meanwhile
+	AudioClip* decoded = audiocache_decode(path, quality, capacity, error);
+	if (decoded == NULL) {
+		return NULL;
+	}
+	decoded->hash = hash;
+	decoded->stamp = stamp;
+
+	uv_mutex_lock(&audiocache_mutex);
+
+	// Someone else may have decoded the same clip while we were
+	clip = audiocache_find(hash, path, quality, &stamp);
+	if (clip != NULL) {
+		audiocache_lru_unlink(clip);
+		audiocache_lru_push(clip);
+		clip->refs++;
+		uv_mutex_unlock(&audiocache_mutex);
+		audiocache_free(decoded);
+		return clip;
+	}
+
+	if (decoded->bytes > audiocache_capacity) {
+		// The cache was shrunk while we were decoding
+		uv_mutex_unlock(&audiocache_mutex);
+		audiocache_free(decoded);
+		return NULL;
+	}
+
+	audiocache_trim(audiocache_capacity - decoded->bytes);
+	audiocache_insert(decoded);
+	decoded->refs = 1;
+	uv_mutex_unlock(&audiocache_mutex);
+
+	mumble_log(LOG_DEBUG, "cached audio clip: %s (%zu bytes)", path, decoded->bytes);
+	return decoded;
+}
+
+void mumble_audiocache_release(AudioClip* clip) {
+	uv_mutex_lock(&audiocache_mutex);
+	clip->refs--;
+	bool orphaned = clip->refs == 0 && !clip->cached;
+	uv_mutex_unlock(&audiocache_mutex);
+
+	if (orphaned) {
+		audiocache_free(clip);
+	}
+}
+
+void mumble_audiocache_set_capacity(size_t capacity) {
+	uv_once(&audiocache_once, audiocache_init);
+
+	uv_mutex_lock(&audiocache_mutex);
+	audiocache_capacity = capacity;
+	audiocache_trim(capacity);
+	uv_mutex_unlock(&audiocache_mutex);
+}
+
+void mumble_audiocache_clear(void) {
+	uv_once(&audiocache_once, audiocache_init);
+
+	uv_mutex_lock(&audiocache_mutex);
+	audiocache_trim(0);
+	uv_mutex_unlock(&audiocache_mutex);
+}
+
+void mumble_audiocache_stats(size_t* bytes, size_t* capacity, size_t* count) {
+	uv_once(&audiocache_once, audiocache_init);
+
+	uv_mutex_lock(&audiocache_mutex);
+	*bytes = audiocache_bytes;
+	*capacity = audiocache_capacity;
+	*count = audiocache_count;
+	uv_mutex_unlock(&audiocache_mutex);
+}
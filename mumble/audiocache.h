@@ -0,0 +1,13 @@
+#pragma once
+
+#include "types.h"
+
+// Returns a shared clip decoded to 48 kHz stereo, decoding it on a miss.
+// A miss decodes the whole file on the calling thread, clips whose file changed on disk count as a miss.
+// Returns NULL without an error when the file is too large to be cached and should be streamed instead.
+AudioClip* mumble_audiocache_acquire(const char* path, int quality, const char** error);
+void mumble_audiocache_release(AudioClip* clip);
+
+void mumble_audiocache_set_capacity(size_t capacity);
+void mumble_audiocache_clear(void);
+void mumble_audiocache_stats(size_t* bytes, size_t* capacity, size_t* count);
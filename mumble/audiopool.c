@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "mumble.h"
+
+#include "audiopool.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Every client normally runs its own playback, encode and buffer threads, which adds up quickly with a lot of bots in one process.
+ * Clients created after mumble.useSharedAudio() share a single thread that keeps everyones frame clock instead,
+ * and a fixed number of workers that run the buffer refills and encodes of every client.
+ * Tasks are handed out to the workers in turn, and a worker with nothing left in its own queue takes tasks from the others.
+ * Every Lua state that loads the module holds on to the threads, and the last one to close stops and joins them.
+ */
+
+typedef struct {
+	uv_thread_t thread;
+	uv_mutex_t mutex;
+	MumbleAudioTask* head;
+	MumbleAudioTask* tail;
+	Arena arena;
+	unsigned int index;
+} AudioPoolWorker;
+
+static uv_once_t audiopool_once = UV_ONCE_INIT;
+// Guards starting and stopping the threads, and how many Lua states use them
+static uv_mutex_t audiopool_lifecycle;
+static unsigned int audiopool_users = 0;
+static _Atomic bool audiopool_started = false;
+static bool audiopool_running = false;
+
+static uv_mutex_t audiopool_mutex;
+// Wakes the tick thread early, when the clients it keeps time for change
+static uv_cond_t audiopool_wake;
+static uv_cond_t audiopool_work;
+static uv_cond_t audiopool_done;
+
+static uv_thread_t audiopool_tick;
+static MumbleClient** audiopool_clients = NULL;
+static size_t audiopool_client_count = 0;
+static size_t audiopool_client_capacity = 0;
+
+static AudioPoolWorker* audiopool_workers = NULL;
+static unsigned int audiopool_worker_count = 0;
+static _Atomic unsigned int audiopool_next = 0;
+static uint32_t audiopool_pending = 0;
+
+static void audiopool_tick_thread(void* arg) {
+	pthread_setname_np(pthread_self(), "audio tick");
+
+	uv_mutex_lock(&audiopool_mutex);
+
+	while (audiopool_running) {
+		if (audiopool_client_count == 0) {
+			// Nothing to keep time for
+			uv_cond_wait(&audiopool_wake, &audiopool_mutex);
+			continue;
+		}
+
+		uint64_t now = uv_hrtime();
+		uint64_t next = UINT64_MAX;
+
+		for (size_t i = 0; i < audiopool_client_count; i++) {
+			uint64_t due = mumble_audio_playback_tick(audiopool_clients[i], now);
+			if (due < next) {
+				next = due;
+			}
+		}
+
+		// Sleep until the next client needs a frame, or until someone changes what that is
+		now = uv_hrtime();
+		if (next > now) {
+			uv_cond_timedwait(&audiopool_wake, &audiopool_mutex, next - now);
+		}
+	}
+
+	uv_mutex_unlock(&audiopool_mutex);
+}
+
+static MumbleAudioTask* audiopool_pop(AudioPoolWorker* worker) {
+	uv_mutex_lock(&worker->mutex);
+	MumbleAudioTask* task = worker->head;
+	if (task != NULL) {
+		worker->head = task->next;
+		if (worker->head == NULL) {
+			worker->tail = NULL;
+		}
+		task->next = NULL;
+	}
+	uv_mutex_unlock(&worker->mutex);
+	return task;
+}
+
+static void audiopool_worker_thread(void* arg) {
+	pthread_setname_np(pthread_self(), "audio worker");
+
+	AudioPoolWorker* worker = (AudioPoolWorker*) arg;
+
+	while (true) {
+		uv_mutex_lock(&audiopool_mutex);
+		while (audiopool_pending == 0 && audiopool_running) {
+			uv_cond_wait(&audiopool_work, &audiopool_mutex);
+		}
+		if (audiopool_pending == 0) {
+			// Stopping, and every task that was queued has run
+			uv_mutex_unlock(&audiopool_mutex);
+			break;
+		}
+		audiopool_pending--;
+		uv_mutex_unlock(&audiopool_mutex);
+
+		// Every pending task is already in a queue, so one of them is bound to have it
+		MumbleAudioTask* task = NULL;
+		while (task == NULL) {
+			// Our own queue first, then whoever comes after us
+			for (unsigned int i = 0; i < audiopool_worker_count && task == NULL; i++) {
+				task = audiopool_pop(&audiopool_workers[(worker->index + i) % audiopool_worker_count]);
+			}
+		}
+
+		// The task can be queued again as soon as it's running, so hold on to the client it's for
+		MumbleClient* client = task->client;
+		task->run(task, &worker->arena);
+
+		uv_mutex_lock(&audiopool_mutex);
+		if (--client->audio_tasks == 0) {
+			uv_cond_broadcast(&audiopool_done);
+		}
+		uv_mutex_unlock(&audiopool_mutex);
+	}
+}
+
+static void audiopool_init(void) {
+	uv_mutex_init(&audiopool_lifecycle);
+}
+
+bool mumble_audiopool_enable(unsigned int threads) {
+	uv_once(&audiopool_once, audiopool_init);
+	uv_mutex_lock(&audiopool_lifecycle);
+
+	if (audiopool_started) {
+		uv_mutex_unlock(&audiopool_lifecycle);
+		return false;
+	}
+
+	audiopool_workers = malloc(sizeof(AudioPoolWorker) * threads);
+	if (audiopool_workers == NULL) {
+		uv_mutex_unlock(&audiopool_lifecycle);
+		mumble_log(LOG_ERROR, "failed to allocate shared audio workers");
+		return false;
+	}
+
+	uv_mutex_init(&audiopool_mutex);
+	uv_cond_init(&audiopool_wake);
+	uv_cond_init(&audiopool_work);
+	uv_cond_init(&audiopool_done);
+
+	audiopool_worker_count = threads;
+	audiopool_running = true;
+
+	for (unsigned int i = 0; i < threads; i++) {
+		AudioPoolWorker* worker = &audiopool_workers[i];
+		uv_mutex_init(&worker->mutex);
+		worker->head = NULL;
+		worker->tail = NULL;
+		worker->index = i;
+		arena_init(&worker->arena, AUDIO_ARENA_SIZE);
+	}
+
+	for (unsigned int i = 0; i < threads; i++) {
+		uv_thread_create(&audiopool_workers[i].thread, audiopool_worker_thread, &audiopool_workers[i]);
+	}
+	uv_thread_create(&audiopool_tick, audiopool_tick_thread, NULL);
+
+	audiopool_started = true;
+	uv_mutex_unlock(&audiopool_lifecycle);
+
+	mumble_log(LOG_DEBUG, "started %u shared audio workers", threads);
+	return true;
+}
+
+static void audiopool_shutdown(void) {
+	uv_mutex_lock(&audiopool_mutex);
+	audiopool_running = false;
+	uv_cond_broadcast(&audiopool_wake);
+	uv_cond_broadcast(&audiopool_work);
+	uv_mutex_unlock(&audiopool_mutex);
+
+	uv_thread_join(&audiopool_tick);
+
+	for (unsigned int i = 0; i < audiopool_worker_count; i++) {
+		AudioPoolWorker* worker = &audiopool_workers[i];
+		uv_thread_join(&worker->thread);
+		uv_mutex_destroy(&worker->mutex);
+		arena_free(&worker->arena);
+	}
+
+	free(audiopool_workers);
+	audiopool_workers = NULL;
+	audiopool_worker_count = 0;
+
+	free(audiopool_clients);
+	audiopool_clients = NULL;
+	audiopool_client_count = 0;
+	audiopool_client_capacity = 0;
+
+	uv_cond_destroy(&audiopool_done);
+	uv_cond_destroy(&audiopool_work);
+	uv_cond_destroy(&audiopool_wake);
+	uv_mutex_destroy(&audiopool_mutex);
+
+	audiopool_started = false;
+	mumble_log(LOG_DEBUG, "stopped shared audio workers");
+}
+
+void mumble_audiopool_retain(void) {
+	uv_once(&audiopool_once, audiopool_init);
+	uv_mutex_lock(&audiopool_lifecycle);
+	audiopool_users++;
+	uv_mutex_unlock(&audiopool_lifecycle);
+}
+
+void mumble_audiopool_release(void) {
+	uv_mutex_lock(&audiopool_lifecycle);
+	if (--audiopool_users == 0 && audiopool_started) {
+		audiopool_shutdown();
+	}
+	uv_mutex_unlock(&audiopool_lifecycle);
+}
+
+bool mumble_audiopool_enabled(void) {
+	return audiopool_started;
+}
+
+unsigned int mumble_audiopool_size(void) {
+	return audiopool_worker_count;
+}
+
+void mumble_audiopool_attach(MumbleClient* client) {
+	uv_mutex_lock(&audiopool_mutex);
+
+	if (audiopool_client_count >= audiopool_client_capacity) {
+		size_t capacity = audiopool_client_capacity ? audiopool_client_capacity * 2 : 16;
+		MumbleClient** clients = realloc(audiopool_clients, capacity * sizeof(MumbleClient*));
+		if (clients == NULL) {
+			uv_mutex_unlock(&audiopool_mutex);
+			mumble_log(LOG_ERROR, "failed to add client to the shared audio clock");
+			return;
+		}
+		audiopool_clients = clients;
+		audiopool_client_capacity = capacity;
+	}
+
+	audiopool_clients[audiopool_client_count++] = client;
+	uv_cond_signal(&audiopool_wake);
+	uv_mutex_unlock(&audiopool_mutex);
+}
+
+void mumble_audiopool_detach(MumbleClient* client) {
+	uv_mutex_lock(&audiopool_mutex);
+
+	for (size_t i = 0; i < audiopool_client_count; i++) {
+		if (audiopool_clients[i] == client) {
+			audiopool_clients[i] = audiopool_clients[--audiopool_client_count];
+			break;
+		}
+	}
+	uv_cond_signal(&audiopool_wake);
+
+	// Tasks are only ever queued from the main thread, so nothing new can show up while we wait
+	while (client->audio_tasks > 0) {
+		uv_cond_wait(&audiopool_done, &audiopool_mutex);
+	}
+
+	uv_mutex_unlock(&audiopool_mutex);
+}
+
+void mumble_audiopool_set_frames(MumbleClient* client, int frames) {
+	uv_mutex_lock(&audiopool_mutex);
+
+	client->audio_frames = frames;
+
+	// Don't make a shorter frame wait out the rest of a longer one
+	uint64_t due = client->audio_playback_last + (uint64_t) frames * 1000000;
+	if (due < client->audio_playback_next) {
+		client->audio_playback_next = due;
+	}
+
+	uv_cond_signal(&audiopool_wake);
+	uv_mutex_unlock(&audiopool_mutex);
+}
+
+void mumble_audiopool_submit(MumbleAudioTask* task) {
+	AudioPoolWorker* worker = &audiopool_workers[atomic_fetch_add(&audiopool_next, 1) % audiopool_worker_count];
+
+	// Counted before it can be picked up, so the count never drops below what is still queued
+	uv_mutex_lock(&audiopool_mutex);
+	task->client->audio_tasks++;
+	uv_mutex_unlock(&audiopool_mutex);
+
+	uv_mutex_lock(&worker->mutex);
+	task->next = NULL;
+	if (worker->tail != NULL) {
+		worker->tail->next = task;
+	} else {
+		worker->head = task;
+	}
+	worker->tail = task;
+	uv_mutex_unlock(&worker->mutex);
+
+	uv_mutex_lock(&audiopool_mutex);
+	audiopool_pending++;
+	uv_cond_signal(&audiopool_work);
+	uv_mutex_unlock(&audiopool_mutex);
+}
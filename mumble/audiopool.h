@@ -0,0 +1,21 @@
+#pragma once
+
+#include "types.h"
+
+// Starts the shared audio threads, returns false if they were already started
+bool mumble_audiopool_enable(unsigned int threads);
+bool mumble_audiopool_enabled(void);
+unsigned int mumble_audiopool_size(void);
+
+// Every Lua state that loads the module holds a reference, the threads are stopped and joined once the last one lets go
+void mumble_audiopool_retain(void);
+void mumble_audiopool_release(void);
+
+// Adds the client to the shared frame clock
+void mumble_audiopool_attach(MumbleClient* client);
+// Removes the client from the shared frame clock, and waits for every task still queued or running for it
+void mumble_audiopool_detach(MumbleClient* client);
+// Changes the frame size of a client on the shared frame clock, its next frame comes early if it is now due
+void mumble_audiopool_set_frames(MumbleClient* client, int frames);
+
+void mumble_audiopool_submit(MumbleAudioTask* task);
@@ -2,6 +2,9 @@
 
 #include "audio.h"
 #include "audiostream.h"
+#include "audiocache.h"
+#include "framecache.h"
+#include "oggopus.h"
 #include "util.h"
 #include "log.h"
 
@@ -13,6 +16,12 @@ static int audiostream_isPlaying(lua_State *l) {
 	return 1;
 }
 
+static int audiostream_isPassthrough(lua_State *l) {
+	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
+	lua_pushboolean(l, sound->playing && (sound->passthrough || sound->replay != NULL));
+	return 1;
+}
+
 static int audiostream_setVolume(lua_State *l) {
 	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
 	sound->volume = luaL_checknumber(l, 2);
@@ -36,6 +45,13 @@ static int audiostream_play(lua_State *l) {
 	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
 
 	audiostream_reset_playback_state(sound);
+
+	// Frames recorded from an earlier playback that sounded exactly the same are sent instead of encoding it again
+	sound->replay = mumble_framecache_acquire(sound->client, sound);
+	if (sound->replay) {
+		sound->passthrough = false;
+	}
+
 	sound->playing = true;
 
 	// Ensure it's in the active list / registry
@@ -43,6 +59,11 @@ static int audiostream_play(lua_State *l) {
 		lua_pushvalue(l, 1);
 		audio_transmission_reference(l, sound);
 	}
+
+	// Start buffering right away, instead of waiting for the first frame to find the buffer empty
+	if (sound->file && !sound->passthrough && sound->replay == NULL) {
+		audio_buffer_wake(sound->client);
+	}
 	return 0;
 }
 
@@ -54,6 +75,26 @@ static int audiostream_stop(lua_State *l) {
 	return 0;
 }
 
+// Works like sf_seek, with offsets in frames of the original file
+static sf_count_t audiostream_clip_seek(AudioStream *sound, sf_count_t offset, int whence) {
+	AudioClip *clip = sound->clip;
+	double ratio = (double) AUDIO_SAMPLE_RATE / clip->info.samplerate;
+
+	sf_count_t position = offset;
+	if (whence == SEEK_CUR) {
+		position += (sf_count_t) (sound->clip_position / ratio);
+	} else if (whence == SEEK_END) {
+		position += clip->info.frames;
+	}
+
+	if (position < 0 || position > clip->info.frames) {
+		return -1;
+	}
+
+	sound->clip_position = (sf_count_t) (position * ratio);
+	return position;
+}
+
 static int audiostream_seek(lua_State *l) {
 	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
 
@@ -65,6 +106,16 @@ static int audiostream_seek(lua_State *l) {
 
 	sf_count_t position = 0;
 
+	// Seeking is done on the decoded stream, so stop sending the original or recorded packets
+	audio_passthrough_stop(sound);
+	sound->fresh = false;
+
+	if (sound->clip) {
+		static const int whence[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+		lua_pushinteger(l, audiostream_clip_seek(sound, offset, whence[option]));
+		return 1;
+	}
+
 	switch (option) {
 	case SET:
 		position = sf_seek(sound->file, offset, SEEK_SET);
@@ -126,33 +177,40 @@ static int audiostream_getInfo(lua_State *l) {
 	return 1;
 }
 
+static const char* audiostream_get_string(AudioStream *sound, int type) {
+	if (sound->clip) {
+		return sound->clip->strings[type];
+	}
+	return sf_get_string(sound->file, type);
+}
+
 static int audiostream_getTitle(lua_State *l) {
 	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
-	lua_pushstring(l, sf_get_string(sound->file, SF_STR_TITLE));
+	lua_pushstring(l, audiostream_get_string(sound, SF_STR_TITLE));
 	return 1;
 }
 
 static int audiostream_getArtist(lua_State *l) {
 	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
-	lua_pushstring(l, sf_get_string(sound->file, SF_STR_ARTIST));
+	lua_pushstring(l, audiostream_get_string(sound, SF_STR_ARTIST));
 	return 1;
 }
 
 static int audiostream_getCopyright(lua_State *l) {
 	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
-	lua_pushstring(l, sf_get_string(sound->file, SF_STR_COPYRIGHT));
+	lua_pushstring(l, audiostream_get_string(sound, SF_STR_COPYRIGHT));
 	return 1;
 }
 
 static int audiostream_getSoftware(lua_State *l) {
 	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
-	lua_pushstring(l, sf_get_string(sound->file, SF_STR_SOFTWARE));
+	lua_pushstring(l, audiostream_get_string(sound, SF_STR_SOFTWARE));
 	return 1;
 }
 
 static int audiostream_getComments(lua_State *l) {
 	AudioStream *sound = luaL_checkudata(l, 1, METATABLE_AUDIOSTREAM);
-	lua_pushstring(l, sf_get_string(sound->file, SF_STR_COMMENT));
+	lua_pushstring(l, audiostream_get_string(sound, SF_STR_COMMENT));
 	return 1;
 }
 
@@ -229,6 +287,20 @@ static int audiostream_gc(lua_State *l) {
 		sf_close(sound->file);
 		sound->file = NULL;
 	}
+	if (sound->opus) {
+		oggopus_close(sound->opus);
+		sound->opus = NULL;
+	}
+	if (sound->clip) {
+		mumble_audiocache_release(sound->clip);
+		sound->clip = NULL;
+	}
+	if (sound->replay) {
+		mumble_framecache_release(sound->replay);
+		sound->replay = NULL;
+	}
+	free(sound->path);
+	sound->path = NULL;
 	if (sound->buffer) {
 		free(sound->buffer);
 		sound->buffer = NULL;
@@ -247,6 +319,7 @@ static int audiostream_tostring(lua_State *l) {
 
 const luaL_Reg mumble_audiostream[] = {
 	{"isPlaying", audiostream_isPlaying},
+	{"isPassthrough", audiostream_isPassthrough},
 	{"setVolume", audiostream_setVolume},
 	{"getVolume", audiostream_getVolume},
 	{"pause", audiostream_pause},
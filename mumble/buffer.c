@@ -20,6 +20,7 @@ ByteBuffer* buffer_init(ByteBuffer* buffer, uint64_t size) {
 	buffer->write_head = 0;
 	buffer->data = malloc(sizeof(uint8_t) * size);
 	buffer->context = NULL;
+	buffer->view = false;
 	if (buffer->data == NULL) return NULL;
 	return buffer;
 }
@@ -33,7 +34,43 @@ ByteBuffer* buffer_init_data(ByteBuffer* buffer, void* data, uint64_t size) {
 	return buffer;
 }
 
+ByteBuffer* buffer_init_view(ByteBuffer* buffer, const void* data, uint64_t size) {
+	buffer->original_capacity = size;
+	buffer->capacity = size;
+	buffer->read_head = 0;
+	buffer->write_head = size;
+	buffer->data = (uint8_t*) data;
+	buffer->context = NULL;
+	buffer->view = true;
+	return buffer;
+}
+
+// Copy borrowed data into our own allocation before it gets modified
+static int buffer_detach(ByteBuffer* buffer) {
+	if (!buffer->view) {
+		return 1;
+	}
+
+	uint8_t* data = malloc(buffer->capacity > 0 ? buffer->capacity : 1);
+	if (data == NULL) {
+		mumble_log(LOG_ERROR, "%s: %p failed to copy buffer view", METATABLE_BUFFER, buffer);
+		return 0;
+	}
+
+	if (buffer->data != NULL) {
+		memcpy(data, buffer->data, buffer->capacity);
+	}
+
+	buffer->data = data;
+	buffer->view = false;
+	return 1;
+}
+
 static int buffer_adjust(ByteBuffer* buffer, uint64_t size) {
+	if (!buffer_detach(buffer)) {
+		return 0;
+	}
+
 	uint64_t new_head = buffer->write_head + size;
 	if (new_head > buffer->capacity) {
 		uint64_t grow_1_5x = buffer->capacity + (buffer->capacity >> 1); // 1.5x
@@ -51,6 +88,10 @@ static int buffer_adjust(ByteBuffer* buffer, uint64_t size) {
 }
 
 int buffer_resize(ByteBuffer* buffer, size_t new_capacity) {
+	if (!buffer_detach(buffer)) {
+		return 0;
+	}
+
 	void* new_data = realloc(buffer->data, new_capacity);
 	if (new_data != NULL) {
 		mumble_log(LOG_DEBUG, "%s: %p resizing from %llu to %llu bytes", METATABLE_BUFFER, buffer, buffer->capacity, new_capacity);
@@ -85,10 +126,11 @@ void buffer_free(ByteBuffer* buffer) {
 		buffer->context = NULL;
 	}
 
-	if (buffer->data) {
+	if (buffer->data && !buffer->view) {
 		free(buffer->data);
-		buffer->data = NULL;
 	}
+	buffer->data = NULL;
+	buffer->view = false;
 	buffer->original_capacity = 0;
 	buffer->capacity          = 0;
 	buffer->write_head        = 0;
@@ -99,7 +141,7 @@ void buffer_pack(ByteBuffer* buffer) {
 	if (buffer->read_head == buffer->write_head) {
 		// Reset the buffer if all data has been read
 		buffer_reset(buffer);
-	} else if (buffer->read_head > 0) {
+	} else if (buffer->read_head > 0 && buffer_detach(buffer)) {
 		// Move remaining data to the front of the buffer
 		uint64_t remaining = buffer->write_head - buffer->read_head;
 		memmove(buffer->data, buffer->data + buffer->read_head, remaining);
@@ -319,6 +361,16 @@ ByteBuffer* luabuffer_new(lua_State *l) {
 	return buffer;
 }
 
+const uint8_t* luabuffer_checkdata(lua_State *l, int index, size_t* len) {
+	ByteBuffer* buffer = luaL_testudata(l, index, METATABLE_BUFFER);
+	if (buffer != NULL) {
+		// Everything that hasn't been read yet
+		*len = buffer_length(buffer);
+		return buffer->data != NULL ? buffer->data + buffer->read_head : (const uint8_t*) "";
+	}
+	return (const uint8_t*) luaL_checklstring(l, index, len);
+}
+
 int mumble_buffer_new(lua_State *l) {
 	int type = lua_type(l, 2);
 
@@ -662,6 +714,22 @@ static int luabuffer_seek(lua_State *l) {
 }
 
 
+int luabuffer_copy(lua_State *l) {
+	ByteBuffer *buffer = luaL_checkudata(l, 1, METATABLE_BUFFER);
+
+	uint64_t length = buffer_length(buffer);
+
+	ByteBuffer *copy = luabuffer_new(l);
+	if (buffer_init(copy, length > 0 ? length : 1) == NULL) {
+		return luaL_error(l, "error copying buffer: %s", strerror(errno));
+	}
+
+	if (length > 0) {
+		buffer_write(copy, buffer->data + buffer->read_head, length);
+	}
+	return 1;
+}
+
 int luabuffer_len(lua_State *l) {
 	ByteBuffer *buffer = luaL_checkudata(l, 1, METATABLE_BUFFER);
 	lua_pushinteger(l, buffer_length(buffer));
@@ -749,6 +817,7 @@ const luaL_Reg mumble_buffer[] = {
 	{"readBoolean", luabuffer_readBool},
 	{"isEmpty", luabuffer_isEmpty},
 	{"seek", luabuffer_seek},
+	{"copy", luabuffer_copy},
 	{"__len", luabuffer_len},
 	{"__index", luabuffer_index},
 	{"__tostring", luabuffer_tostring},
@@ -24,6 +24,7 @@ typedef struct {
 	uint64_t write_head;
 	uint8_t* data;
 	AudioContext* context;
+	bool view; // data is borrowed and only valid until the view is released
 } ByteBuffer;
 
 #define buffer_available(buffer, size) \
@@ -50,6 +51,7 @@ uint8_t buffer_write##name(ByteBuffer* buffer, double value) { \
 ByteBuffer* buffer_new(uint64_t size);
 ByteBuffer* buffer_init(ByteBuffer* buffer, uint64_t size);
 ByteBuffer* buffer_init_data(ByteBuffer* buffer, void* data, uint64_t size);
+ByteBuffer* buffer_init_view(ByteBuffer* buffer, const void* data, uint64_t size);
 
 int buffer_resize(ByteBuffer* buffer, size_t new_capacity);
 int buffer_shrink(ByteBuffer* buffer);
@@ -83,6 +85,7 @@ uint8_t buffer_readVarInt(ByteBuffer* buffer, uint64_t* output);
 #define METATABLE_BUFFER			"mumble.buffer"
 
 ByteBuffer* luabuffer_new(lua_State *l);
+const uint8_t* luabuffer_checkdata(lua_State *l, int index, size_t* len);
 
 extern int mumble_buffer_new(lua_State *l);
 extern const luaL_Reg mumble_buffer[];
\ No newline at end of file
@@ -85,38 +85,40 @@ static int channel_getParent(lua_State *l) {
 
 static int channel_getChildren(lua_State *l) {
 	MumbleChannel *channel = luaL_checkudata(l, 1, METATABLE_CHAN);
-	LinkNode* current = channel->client->channel_list;
+	IndexMap* children = map_group_get(&channel->client->channel_children, channel->channel_id);
 
 	lua_newtable(l);
-	int i = 1;
 
-	while (current != NULL) {
-		MumbleChannel *chan = current->data;
-		if (chan->channel_id != chan->parent && chan->parent == channel->channel_id) {
+	if (children != NULL) {
+		int i = 1;
+		size_t iter = 0;
+		uint32_t channel_id;
+
+		while (map_next(children, &iter, &channel_id, NULL)) {
 			lua_pushinteger(l, i++);
-			mumble_channel_raw_get(channel->client, current->index);
+			mumble_channel_raw_get(channel->client, channel_id);
 			lua_settable(l, -3);
 		}
-		current = current->next;
 	}
 	return 1;
 }
 
 static int channel_getUsers(lua_State *l) {
 	MumbleChannel *channel = luaL_checkudata(l, 1, METATABLE_CHAN);
-	LinkNode* current = channel->client->user_list;
+	IndexMap* users = map_group_get(&channel->client->channel_users, channel->channel_id);
 
 	lua_newtable(l);
-	int i = 1;
 
-	while (current != NULL) {
-		MumbleUser *user = current->data;
-		if (user->channel_id == channel->channel_id) {
+	if (users != NULL) {
+		int i = 1;
+		size_t iter = 0;
+		uint32_t session;
+
+		while (map_next(users, &iter, &session, NULL)) {
 			lua_pushinteger(l, i++);
-			mumble_user_raw_get(channel->client, current->index);
+			mumble_user_raw_get(channel->client, session);
 			lua_settable(l, -3);
 		}
-		current = current->next;
 	}
 	return 1;
 }
@@ -382,15 +384,16 @@ int channel_call(lua_State *l) {
 			current = lua_touserdata(l, -1);
 			lua_remove(l, -2);
 		} else {
-			LinkNode* next_channel = channel->client->channel_list;
-			while (next_channel != NULL) {
-				MumbleChannel *chan = next_channel->data;
-				if (chan != NULL && chan->name != NULL
-					&& chan->channel_id != chan->parent && chan->parent == channel->channel_id
-					&& strcmp(pch, chan->name) == 0) {
-					current = chan;
+			IndexMap* children = map_group_get(&channel->client->channel_children, channel->channel_id);
+			if (children != NULL) {
+				size_t iter = 0;
+				void* value;
+				while (map_next(children, &iter, NULL, &value)) {
+					MumbleChannel *chan = value;
+					if (chan->name != NULL && strcmp(pch, chan->name) == 0) {
+						current = chan;
+					}
 				}
-				next_channel = next_channel->next;
 			}
 		}
 
@@ -2,7 +2,12 @@
 
 #include "audio.h"
 #include "audiostream.h"
+#include "audiocache.h"
+#include "audiopool.h"
+#include "framecache.h"
+#include "oggopus.h"
 #include "client.h"
+#include "mixer.h"
 #include "channel.h"
 #include "packet.h"
 #include "target.h"
@@ -258,7 +263,7 @@ static int client_transmit(lua_State *l) {
 	uint8_t codec = (uint8_t) luaL_checkinteger(l, 2);
 
 	size_t outputlen;
-	uint8_t* output = (uint8_t*) luaL_checklstring(l, 3, &outputlen);
+	uint8_t* output = (uint8_t*) luabuffer_checkdata(l, 3, &outputlen);
 
 	bool speaking = luaL_optboolean(l, 4, true);
 
@@ -336,6 +341,53 @@ static const int quality_vals[] = {
 	SRC_LINEAR
 };
 
+static AudioStream* client_new_audiostream(lua_State *l, MumbleClient *client) {
+	AudioStream *sound = lua_newuserdata(l, sizeof(AudioStream));
+	luaL_getmetatable(l, METATABLE_AUDIOSTREAM);
+	lua_setmetatable(l, -2);
+
+	sound->file = NULL;
+	sound->clip = NULL;
+	sound->clip_position = 0;
+	sound->opus = NULL;
+	sound->passthrough = false;
+	sound->path = NULL;
+	sound->quality = 0;
+	memset(&sound->stamp, 0, sizeof(FileStamp));
+	sound->replay = NULL;
+	sound->replay_packet = 0;
+	sound->replay_offset = 0;
+	sound->fresh = true;
+	atomic_store_explicit(&sound->refilling, false, memory_order_relaxed);
+	sound->refill_failed = NULL;
+	memset(&sound->info, 0, sizeof(SF_INFO));
+	sound->client = client;
+	sound->playing = false;
+	sound->looping = false;
+	sound->refrence = LUA_NOREF;
+	sound->reclaim_ref = LUA_NOREF;
+	sound->loop_count = 0;
+	sound->volume = 1.0f;
+	sound->fade_volume = 1.0f;
+	sound->fade_frames = 0;
+	sound->fade_frames_left = 0;
+	sound->fade_stop = false;
+	sound->buffer_size = 0;
+	sound->buffer = NULL;
+	sound->read_position = 0;
+	sound->write_position = 0;
+	sound->src_state = NULL;
+	sound->end = false;
+	atomic_store_explicit(&sound->used, 0, memory_order_relaxed);
+	atomic_store_explicit(&sound->head, 0, memory_order_relaxed);
+	atomic_store_explicit(&sound->tail, 0, memory_order_relaxed);
+	atomic_store_explicit(&sound->usecount, 0, memory_order_relaxed);
+	atomic_store_explicit(&sound->reclaimed, false, memory_order_relaxed);
+
+	uv_mutex_init(&sound->mutex);
+	return sound;
+}
+
 static int client_openAudio(lua_State *l) {
 	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
 	const char* filepath	= luaL_checkstring(l, 2);
@@ -357,6 +409,7 @@ static int client_openAudio(lua_State *l) {
 	float* buffer = malloc(buffer_size * sizeof(float));
 
 	if (buffer == NULL) {
+		sf_close(file);
 		lua_pushnil(l);
 		lua_pushfstring(l, "failed creating audio buffer: %s", strerror(errno));
 		return 2;
@@ -365,41 +418,60 @@ static int client_openAudio(lua_State *l) {
 	int error;
 	SRC_STATE *src_state = src_new(qualityType, AUDIO_PLAYBACK_CHANNELS, &error);
 	if (src_state == NULL) {
+		sf_close(file);
+		free(buffer);
 		lua_pushnil(l);
 		lua_pushfstring(l, "failed creating audio resampler: %s", src_strerror(error));
 		return 2;
 	}
 
-	AudioStream *sound = lua_newuserdata(l, sizeof(AudioStream));
-	luaL_getmetatable(l, METATABLE_AUDIOSTREAM);
-	lua_setmetatable(l, -2);
-
+	AudioStream *sound = client_new_audiostream(l, client);
 	sound->file = file;
 	sound->info = info;
-	sound->client = client;
-	sound->playing = false;
-	sound->looping = false;
-	sound->refrence = LUA_NOREF;
-	sound->reclaim_ref = LUA_NOREF;
-	sound->loop_count = 0;
-	sound->volume = 1.0f;
-	sound->fade_volume = 1.0f;
-	sound->fade_frames = 0;
-	sound->fade_frames_left = 0;
-	sound->fade_stop = false;
 	sound->buffer_size = buffer_size;
 	sound->buffer = buffer;
-	sound->used = 0;
-	sound->read_position = 0;
-	sound->write_position = 0;
 	sound->src_state = src_state;
-	atomic_store_explicit(&sound->used, 0, memory_order_relaxed);
-	atomic_store_explicit(&sound->head, 0, memory_order_relaxed);
-	atomic_store_explicit(&sound->tail, 0, memory_order_relaxed);
-	atomic_store_explicit(&sound->usecount, 0, memory_order_relaxed);
-	atomic_store_explicit(&sound->reclaimed, false, memory_order_relaxed);
+	sound->quality = qualityType;
 
-	uv_mutex_init(&sound->mutex);
+	// Recorded frames are only played again for the exact same file
+	if (file_stamp(filepath, &sound->stamp) == 0) {
+		sound->path = strdup(filepath);
+	}
+
+	if ((info.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_OGG) {
+		// Opus packets can be sent without decoding and encoding them again, whenever nothing needs mixing
+		sound->opus = oggopus_open(filepath);
+		sound->passthrough = sound->opus != NULL;
+	}
+	return 1;
+}
+
+static int client_openCachedAudio(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	const char* filepath	= luaL_checkstring(l, 2);
+
+	int idx = luaL_checkoption(l, 3, "medium", quality_names);
+	int qualityType = quality_vals[idx];
+
+	const char* error;
+	AudioClip *clip = mumble_audiocache_acquire(filepath, qualityType, &error);
+
+	if (clip == NULL) {
+		if (error != NULL) {
+			lua_pushnil(l);
+			lua_pushfstring(l, "failed to open audio file: %s (%s)", filepath, error);
+			return 2;
+		}
+		// Too large to keep in memory, so stream it from disk instead
+		return client_openAudio(l);
+	}
+
+	AudioStream *sound = client_new_audiostream(l, client);
+	sound->clip = clip;
+	sound->info = clip->info;
+	sound->path = strdup(filepath);
+	sound->quality = qualityType;
+	sound->stamp = clip->stamp;
 	return 1;
 }
 
@@ -433,7 +505,11 @@ static int client_setAudioPacketSize(lua_State *l) {
 		return luaL_error(l, "invalid value \"%d\" (must be one the following values: 10, 20, 40, 60)", size);
 	}
 
-	client->audio_frames = frames;
+	if (client->audio_shared) {
+		mumble_audiopool_set_frames(client, frames);
+	} else {
+		client->audio_frames = frames;
+	}
 	return 0;
 }
 
@@ -480,13 +556,18 @@ static int client_hook(lua_State *l) {
 	if (lua_isfunction(l, 3) == 0) {
 		// If the callback isn't in argument #3, assume that this is the custom hook name instead
 		hook = luaL_checkstring(l, 2);
-		name = lua_tostring(l, 3);
+		name = luaL_checkstring(l, 3);
 		funcIndex = 4;
 	}
 
 	// Check our callback argument is a function
 	luaL_checktype(l, funcIndex, LUA_TFUNCTION);
 
+	// Register the callback with the interned hook, which is what actually gets dispatched
+	if (!mumble_hook_add(l, client, mumble_hook_intern(hook), name, funcIndex)) {
+		return luaL_error(l, "failed to register callback \"%s\" for hook \"%s\"", name, hook);
+	}
+
 	// Push our reference for the hooks table
 	mumble_pushref(l, client->hooks);
 
@@ -505,6 +586,8 @@ static int client_hook(lua_State *l) {
 	lua_pushvalue(l, funcIndex);
 	lua_setfield(l, -2, name);
 
+	lua_pop(l, 2); // Pop callback table and hook table
+
 	return 0;
 }
 
@@ -537,6 +620,8 @@ static int client_unhook(lua_State *l) {
 
 	lua_pop(l, 2); // Pop callback table and hook table
 
+	mumble_hook_remove(l, client, mumble_hook_find(hook), name);
+
 	return 0;
 }
 
@@ -544,7 +629,8 @@ static int client_call(lua_State *l) {
 	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
 	const char* hook = luaL_checkstring(l, 2);
 	int nargs = lua_gettop(l) - 2;
-	return mumble_hook_call_ret(client, hook, nargs, LUA_MULTRET);
+	// A hook name that was never hooked can't have any callbacks
+	return mumble_hook_call_ret(client, mumble_hook_find(hook), nargs, LUA_MULTRET);
 }
 
 static int client_getHooks(lua_State *l) {
@@ -555,32 +641,32 @@ static int client_getHooks(lua_State *l) {
 
 static int client_getUsers(lua_State *l) {
 	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
-	LinkNode* current = client->user_list;
 
 	lua_newtable(l);
 	int i = 1;
+	size_t iter = 0;
+	uint32_t session;
 
-	while (current != NULL) {
+	while (map_next(&client->user_map, &iter, &session, NULL)) {
 		lua_pushinteger(l, i++);
-		mumble_user_raw_get(client, current->index);
+		mumble_user_raw_get(client, session);
 		lua_settable(l, -3);
-		current = current->next;
 	}
 	return 1;
 }
 
 static int client_getChannels(lua_State *l) {
 	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
-	LinkNode* current = client->channel_list;
 
 	lua_newtable(l);
 	int i = 1;
+	size_t iter = 0;
+	uint32_t channel_id;
 
-	while (current != NULL) {
+	while (map_next(&client->channel_map, &iter, &channel_id, NULL)) {
 		lua_pushinteger(l, i++);
-		mumble_channel_raw_get(client, current->index);
+		mumble_channel_raw_get(client, channel_id);
 		lua_settable(l, -3);
-		current = current->next;
 	}
 	return 1;
 }
@@ -974,6 +1060,165 @@ static int client_createAudioBuffer(lua_State *l) {
 	return 1;
 }
 
+static bool client_check_mixable(lua_State *l, MumbleClient *client) {
+	if (client->connected || client->connecting) {
+		return true;
+	}
+	lua_pushnil(l);
+	lua_pushstring(l, "not connected to a server");
+	return false;
+}
+
+static int client_mixToFile(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	const char *filepath = luaL_checkstring(l, 2);
+
+	if (!client_check_mixable(l, client)) return 2;
+
+	SF_INFO sfinfo;
+	sfinfo.samplerate = AUDIO_SAMPLE_RATE;
+	sfinfo.channels = AUDIO_PLAYBACK_CHANNELS;
+	sfinfo.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+
+	SNDFILE *outfile = sf_open(filepath, SFM_WRITE, &sfinfo);
+	if (!outfile) {
+		lua_pushnil(l);
+		lua_pushfstring(l, "error opening file \"%s\" (%s)", filepath, sf_strerror(NULL));
+		return 2;
+	}
+
+	if (!mumble_mixer_set_file(client, outfile)) {
+		sf_close(outfile);
+		lua_pushnil(l);
+		lua_pushstring(l, "could not start mixing: out of memory");
+		return 2;
+	}
+
+	mumble_update_recording_status(client);
+
+	lua_pushboolean(l, true);
+	return 1;
+}
+
+static int client_mixToPipe(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	const char *path = luaL_checkstring(l, 2);
+
+	if (!client_check_mixable(l, client)) return 2;
+
+	int err = mumble_mixer_set_pipe(client, path);
+	if (err != 0) {
+		lua_pushnil(l);
+		lua_pushfstring(l, "error opening pipe \"%s\" (%s)", path, strerror(err));
+		return 2;
+	}
+
+	mumble_update_recording_status(client);
+
+	lua_pushboolean(l, true);
+	return 1;
+}
+
+static int client_mixToBuffer(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	lua_Number seconds = luaL_optnumber(l, 2, 1);
+
+	if (seconds <= 0) {
+		return luaL_argerror(l, 2, "must be greater than 0");
+	}
+
+	if (!client_check_mixable(l, client)) return 2;
+
+	// Always room for at least one whole frame of the mix
+	size_t frames = (size_t) (seconds * AUDIO_SAMPLE_RATE);
+	if (frames < JITTER_FRAME_SIZE) {
+		frames = JITTER_FRAME_SIZE;
+	}
+	size_t limit = frames * AUDIO_PLAYBACK_CHANNELS * sizeof(float);
+
+	ByteBuffer* buffer = luabuffer_new(l);
+	if (buffer_init(buffer, limit) == NULL) {
+		return luaL_error(l, "error creating buffer: %s", strerror(errno));
+	}
+
+	// Keep it alive while we write into it
+	lua_pushvalue(l, -1);
+	mumble_mixer_set_buffer(client, buffer, mumble_ref(l), limit);
+
+	mumble_update_recording_status(client);
+	return 1;
+}
+
+static int client_stopMix(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	bool mixing = mumble_mixer_active(client);
+	mumble_mixer_stop(client);
+	mumble_update_recording_status(client);
+	lua_pushboolean(l, mixing);
+	return 1;
+}
+
+static int client_isMixing(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	lua_pushboolean(l, mumble_mixer_active(client));
+	return 1;
+}
+
+static int client_setFrameCacheSize(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	lua_Integer bytes = luaL_checkinteger(l, 2);
+	if (bytes < 0) {
+		return luaL_argerror(l, 2, "must not be negative");
+	}
+	mumble_framecache_set_capacity(client, (size_t) bytes);
+	return 0;
+}
+
+static int client_getFrameCacheSize(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	lua_pushinteger(l, client->frame_cache_bytes);
+	lua_pushinteger(l, client->frame_cache_capacity);
+	lua_pushinteger(l, client->frame_cache_count);
+	return 3;
+}
+
+static int client_clearFrameCache(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	mumble_framecache_clear(client);
+	return 0;
+}
+
+static int client_saveFrameCache(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	const char* path = luaL_checkstring(l, 2);
+
+	const char* error;
+	if (!mumble_framecache_save(client, path, &error)) {
+		lua_pushnil(l);
+		lua_pushfstring(l, "failed to save frame cache: %s (%s)", path, error);
+		return 2;
+	}
+
+	lua_pushboolean(l, true);
+	return 1;
+}
+
+static int client_loadFrameCache(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	const char* path = luaL_checkstring(l, 2);
+
+	const char* error;
+	int count = mumble_framecache_load(client, path, &error);
+	if (count < 0) {
+		lua_pushnil(l);
+		lua_pushfstring(l, "failed to load frame cache: %s (%s)", path, error);
+		return 2;
+	}
+
+	lua_pushinteger(l, count);
+	return 1;
+}
+
 static int client_getMe(lua_State *l) {
 	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
 	mumble_user_raw_get(client, client->session);
@@ -992,17 +1237,34 @@ static int client_isLegacy(lua_State *l) {
 	return 1;
 }
 
+static int client_getSendQueueSize(lua_State *l) {
+	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
+	lua_pushinteger(l, client->tcp_send_length - client->tcp_send_offset);
+	lua_pushboolean(l, client->tcp_send_full);
+	return 2;
+}
+
 static int client_gc(lua_State *l) {
 	MumbleClient *client = luaL_checkudata(l, 1, METATABLE_CLIENT);
 	mumble_log(LOG_DEBUG, "%s: %p garbage collected", METATABLE_CLIENT, client);
 
 	mumble_disconnect(client, "garbage collected", true);
 
+	// Not freed on disconnect, since a hook can disconnect us while a message is still being handled
+	arena_free(&client->message_arena);
+
+	mumble_hook_clear(l, client);
 	mumble_unref(l, &client->hooks);
 	mumble_unref(l, &client->users);
 	mumble_unref(l, &client->channels);
 	mumble_unref(l, &client->audio_streams);
 	mumble_unref(l, &client->encoder_ref);
+	mumble_unref(l, &client->speak_event_ref);
+	mumble_unref(l, &client->jitter_pcm_ref);
+	mumble_unref(l, &client->mix_buffer_ref);
+
+	// Streams still replaying recorded frames keep them until they are collected too
+	mumble_framecache_clear(client);
 	return 0;
 }
 
@@ -1049,6 +1311,7 @@ const luaL_Reg mumble_client[] = {
 	{"sendPluginData", client_sendPluginData},
 	{"transmit", client_transmit},
 	{"openAudio", client_openAudio},
+	{"openCachedAudio", client_openCachedAudio},
 	{"getAudioStreams", client_getAudioStreams},
 	{"setAudioPacketSize", client_setAudioPacketSize},
 	{"getAudioPacketSize", client_getAudioPacketSize},
@@ -1076,10 +1339,21 @@ const luaL_Reg mumble_client[] = {
 	{"requestDescriptionBlob", client_requestDescriptionBlob},
 	{"createChannel", client_createChannel},
 	{"createAudioBuffer", client_createAudioBuffer},
+	{"mixToFile", client_mixToFile},
+	{"mixToPipe", client_mixToPipe},
+	{"mixToBuffer", client_mixToBuffer},
+	{"stopMix", client_stopMix},
+	{"isMixing", client_isMixing},
+	{"setFrameCacheSize", client_setFrameCacheSize},
+	{"getFrameCacheSize", client_getFrameCacheSize},
+	{"clearFrameCache", client_clearFrameCache},
+	{"saveFrameCache", client_saveFrameCache},
+	{"loadFrameCache", client_loadFrameCache},
 	{"getMe", client_getMe},
 	{"getSelf", client_getMe},
 	{"isTunnelingUDP", client_isTunnelingUDP},
 	{"isLegacy", client_isLegacy},
+	{"getSendQueueSize", client_getSendQueueSize},
 	{"__gc", client_gc},
 	{"__tostring", client_tostring},
 	{"__index", client_index},
@@ -1,5 +1,6 @@
 #include "mumble.h"
 
+#include "buffer.h"
 #include "decoder.h"
 #include "util.h"
 #include "log.h"
@@ -119,7 +120,7 @@ static int decoder_decode(lua_State *l) {
 	MumbleOpusDecoder *wrapper = luaL_checkudata(l, 1, METATABLE_DECODER);
 
 	size_t encoded_len;
-	const unsigned char* encoded = (unsigned char*) luaL_checklstring(l, 2, &encoded_len);
+	const unsigned char* encoded = luabuffer_checkdata(l, 2, &encoded_len);
 
 	// samples per channel from packet
 	int samples_per_channel = opus_decoder_get_nb_samples(wrapper->decoder, encoded, encoded_len);
@@ -158,7 +159,7 @@ static int decoder_decode_float(lua_State *l) {
 	MumbleOpusDecoder *wrapper = luaL_checkudata(l, 1, METATABLE_DECODER);
 
 	size_t encoded_len;
-	const unsigned char* encoded = (const unsigned char*) luaL_checklstring(l, 2, &encoded_len);
+	const unsigned char* encoded = luabuffer_checkdata(l, 2, &encoded_len);
 
 	int samples_per_channel = opus_decoder_get_nb_samples(wrapper->decoder, encoded, encoded_len);
 	if (samples_per_channel <= 0) {
@@ -190,7 +191,7 @@ static int decoder_getNumSamples(lua_State *l) {
 	MumbleOpusDecoder *wrapper = luaL_checkudata(l, 1, METATABLE_DECODER);
 
 	size_t encoded_len;
-	const unsigned char* encoded = (unsigned char*) luaL_checklstring(l, 2, &encoded_len);
+	const unsigned char* encoded = luabuffer_checkdata(l, 2, &encoded_len);
 
 	int samples = opus_decoder_get_nb_samples(wrapper->decoder, encoded, encoded_len) * wrapper->channels;
 
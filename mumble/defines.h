@@ -50,6 +50,61 @@
 
 #define PAYLOAD_SIZE_MAX (1024 * 8 - 1)
 
+// How many audio frames can be waiting to be encoded or sent before we fall back to allocating more
+#define AUDIO_WORK_POOL_SIZE 4
+
+// How many audio frames can be waiting to be encoded or sent before new frames are dropped
+// Must be a power of two
+#define AUDIO_QUEUE_SIZE 16
+
+// Starting size of the scratch memory used to convert and resample audio each frame
+#define AUDIO_ARENA_SIZE (3 * PCM_BUFFER * sizeof(float))
+
+// Starting size of the scratch memory server messages are unpacked into
+#define MESSAGE_ARENA_SIZE (16 * 1024)
+
+// How many bytes of decoded audio clips are kept in memory, shared by every client in the process
+#define AUDIO_CACHE_SIZE (64 * 1024 * 1024)
+
+// How many hash buckets the audio clip cache uses to look up clips
+// Must be a power of two
+#define AUDIO_CACHE_BUCKETS 256
+
+// How many hash buckets each clients encoded frame cache uses to look up recordings
+// Must be a power of two
+#define FRAME_CACHE_BUCKETS 64
+
+// How many threads decode and resample audio files ahead of time for each client
+#define AUDIO_BUFFER_THREADS 2
+
+// How many threads decode and write user recordings for each client
+#define AUDIO_RECORD_THREADS 2
+
+// How many pending recording jobs each recording thread can hold
+// Must be a power of two
+#define AUDIO_RECORD_QUEUE_SIZE 1024
+
+// The largest opus packet we can decode is 120ms
+#define AUDIO_RECORD_MAX_FRAMES (120 * AUDIO_SAMPLE_RATE / 1000)
+
+// Received voice is played out of each users jitter buffer in steps of this many milliseconds
+// Mumble counts voice sequence numbers in the same 10ms frames
+#define JITTER_FRAME_MS 10
+#define JITTER_FRAME_SIZE (JITTER_FRAME_MS * AUDIO_SAMPLE_RATE / 1000)
+
+// How many frames a jitter buffer can hold, must be a power of two
+#define JITTER_SLOTS 64
+
+// Bounds for how many frames are buffered before a talk spurt starts playing
+#define JITTER_MIN_DEPTH 2
+#define JITTER_MAX_DEPTH 20
+
+// How many frames in a row are concealed before a user that stopped sending is considered done talking
+#define JITTER_MAX_CONCEAL 20
+
+// Recording jobs holding up to one frame of audio are reused instead of allocated every time
+#define AUDIO_RECORD_JOB_SIZE (JITTER_FRAME_SIZE * AUDIO_PLAYBACK_CHANNELS * sizeof(float))
+
 #define PING_TIME 30000
 
 // How big a protobuf packet header is
@@ -57,11 +112,35 @@
 // 4 bytes for message length
 #define PACKET_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint32_t))
 
+// Starting size of the buffer TLS data is read into, grows to fit larger packets
+#define TCP_RECV_BUFFER_SIZE (64 * 1024)
+
+// Starting size of the buffer outgoing packets are packed into, grows as needed
+#define TCP_SEND_BUFFER_SIZE (16 * 1024)
+
+// How many bytes can be waiting to be written before "OnSendQueueFull" is called
+#define TCP_SEND_HIGH_WATER (1024 * 1024)
+
 // How many dropped UDP pings will result in falling back to TCP tunnel
 #define UDP_TCP_FALLBACK 2
 
 #define UDP_BUFFER_MAX 1024
 
+// Encrypted datagrams up to this size reuse a pooled send buffer
+#define UDP_SEND_BUFFER_SIZE 1500
+
+// How many send buffers each client keeps around for reuse
+#define UDP_SEND_POOL_SIZE 32
+
+// How many datagrams are queued up before they are flushed to the socket in one go
+#define UDP_SEND_BATCH 32
+
+// libuv hands out one maximum sized datagram slot per packet when reading with recvmmsg
+#define UDP_RECV_DATAGRAM_SIZE (64 * 1024)
+
+// How many datagrams can be read from the socket with a single recvmmsg call
+#define UDP_RECV_DATAGRAMS 8
+
 #define LEGACY_UDP_CELT_ALPHA 0
 #define LEGACY_PROTO_UDP_PING 1
 #define LEGACY_UDP_SPEEX 2
@@ -0,0 +1,598 @@
+#include "mumble.h"
+
+#include "framecache.h"
+#include "util.h"
+#include "log.h"
+
+/*
+ * Playing the same clip on its own, at the same volume, bitrate and frame size, encodes to the same opus packets every time.
+ * When a client has room in its frame cache, a solo playback from the start of a stream is recorded packet by packet as
+ * it is sent, and later playbacks that would encode exactly the same way send the recorded packets instead.
+ * Recordings are looked up by path and resample quality, and only reused while the file still has the size and modification time it was recorded from.
+ * Everything here runs on the main thread, so the cache belongs to a single client and needs no locking.
+ */
+
+#define FRAME_CACHE_MAGIC "MFC"
+#define FRAME_CACHE_VERSION 2
+
+static uint32_t framecache_hash(const char* path, int quality) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const char* c = path; *c != '\0'; c++) {
+		hash ^= (uint8_t) *c;
+		hash *= 16777619u;
+	}
+	hash ^= (uint32_t) quality;
+	hash *= 16777619u;
+	return hash;
+}
+
+static opus_int32 framecache_bitrate(MumbleClient* client) {
+	opus_int32 bitrate = 0;
+	opus_encoder_ctl(client->encoder, OPUS_GET_BITRATE(&bitrate));
+	return bitrate;
+}
+
+static uint32_t framecache_frame_size(MumbleClient* client) {
+	return client->audio_frames * AUDIO_SAMPLE_RATE / 1000;
+}
+
+static void framecache_free(EncodedClip* frames) {
+	free(frames->path);
+	free(frames->data);
+	free(frames->lengths);
+	free(frames);
+}
+
+static EncodedClip* framecache_new(const char* path, int quality) {
+	EncodedClip* frames = calloc(1, sizeof(EncodedClip));
+	if (frames == NULL) {
+		return NULL;
+	}
+
+	frames->path = strdup(path);
+	if (frames->path == NULL) {
+		free(frames);
+		return NULL;
+	}
+
+	frames->quality = quality;
+	frames->hash = framecache_hash(path, quality);
+	frames->bytes = sizeof(EncodedClip) + strlen(path) + 1;
+	return frames;
+}
+
+static bool framecache_append(EncodedClip* frames, const uint8_t* packet, uint16_t length) {
+	if (frames->packets >= frames->packets_capacity) {
+		uint32_t capacity = frames->packets_capacity ? frames->packets_capacity * 2 : 64;
+		uint16_t* lengths = realloc(frames->lengths, capacity * sizeof(uint16_t));
+		if (lengths == NULL) {
+			return false;
+		}
+		frames->lengths = lengths;
+		frames->packets_capacity = capacity;
+	}
+
+	if (frames->data_length + length > frames->data_capacity) {
+		size_t capacity = frames->data_capacity ? frames->data_capacity * 2 : 4096;
+		while (capacity < frames->data_length + length) {
+			capacity *= 2;
+		}
+		uint8_t* data = realloc(frames->data, capacity);
+		if (data == NULL) {
+			return false;
+		}
+		frames->data = data;
+		frames->data_capacity = capacity;
+	}
+
+	memcpy(frames->data + frames->data_length, packet, length);
+	frames->data_length += length;
+	frames->lengths[frames->packets++] = length;
+	frames->bytes += sizeof(uint16_t) + length;
+	return true;
+}
+
+static void framecache_unlink(MumbleClient* client, EncodedClip* frames) {
+	if (frames->prev != NULL) {
+		frames->prev->next = frames->next;
+	} else {
+		client->frame_cache_head = frames->next;
+	}
+
+	if (frames->next != NULL) {
+		frames->next->prev = frames->prev;
+	} else {
+		client->frame_cache_tail = frames->prev;
+	}
+
+	frames->prev = NULL;
+	frames->next = NULL;
+}
+
+static void framecache_push(MumbleClient* client, EncodedClip* frames) {
+	frames->prev = NULL;
+	frames->next = client->frame_cache_head;
+
+	if (client->frame_cache_head != NULL) {
+		client->frame_cache_head->prev = frames;
+	} else {
+		client->frame_cache_tail = frames;
+	}
+
+	client->frame_cache_head = frames;
+}
+
+static void framecache_remove(MumbleClient* client, EncodedClip* frames) {
+	EncodedClip** link = &client->frame_cache_buckets[frames->hash & (FRAME_CACHE_BUCKETS - 1)];
+	while (*link != NULL && *link != frames) {
+		link = &(*link)->hash_next;
+	}
+	if (*link == frames) {
+		*link = frames->hash_next;
+	}
+	frames->hash_next = NULL;
+
+	framecache_unlink(client, frames);
+	client->frame_cache_bytes -= frames->bytes;
+	client->frame_cache_count--;
+	frames->cached = false;
+
+	// Streams still replaying it hold on to it until they are done
+	if (frames->refs == 0) {
+		framecache_free(frames);
+	}
+}
+
+static void framecache_evict(MumbleClient* client, size_t needed) {
+	while (client->frame_cache_tail != NULL && client->frame_cache_bytes + needed > client->frame_cache_capacity) {
+		framecache_remove(client, client->frame_cache_tail);
+	}
+}
+
+// Returns the recording made with the same settings from any version of the file, when stamp is NULL
+static EncodedClip* framecache_find(MumbleClient* client, const char* path, int quality, const FileStamp* stamp, float volume, opus_int32 bitrate, uint32_t frame_size) {
+	uint32_t hash = framecache_hash(path, quality);
+
+	for (EncodedClip* frames = client->frame_cache_buckets[hash & (FRAME_CACHE_BUCKETS - 1)]; frames != NULL; frames = frames->hash_next) {
+		if (frames->hash == hash && frames->quality == quality && frames->volume == volume &&
+		    frames->bitrate == bitrate && frames->frame_size == frame_size && strcmp(frames->path, path) == 0 &&
+		    (stamp == NULL || file_stamp_equal(&frames->stamp, stamp))) {
+			return frames;
+		}
+	}
+	return NULL;
+}
+
+static void framecache_insert(MumbleClient* client, EncodedClip* frames) {
+	// A recording of an older version of the file is replaced, not kept next to it
+	EncodedClip* existing = framecache_find(client, frames->path, frames->quality, NULL, frames->volume, frames->bitrate, frames->frame_size);
+	if (existing != NULL) {
+		framecache_remove(client, existing);
+	}
+
+	if (frames->bytes > client->frame_cache_capacity) {
+		framecache_free(frames);
+		return;
+	}
+
+	framecache_evict(client, frames->bytes);
+
+	EncodedClip** bucket = &client->frame_cache_buckets[frames->hash & (FRAME_CACHE_BUCKETS - 1)];
+	frames->hash_next = *bucket;
+	*bucket = frames;
+
+	framecache_push(client, frames);
+	frames->cached = true;
+	client->frame_cache_bytes += frames->bytes;
+	client->frame_cache_count++;
+}
+
+void mumble_framecache_init(MumbleClient* client) {
+	memset(client->frame_cache_buckets, 0, sizeof(client->frame_cache_buckets));
+	client->frame_cache_head = NULL;
+	client->frame_cache_tail = NULL;
+	client->frame_cache_bytes = 0;
+	client->frame_cache_count = 0;
+	client->frame_cache_capacity = 0;
+	client->frame_recording = NULL;
+	client->frame_recording_stream = NULL;
+	client->frame_recording_id = 0;
+	client->frame_recording_pending = 0;
+	client->frame_recording_finishing = false;
+	client->frame_recording_sealed = false;
+}
+
+EncodedClip* mumble_framecache_acquire(MumbleClient* client, AudioStream* sound) {
+	if (client->frame_cache_capacity == 0 || sound->path == NULL) {
+		return NULL;
+	}
+
+	EncodedClip* frames = framecache_find(client, sound->path, sound->quality, &sound->stamp, sound->volume * client->volume,
+	                                      framecache_bitrate(client), framecache_frame_size(client));
+	if (frames == NULL) {
+		return NULL;
+	}
+
+	// Move it to the front of the list, since it was just used
+	framecache_unlink(client, frames);
+	framecache_push(client, frames);
+
+	frames->refs++;
+	return frames;
+}
+
+void mumble_framecache_release(EncodedClip* frames) {
+	if (--frames->refs == 0 && !frames->cached) {
+		framecache_free(frames);
+	}
+}
+
+bool mumble_framecache_matches(MumbleClient* client, EncodedClip* frames, AudioStream* sound) {
+	return frames->volume == sound->volume * client->volume &&
+	       frames->frame_size == framecache_frame_size(client) &&
+	       frames->bitrate == framecache_bitrate(client);
+}
+
+void mumble_framecache_set_capacity(MumbleClient* client, size_t capacity) {
+	client->frame_cache_capacity = capacity;
+	framecache_evict(client, 0);
+
+	if (capacity == 0) {
+		mumble_framecache_record_abort(client);
+	}
+}
+
+void mumble_framecache_clear(MumbleClient* client) {
+	while (client->frame_cache_head != NULL) {
+		framecache_remove(client, client->frame_cache_head);
+	}
+	mumble_framecache_record_abort(client);
+}
+
+static void framecache_record_complete(MumbleClient* client) {
+	EncodedClip* frames = client->frame_recording;
+	AudioStream* sound = client->frame_recording_stream;
+
+	client->frame_recording = NULL;
+	client->frame_recording_stream = NULL;
+	client->frame_recording_finishing = false;
+	client->frame_recording_sealed = false;
+
+	if (frames->packets == 0) {
+		framecache_free(frames);
+		return;
+	}
+
+	mumble_log(LOG_DEBUG, "%p: recorded %u encoded frames of %s for the frame cache", sound, frames->packets, frames->path);
+	framecache_insert(client, frames);
+}
+
+void mumble_framecache_record_abort(MumbleClient* client) {
+	if (client->frame_recording == NULL) {
+		return;
+	}
+
+	// Frames still on their way to being sent no longer match the recording id, so they are ignored
+	framecache_free(client->frame_recording);
+	client->frame_recording = NULL;
+	client->frame_recording_stream = NULL;
+	client->frame_recording_pending = 0;
+	client->frame_recording_finishing = false;
+	client->frame_recording_sealed = false;
+}
+
+void mumble_framecache_record_begin(MumbleClient* client, AudioStream* solo) {
+	if (client->frame_recording != NULL) {
+		if (client->frame_recording_sealed) {
+			// Waiting on the last frames to be encoded
+			return;
+		}
+
+		if (solo != client->frame_recording_stream || !mumble_framecache_matches(client, client->frame_recording, solo)) {
+			// Something else is being mixed in, so it wouldn't sound the same anymore
+			mumble_framecache_record_abort(client);
+		}
+		return;
+	}
+
+	// Only playbacks from the very start, that nothing is mixed into, are worth recording
+	if (client->frame_cache_capacity == 0 || solo == NULL || !solo->fresh || solo->path == NULL || solo->replay != NULL) {
+		return;
+	}
+
+	float volume = solo->volume * client->volume;
+	opus_int32 bitrate = framecache_bitrate(client);
+	uint32_t frame_size = framecache_frame_size(client);
+
+	if (framecache_find(client, solo->path, solo->quality, &solo->stamp, volume, bitrate, frame_size) != NULL) {
+		return;
+	}
+
+	EncodedClip* frames = framecache_new(solo->path, solo->quality);
+	if (frames == NULL) {
+		mumble_log(LOG_WARN, "failed to start recording encoded frames: %s", strerror(errno));
+		return;
+	}
+
+	frames->stamp = solo->stamp;
+	frames->volume = volume;
+	frames->bitrate = bitrate;
+	frames->frame_size = frame_size;
+
+	if (++client->frame_recording_id == 0) {
+		// Zero means a frame isn't being recorded
+		client->frame_recording_id++;
+	}
+
+	client->frame_recording = frames;
+	client->frame_recording_stream = solo;
+	client->frame_recording_pending = 0;
+	client->frame_recording_finishing = false;
+	client->frame_recording_sealed = false;
+}
+
+void mumble_framecache_record_end(MumbleClient* client, sf_count_t read, sf_count_t frame_size) {
+	if (client->frame_recording == NULL || client->frame_recording_sealed) {
+		return;
+	}
+
+	if (client->frame_recording_finishing) {
+		// Nothing more belongs to the recording, it's complete once the frames already queued are encoded
+		client->frame_recording_sealed = true;
+		if (client->frame_recording_pending == 0) {
+			framecache_record_complete(client);
+		}
+	} else if (read > 0 && read < frame_size) {
+		// The stream couldn't keep up, so this frame was padded with silence
+		mumble_framecache_record_abort(client);
+	}
+}
+
+void mumble_framecache_record_finish(MumbleClient* client, AudioStream* sound) {
+	if (client->frame_recording != NULL && !client->frame_recording_sealed && client->frame_recording_stream == sound) {
+		client->frame_recording_finishing = true;
+	}
+}
+
+uint32_t mumble_framecache_record_tag(MumbleClient* client) {
+	if (client->frame_recording == NULL || client->frame_recording_sealed) {
+		return 0;
+	}
+
+	client->frame_recording_pending++;
+	return client->frame_recording_id;
+}
+
+void mumble_framecache_record_packet(MumbleClient* client, audio_work_t* work) {
+	EncodedClip* frames = client->frame_recording;
+
+	if (frames == NULL || work->record != client->frame_recording_id) {
+		return;
+	}
+
+	client->frame_recording_pending--;
+
+	if (work->encoded_len <= 0 || !framecache_append(frames, work->encoded, (uint16_t) work->encoded_len)) {
+		mumble_framecache_record_abort(client);
+		return;
+	}
+
+	if (frames->bytes > client->frame_cache_capacity) {
+		// Would never fit, so don't bother with the rest of it
+		mumble_log(LOG_DEBUG, "%s is too large for the frame cache, no longer recording it", frames->path);
+		mumble_framecache_record_abort(client);
+		return;
+	}
+
+	if (client->frame_recording_sealed && client->frame_recording_pending == 0) {
+		framecache_record_complete(client);
+	}
+}
+
+/*
+ * Saved caches are a magic and version, followed by every recording from least to most recently used:
+ * u16 path length, path, u64 file size, i64 file modification time in nanoseconds,
+ * u8 quality, f32 volume, u32 bitrate, u32 frame size, u32 packet count,
+ * a u16 length for every packet, then the packets back to back. Numbers are little endian.
+ */
+
+static void framecache_write_u16(FILE* file, uint16_t value) {
+	uint8_t bytes[2] = {value & 0xFF, value >> 8};
+	fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+static void framecache_write_u32(FILE* file, uint32_t value) {
+	uint8_t bytes[4] = {value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24};
+	fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+static void framecache_write_u64(FILE* file, uint64_t value) {
+	framecache_write_u32(file, (uint32_t) value);
+	framecache_write_u32(file, (uint32_t) (value >> 32));
+}
+
+static bool framecache_read_u16(FILE* file, uint16_t* value) {
+	uint8_t bytes[2];
+	if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+		return false;
+	}
+	*value = bytes[0] | (bytes[1] << 8);
+	return true;
+}
+
+static bool framecache_read_u32(FILE* file, uint32_t* value) {
+	uint8_t bytes[4];
+	if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+		return false;
+	}
+	*value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+	return true;
+}
+
+static bool framecache_read_u64(FILE* file, uint64_t* value) {
+	uint32_t low, high;
+	if (!framecache_read_u32(file, &low) || !framecache_read_u32(file, &high)) {
+		return false;
+	}
+	*value = low | ((uint64_t) high << 32);
+	return true;
+}
+
+bool mumble_framecache_save(MumbleClient* client, const char* path, const char** error) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		*error = strerror(errno);
+		return false;
+	}
+
+	fwrite(FRAME_CACHE_MAGIC, 1, strlen(FRAME_CACHE_MAGIC), file);
+	fputc(FRAME_CACHE_VERSION, file);
+
+	for (EncodedClip* frames = client->frame_cache_tail; frames != NULL; frames = frames->prev) {
+		size_t path_length = strlen(frames->path);
+		if (path_length > UINT16_MAX) {
+			continue;
+		}
+
+		uint32_t volume;
+		memcpy(&volume, &frames->volume, sizeof(volume));
+
+		framecache_write_u16(file, (uint16_t) path_length);
+		fwrite(frames->path, 1, path_length, file);
+		framecache_write_u64(file, frames->stamp.size);
+		framecache_write_u64(file, (uint64_t) frames->stamp.mtime);
+		fputc(frames->quality, file);
+		framecache_write_u32(file, volume);
+		framecache_write_u32(file, (uint32_t) frames->bitrate);
+		framecache_write_u32(file, frames->frame_size);
+		framecache_write_u32(file, frames->packets);
+		for (uint32_t i = 0; i < frames->packets; i++) {
+			framecache_write_u16(file, frames->lengths[i]);
+		}
+		fwrite(frames->data, 1, frames->data_length, file);
+	}
+
+	bool failed = ferror(file) != 0;
+	if (fclose(file) != 0 || failed) {
+		*error = strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+// Reads one saved recording, returns NULL at the end of the file or on an error
+static EncodedClip* framecache_read(FILE* file, const char** error) {
+	uint16_t path_length;
+	if (!framecache_read_u16(file, &path_length)) {
+		if (!feof(file)) {
+			*error = strerror(errno);
+		}
+		return NULL;
+	}
+
+	*error = "truncated or corrupt frame cache file";
+
+	char path[UINT16_MAX + 1];
+	if (path_length == 0 || fread(path, 1, path_length, file) != path_length) {
+		return NULL;
+	}
+	path[path_length] = '\0';
+
+	uint64_t size, mtime;
+	if (!framecache_read_u64(file, &size) || !framecache_read_u64(file, &mtime)) {
+		return NULL;
+	}
+
+	int quality = fgetc(file);
+	uint32_t volume, bitrate, frame_size, packets;
+	if (quality == EOF || !framecache_read_u32(file, &volume) || !framecache_read_u32(file, &bitrate) ||
+	    !framecache_read_u32(file, &frame_size) || !framecache_read_u32(file, &packets)) {
+		return NULL;
+	}
+
+	if (frame_size == 0 || frame_size > MAX_PCM_FRAMES || packets == 0) {
+		return NULL;
+	}
+
+	EncodedClip* frames = framecache_new(path, quality);
+	if (frames == NULL) {
+		*error = strerror(errno);
+		return NULL;
+	}
+
+	frames->stamp.size = size;
+	frames->stamp.mtime = (int64_t) mtime;
+	memcpy(&frames->volume, &volume, sizeof(volume));
+	frames->bitrate = (opus_int32) bitrate;
+	frames->frame_size = frame_size;
+
+	frames->lengths = malloc(packets * sizeof(uint16_t));
+	if (frames->lengths == NULL) {
+		*error = strerror(errno);
+		framecache_free(frames);
+		return NULL;
+	}
+	frames->packets = packets;
+	frames->packets_capacity = packets;
+
+	for (uint32_t i = 0; i < packets; i++) {
+		if (!framecache_read_u16(file, &frames->lengths[i]) || frames->lengths[i] == 0 || frames->lengths[i] > PAYLOAD_SIZE_MAX) {
+			framecache_free(frames);
+			return NULL;
+		}
+		frames->data_length += frames->lengths[i];
+	}
+
+	frames->data = malloc(frames->data_length);
+	if (frames->data == NULL) {
+		*error = strerror(errno);
+		framecache_free(frames);
+		return NULL;
+	}
+	frames->data_capacity = frames->data_length;
+
+	if (fread(frames->data, 1, frames->data_length, file) != frames->data_length) {
+		framecache_free(frames);
+		return NULL;
+	}
+
+	frames->bytes += packets * sizeof(uint16_t) + frames->data_length;
+	*error = NULL;
+	return frames;
+}
+
+int mumble_framecache_load(MumbleClient* client, const char* path, const char** error) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		*error = strerror(errno);
+		return -1;
+	}
+
+	char magic[sizeof(FRAME_CACHE_MAGIC)];
+	size_t magic_length = strlen(FRAME_CACHE_MAGIC);
+	if (fread(magic, 1, magic_length, file) != magic_length || memcmp(magic, FRAME_CACHE_MAGIC, magic_length) != 0) {
+		fclose(file);
+		*error = "not a frame cache file";
+		return -1;
+	}
+
+	if (fgetc(file) != FRAME_CACHE_VERSION) {
+		// Older files don't say which version of each audio file was recorded, so they can't be trusted
+		fclose(file);
+		*error = "unsupported frame cache version";
+		return -1;
+	}
+
+	int count = 0;
+	*error = NULL;
+
+	EncodedClip* frames;
+	while ((frames = framecache_read(file, error)) != NULL) {
+		framecache_insert(client, frames);
+		count++;
+	}
+
+	fclose(file);
+	return *error != NULL ? -1 : count;
+}
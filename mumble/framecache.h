@@ -0,0 +1,30 @@
+#pragma once
+
+#include "types.h"
+
+void mumble_framecache_init(MumbleClient* client);
+
+// Returns the frames recorded for the stream as it would be encoded right now, or NULL
+EncodedClip* mumble_framecache_acquire(MumbleClient* client, AudioStream* sound);
+void mumble_framecache_release(EncodedClip* frames);
+
+// Returns if the recorded frames still sound exactly like encoding the stream would
+bool mumble_framecache_matches(MumbleClient* client, EncodedClip* frames, AudioStream* sound);
+
+void mumble_framecache_set_capacity(MumbleClient* client, size_t capacity);
+void mumble_framecache_clear(MumbleClient* client);
+
+bool mumble_framecache_save(MumbleClient* client, const char* path, const char** error);
+int mumble_framecache_load(MumbleClient* client, const char* path, const char** error);
+
+// Called before a mixed frame, with the only stream playing, to start or abandon recording it
+void mumble_framecache_record_begin(MumbleClient* client, AudioStream* solo);
+// Called after a mixed frame has been queued for encoding
+void mumble_framecache_record_end(MumbleClient* client, sf_count_t read, sf_count_t frame_size);
+// The stream being recorded reached its end
+void mumble_framecache_record_finish(MumbleClient* client, AudioStream* sound);
+// Returns the id to tag a frame queued for encoding with, or 0 when nothing is being recorded
+uint32_t mumble_framecache_record_tag(MumbleClient* client);
+// An encoded frame tagged for recording is being sent
+void mumble_framecache_record_packet(MumbleClient* client, audio_work_t* work);
+void mumble_framecache_record_abort(MumbleClient* client);
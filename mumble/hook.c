@@ -0,0 +1,269 @@
+#include "mumble.h"
+#include "hook.h"
+#include "log.h"
+
+static const char* hook_builtin_names[HOOK_BUILTIN_COUNT] = {
+	[HOOK_ON_CONNECT] = "OnConnect",
+	[HOOK_ON_DISCONNECT] = "OnDisconnect",
+	[HOOK_ON_SERVER_VERSION] = "OnServerVersion",
+	[HOOK_ON_PONG_TCP] = "OnPongTCP",
+	[HOOK_ON_PONG_UDP] = "OnPongUDP",
+	[HOOK_ON_SERVER_REJECT] = "OnServerReject",
+	[HOOK_ON_SERVER_SYNC] = "OnServerSync",
+	[HOOK_ON_CHANNEL_REMOVE] = "OnChannelRemove",
+	[HOOK_ON_CHANNEL_STATE] = "OnChannelState",
+	[HOOK_ON_USER_CHANNEL] = "OnUserChannel",
+	[HOOK_ON_USER_REMOVE] = "OnUserRemove",
+	[HOOK_ON_USER_CONNECT] = "OnUserConnect",
+	[HOOK_ON_USER_STATE] = "OnUserState",
+	[HOOK_ON_USER_START_SPEAKING] = "OnUserStartSpeaking",
+	[HOOK_ON_USER_STOP_SPEAKING] = "OnUserStopSpeaking",
+	[HOOK_ON_USER_SPEAK] = "OnUserSpeak",
+	[HOOK_ON_BAN_LIST] = "OnBanList",
+	[HOOK_ON_MESSAGE] = "OnMessage",
+	[HOOK_ON_PERMISSION_DENIED] = "OnPermissionDenied",
+	[HOOK_ON_ACL] = "OnACL",
+	[HOOK_ON_CRYPT_SETUP] = "OnCryptSetup",
+	[HOOK_ON_USER_LIST] = "OnUserList",
+	[HOOK_ON_PERMISSION_QUERY] = "OnPermissionQuery",
+	[HOOK_ON_CODEC_VERSION] = "OnCodecVersion",
+	[HOOK_ON_USER_STATS] = "OnUserStats",
+	[HOOK_ON_SERVER_CONFIG] = "OnServerConfig",
+	[HOOK_ON_SUGGEST_CONFIG] = "OnSuggestConfig",
+	[HOOK_ON_PLUGIN_DATA] = "OnPluginData",
+	[HOOK_ON_ERROR] = "OnError",
+	[HOOK_ON_PING_TCP] = "OnPingTCP",
+	[HOOK_ON_SEND_QUEUE_FULL] = "OnSendQueueFull",
+	[HOOK_ON_SEND_QUEUE_DRAINED] = "OnSendQueueDrained",
+	[HOOK_ON_PING_UDP] = "OnPingUDP",
+	[HOOK_ON_AUDIO_STREAM] = "OnAudioStream",
+	[HOOK_ON_AUDIO_STREAM_END] = "OnAudioStreamEnd",
+	[HOOK_ON_CONTEXT_ACTION_MODIFY] = "OnContextActionModify",
+	[HOOK_ON_QUERY_USERS] = "OnQueryUsers",
+	[HOOK_ON_USER_AUDIO] = "OnUserAudio",
+};
+
+// Custom hook names, shared by every client
+static char** hook_custom_names = NULL;
+static size_t hook_custom_count = 0;
+
+int mumble_hook_find(const char* name) {
+	for (int i = 0; i < HOOK_BUILTIN_COUNT; i++) {
+		if (strcmp(hook_builtin_names[i], name) == 0) {
+			return i;
+		}
+	}
+
+	for (size_t i = 0; i < hook_custom_count; i++) {
+		if (strcmp(hook_custom_names[i], name) == 0) {
+			return HOOK_BUILTIN_COUNT + i;
+		}
+	}
+
+	return -1;
+}
+
+int mumble_hook_intern(const char* name) {
+	int hook = mumble_hook_find(name);
+
+	if (hook >= 0) {
+		return hook;
+	}
+
+	char* copy = strdup(name);
+	if (!copy) {
+		return -1;
+	}
+
+	char** names = realloc(hook_custom_names, sizeof(char*) * (hook_custom_count + 1));
+	if (!names) {
+		free(copy);
+		return -1;
+	}
+
+	names[hook_custom_count] = copy;
+	hook_custom_names = names;
+
+	return HOOK_BUILTIN_COUNT + hook_custom_count++;
+}
+
+const char* mumble_hook_name(int hook) {
+	if (hook < 0) {
+		return "unknown";
+	}
+	if (hook < HOOK_BUILTIN_COUNT) {
+		return hook_builtin_names[hook];
+	}
+	if ((size_t) hook < HOOK_BUILTIN_COUNT + hook_custom_count) {
+		return hook_custom_names[hook - HOOK_BUILTIN_COUNT];
+	}
+	return "unknown";
+}
+
+static void hook_set_present(MumbleClient* client, int hook, bool present) {
+	if (present) {
+		client->hook_present[hook / 64] |= (uint64_t) 1 << (hook % 64);
+	} else {
+		client->hook_present[hook / 64] &= ~((uint64_t) 1 << (hook % 64));
+	}
+}
+
+static bool hook_reserve(MumbleClient* client, int hook) {
+	if ((size_t) hook < client->hook_slot_count) {
+		return true;
+	}
+
+	size_t count = client->hook_slot_count > 0 ? client->hook_slot_count : HOOK_BUILTIN_COUNT;
+	while (count <= (size_t) hook) {
+		count *= 2;
+	}
+
+	size_t words = (count + 63) / 64;
+	size_t old_words = (client->hook_slot_count + 63) / 64;
+
+	MumbleHookSlot* slots = realloc(client->hook_slots, sizeof(MumbleHookSlot) * count);
+	if (!slots) {
+		return false;
+	}
+	client->hook_slots = slots;
+
+	uint64_t* present = realloc(client->hook_present, sizeof(uint64_t) * words);
+	if (!present) {
+		return false;
+	}
+	client->hook_present = present;
+
+	memset(slots + client->hook_slot_count, 0, sizeof(MumbleHookSlot) * (count - client->hook_slot_count));
+	memset(present + old_words, 0, sizeof(uint64_t) * (words - old_words));
+
+	client->hook_slot_count = count;
+	return true;
+}
+
+bool mumble_hook_add(lua_State* l, MumbleClient* client, int hook, const char* name, int index) {
+	if (hook < 0 || !hook_reserve(client, hook)) {
+		return false;
+	}
+
+	MumbleHookSlot* slot = &client->hook_slots[hook];
+
+	for (size_t i = 0; i < slot->count; i++) {
+		if (slot->callbacks[i].callback != LUA_NOREF && strcmp(slot->callbacks[i].name, name) == 0) {
+			// Replace the callback with the same name
+			lua_pushvalue(l, index);
+			int callback = mumble_ref(l);
+			mumble_unref(l, &slot->callbacks[i].callback);
+			slot->callbacks[i].callback = callback;
+			return true;
+		}
+	}
+
+	if (slot->count >= slot->capacity) {
+		size_t capacity = slot->capacity > 0 ? slot->capacity * 2 : 4;
+		MumbleHookCallback* callbacks = realloc(slot->callbacks, sizeof(MumbleHookCallback) * capacity);
+		if (!callbacks) {
+			return false;
+		}
+		slot->callbacks = callbacks;
+		slot->capacity = capacity;
+	}
+
+	char* copy = strdup(name);
+	if (!copy) {
+		return false;
+	}
+
+	lua_pushvalue(l, index);
+	slot->callbacks[slot->count].name = copy;
+	slot->callbacks[slot->count].callback = mumble_ref(l);
+	slot->count++;
+
+	hook_set_present(client, hook, true);
+	return true;
+}
+
+static bool hook_slot_empty(MumbleHookSlot* slot) {
+	for (size_t i = 0; i < slot->count; i++) {
+		if (slot->callbacks[i].callback != LUA_NOREF) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Drop every callback that was removed while the hook was being dispatched
+static void hook_compact(MumbleHookSlot* slot) {
+	size_t count = 0;
+
+	for (size_t i = 0; i < slot->count; i++) {
+		if (slot->callbacks[i].callback == LUA_NOREF) {
+			free(slot->callbacks[i].name);
+		} else {
+			slot->callbacks[count++] = slot->callbacks[i];
+		}
+	}
+
+	slot->count = count;
+	slot->removed = false;
+}
+
+void mumble_hook_remove(lua_State* l, MumbleClient* client, int hook, const char* name) {
+	if (hook < 0 || (size_t) hook >= client->hook_slot_count) {
+		return;
+	}
+
+	MumbleHookSlot* slot = &client->hook_slots[hook];
+
+	for (size_t i = 0; i < slot->count; i++) {
+		if (slot->callbacks[i].callback != LUA_NOREF && strcmp(slot->callbacks[i].name, name) == 0) {
+			mumble_unref(l, &slot->callbacks[i].callback);
+
+			if (slot->dispatching > 0) {
+				// Moving the callbacks now would make the running dispatch skip one, leave a hole instead
+				slot->removed = true;
+				break;
+			}
+
+			free(slot->callbacks[i].name);
+
+			// Keep the order callbacks were added in
+			memmove(&slot->callbacks[i], &slot->callbacks[i + 1], sizeof(MumbleHookCallback) * (slot->count - i - 1));
+			slot->count--;
+			break;
+		}
+	}
+
+	if (hook_slot_empty(slot)) {
+		hook_set_present(client, hook, false);
+	}
+}
+
+void mumble_hook_dispatch_begin(MumbleClient* client, int hook) {
+	client->hook_slots[hook].dispatching++;
+}
+
+void mumble_hook_dispatch_end(MumbleClient* client, int hook) {
+	// The slots may have moved while the callbacks ran
+	MumbleHookSlot* slot = &client->hook_slots[hook];
+
+	if (--slot->dispatching == 0 && slot->removed) {
+		hook_compact(slot);
+	}
+}
+
+void mumble_hook_clear(lua_State* l, MumbleClient* client) {
+	for (size_t hook = 0; hook < client->hook_slot_count; hook++) {
+		MumbleHookSlot* slot = &client->hook_slots[hook];
+		for (size_t i = 0; i < slot->count; i++) {
+			mumble_unref(l, &slot->callbacks[i].callback);
+			free(slot->callbacks[i].name);
+		}
+		free(slot->callbacks);
+	}
+
+	free(client->hook_slots);
+	free(client->hook_present);
+	client->hook_slots = NULL;
+	client->hook_present = NULL;
+	client->hook_slot_count = 0;
+}
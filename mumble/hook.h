@@ -0,0 +1,63 @@
+#pragma once
+
+#include "types.h"
+
+// Hooks called by the library itself, any custom hook names are interned after these
+enum {
+	HOOK_ON_CONNECT,
+	HOOK_ON_DISCONNECT,
+	HOOK_ON_SERVER_VERSION,
+	HOOK_ON_PONG_TCP,
+	HOOK_ON_PONG_UDP,
+	HOOK_ON_SERVER_REJECT,
+	HOOK_ON_SERVER_SYNC,
+	HOOK_ON_CHANNEL_REMOVE,
+	HOOK_ON_CHANNEL_STATE,
+	HOOK_ON_USER_CHANNEL,
+	HOOK_ON_USER_REMOVE,
+	HOOK_ON_USER_CONNECT,
+	HOOK_ON_USER_STATE,
+	HOOK_ON_USER_START_SPEAKING,
+	HOOK_ON_USER_STOP_SPEAKING,
+	HOOK_ON_USER_SPEAK,
+	HOOK_ON_BAN_LIST,
+	HOOK_ON_MESSAGE,
+	HOOK_ON_PERMISSION_DENIED,
+	HOOK_ON_ACL,
+	HOOK_ON_CRYPT_SETUP,
+	HOOK_ON_USER_LIST,
+	HOOK_ON_PERMISSION_QUERY,
+	HOOK_ON_CODEC_VERSION,
+	HOOK_ON_USER_STATS,
+	HOOK_ON_SERVER_CONFIG,
+	HOOK_ON_SUGGEST_CONFIG,
+	HOOK_ON_PLUGIN_DATA,
+	HOOK_ON_ERROR,
+	HOOK_ON_PING_TCP,
+	HOOK_ON_SEND_QUEUE_FULL,
+	HOOK_ON_SEND_QUEUE_DRAINED,
+	HOOK_ON_PING_UDP,
+	HOOK_ON_AUDIO_STREAM,
+	HOOK_ON_AUDIO_STREAM_END,
+	HOOK_ON_CONTEXT_ACTION_MODIFY,
+	HOOK_ON_QUERY_USERS,
+	HOOK_ON_USER_AUDIO,
+	HOOK_BUILTIN_COUNT,
+};
+
+int mumble_hook_intern(const char* name);
+int mumble_hook_find(const char* name);
+const char* mumble_hook_name(int hook);
+
+bool mumble_hook_add(lua_State* l, MumbleClient* client, int hook, const char* name, int index);
+void mumble_hook_remove(lua_State* l, MumbleClient* client, int hook, const char* name);
+void mumble_hook_clear(lua_State* l, MumbleClient* client);
+
+// Wrapped around calling every callback of a hook, so callbacks can unhook themselves without others being skipped
+void mumble_hook_dispatch_begin(MumbleClient* client, int hook);
+void mumble_hook_dispatch_end(MumbleClient* client, int hook);
+
+// A single branch, so events nobody listens to cost next to nothing
+static inline bool mumble_hook_active(const MumbleClient* client, int hook) {
+	return (size_t) hook < client->hook_slot_count && (client->hook_present[hook / 64] >> (hook % 64)) & 1;
+}
@@ -0,0 +1,540 @@
+#include "mumble.h"
+
+#include "buffer.h"
+#include "jitter.h"
+#include "mixer.h"
+#include "record.h"
+#include "log.h"
+
+#include <math.h>
+
+/*
+ * Received voice is reordered by sequence number in a per-user jitter buffer,
+ * and decoded on a fixed 10ms clock shared by every user of a client.
+ *
+ * Each talk spurt is held back for a few frames before it starts playing.
+ * How many depends on how much the arrival time of that users packets varies.
+ * Frames that never arrive are recovered from the next packets in-band FEC data when possible,
+ * or concealed by the decoder when not.
+ *
+ * When a users recording is the only thing that wants their audio, packets are still put in order here,
+ * but decoding them is left to the recording worker.
+ */
+
+static void jitter_clock(uv_timer_t* handle);
+
+void mumble_jitter_init(MumbleClient* client) {
+	client->jitter_users = NULL;
+	client->jitter_user_count = 0;
+	client->jitter_user_capacity = 0;
+	client->jitter_clock = 0;
+
+	// A view of the frame being passed to "OnUserAudio"
+	client->jitter_pcm = luabuffer_new(client->l);
+	buffer_init_view(client->jitter_pcm, NULL, 0);
+	client->jitter_pcm_ref = mumble_ref(client->l);
+}
+
+static MumbleJitter* jitter_new(MumbleUser* user) {
+	MumbleJitter* jitter = calloc(1, sizeof(MumbleJitter));
+	if (jitter == NULL) {
+		mumble_log(LOG_ERROR, "failed to allocate jitter buffer for user session: %u", user->session);
+		return NULL;
+	}
+
+	int err;
+	jitter->decoder = opus_decoder_create(AUDIO_SAMPLE_RATE, AUDIO_PLAYBACK_CHANNELS, &err);
+	if (err != OPUS_OK) {
+		mumble_log(LOG_ERROR, "failed to create opus decoder for user session: %u (%s)", user->session, opus_strerror(err));
+		free(jitter);
+		return NULL;
+	}
+
+	jitter->state = JITTER_IDLE;
+	jitter->depth = JITTER_MIN_DEPTH;
+	return jitter;
+}
+
+static void jitter_clear(MumbleJitter* jitter) {
+	for (size_t i = 0; i < JITTER_SLOTS; i++) {
+		jitter->slots[i].filled = false;
+	}
+}
+
+static bool jitter_activate(MumbleClient* client, MumbleUser* user) {
+	if (client->jitter_user_count >= client->jitter_user_capacity) {
+		size_t capacity = client->jitter_user_capacity > 0 ? client->jitter_user_capacity * 2 : 8;
+		MumbleUser** users = realloc(client->jitter_users, sizeof(MumbleUser*) * capacity);
+		if (users == NULL) {
+			mumble_log(LOG_ERROR, "failed to grow jitter buffer list");
+			return false;
+		}
+		client->jitter_users = users;
+		client->jitter_user_capacity = capacity;
+	}
+
+	client->jitter_users[client->jitter_user_count++] = user;
+	mumble_jitter_clock_update(client);
+	return true;
+}
+
+static void jitter_deactivate(MumbleClient* client, MumbleUser* user) {
+	for (size_t i = 0; i < client->jitter_user_count; i++) {
+		if (client->jitter_users[i] == user) {
+			client->jitter_users[i] = client->jitter_users[--client->jitter_user_count];
+			break;
+		}
+	}
+
+	mumble_jitter_clock_update(client);
+}
+
+static bool jitter_clock_wanted(MumbleClient* client) {
+	return client->jitter_user_count > 0 || mumble_mixer_active(client);
+}
+
+void mumble_jitter_clock_update(MumbleClient* client) {
+	uv_handle_t* handle = (uv_handle_t*) &client->jitter_timer;
+
+	if (uv_is_closing(handle)) {
+		return;
+	}
+
+	bool wanted = jitter_clock_wanted(client);
+
+	// Only tick while someone is talking, or while the mix has somewhere to go
+	if (wanted && !uv_is_active(handle)) {
+		client->jitter_clock = uv_now(uv_default_loop());
+		uv_timer_start(&client->jitter_timer, jitter_clock, JITTER_FRAME_MS, JITTER_FRAME_MS);
+	} else if (!wanted && uv_is_active(handle)) {
+		uv_timer_stop(&client->jitter_timer);
+	}
+}
+
+static void jitter_idle(MumbleClient* client, MumbleUser* user) {
+	MumbleJitter* jitter = user->jitter;
+
+	jitter->state = JITTER_IDLE;
+	jitter->ended = false;
+	jitter->silence_until = 0;
+	jitter->pcm_frames = 0;
+	jitter_clear(jitter);
+
+	// Any recording is filled with silence from here until the user talks again
+	user->last_spoke = uv_now(uv_default_loop());
+
+	jitter_deactivate(client, user);
+}
+
+// How many 10ms frames of audio an opus packet holds
+static uint64_t jitter_packet_frames(const uint8_t* data, size_t length) {
+	int samples = opus_packet_get_nb_samples(data, length, AUDIO_SAMPLE_RATE);
+	if (samples < JITTER_FRAME_SIZE) {
+		return 1;
+	}
+	return samples / JITTER_FRAME_SIZE;
+}
+
+void mumble_jitter_push(MumbleClient* client, MumbleUser* user, uint64_t sequence, const uint8_t* data, size_t length, bool speaking) {
+	MumbleJitter* jitter = user->jitter;
+
+	if (jitter == NULL) {
+		jitter = jitter_new(user);
+		if (jitter == NULL) {
+			return;
+		}
+		user->jitter = jitter;
+	}
+
+	uint64_t now = uv_now(uv_default_loop());
+
+	if (jitter->state == JITTER_IDLE) {
+		if (!jitter_activate(client, user)) {
+			return;
+		}
+
+		// Hold the talk spurt back by about twice the jitter we have seen so far
+		uint32_t depth = JITTER_MIN_DEPTH + (uint32_t) ceil(jitter->jitter * 2 / JITTER_FRAME_MS);
+		jitter->depth = depth < JITTER_MAX_DEPTH ? depth : JITTER_MAX_DEPTH;
+
+		jitter->state = JITTER_BUFFERING;
+		jitter->play_sequence = sequence;
+		jitter->play_at = now + jitter->depth * JITTER_FRAME_MS;
+		jitter->concealed = 0;
+		jitter->has_transit = false;
+	} else if (sequence < jitter->play_sequence) {
+		if (jitter->state == JITTER_BUFFERING && jitter->play_sequence - sequence < JITTER_SLOTS) {
+			// Arrived out of order before the talk spurt started playing
+			jitter->play_sequence = sequence;
+		} else {
+			jitter->late++;
+			return;
+		}
+	}
+
+	// Interarrival jitter estimate, as described in RFC 3550
+	int64_t transit = (int64_t) now - (int64_t) (sequence * JITTER_FRAME_MS);
+	if (jitter->has_transit) {
+		int64_t delta = transit - jitter->last_transit;
+		if (delta < 0) {
+			delta = -delta;
+		}
+		jitter->jitter += ((double) delta - jitter->jitter) / 16;
+	}
+	jitter->last_transit = transit;
+	jitter->has_transit = true;
+
+	if (sequence - jitter->play_sequence >= JITTER_SLOTS) {
+		// Too far ahead to fit, the sender must have skipped ahead, so follow it
+		jitter_clear(jitter);
+		jitter->play_sequence = sequence;
+		jitter->ended = false;
+	}
+
+	if (jitter->ended && speaking && sequence >= jitter->end_sequence) {
+		// A new talk spurt started before the last one finished playing
+		jitter->ended = false;
+		jitter->silence_until = sequence;
+	}
+
+	if (!speaking) {
+		jitter->ended = true;
+		jitter->end_sequence = sequence + (length > 0 ? jitter_packet_frames(data, length) : 0);
+	}
+
+	if (length == 0) {
+		return;
+	}
+
+	MumbleJitterSlot* slot = &jitter->slots[sequence & (JITTER_SLOTS - 1)];
+
+	if (slot->capacity < length) {
+		uint8_t* slot_data = realloc(slot->data, length);
+		if (slot_data == NULL) {
+			mumble_log(LOG_ERROR, "failed to store voice packet for user session: %u", user->session);
+			return;
+		}
+		slot->data = slot_data;
+		slot->capacity = length;
+	}
+
+	memcpy(slot->data, data, length);
+	slot->length = length;
+	slot->sequence = sequence;
+	slot->filled = true;
+}
+
+// Decodes on the main loop when something here needs the audio, otherwise the users recording worker decodes it
+static void jitter_offload_update(MumbleClient* client, MumbleUser* user) {
+	MumbleJitter* jitter = user->jitter;
+
+	bool offload = user->recorder != NULL && !mumble_mixer_active(client) && !mumble_hook_active(client, HOOK_ON_USER_AUDIO);
+
+	if (offload == jitter->offload) {
+		return;
+	}
+
+	// Whichever decoder takes over has missed the packets the other one decoded
+	jitter->offload = offload;
+	if (offload) {
+		jitter->offload_reset = true;
+	} else {
+		opus_decoder_ctl(jitter->decoder, OPUS_RESET_STATE);
+	}
+}
+
+// Runs a single opus decode for the user, and returns how many frames it adds to the pcm buffer
+static int jitter_run(MumbleClient* client, MumbleUser* user, const uint8_t* data, size_t length, int frame_size, bool fec, float* out) {
+	MumbleJitter* jitter = user->jitter;
+
+	if (!jitter->offload) {
+		return opus_decode_float(jitter->decoder, data, length, out, frame_size, fec);
+	}
+
+	int frames = frame_size;
+
+	if (data != NULL && !fec) {
+		frames = opus_packet_get_nb_samples(data, length, AUDIO_SAMPLE_RATE);
+		if (frames < 0) {
+			return frames;
+		}
+	}
+
+	// Only the frame count is kept, the audio itself goes straight to the recording
+	mumble_record_decode(client, user, data, data != NULL ? length : 0, frame_size, fec, jitter->offload_reset);
+	jitter->offload_reset = false;
+	return frames;
+}
+
+static void jitter_silence(MumbleClient* client, MumbleUser* user, float* out) {
+	if (user->jitter->offload) {
+		mumble_record_silence(client, user, JITTER_FRAME_SIZE * AUDIO_PLAYBACK_CHANNELS);
+	} else {
+		memset(out, 0, sizeof(float) * JITTER_FRAME_SIZE * AUDIO_PLAYBACK_CHANNELS);
+	}
+}
+
+static int jitter_conceal(MumbleClient* client, MumbleUser* user, float* out) {
+	MumbleJitter* jitter = user->jitter;
+	jitter->lost++;
+	jitter->concealed++;
+	jitter->play_sequence++;
+	return jitter_run(client, user, NULL, 0, JITTER_FRAME_SIZE, false, out);
+}
+
+// Decodes the next packet onto the end of the pcm buffer, returns false once the talk spurt is over
+static bool jitter_decode(MumbleClient* client, MumbleUser* user, bool draining) {
+	MumbleJitter* jitter = user->jitter;
+
+	uint64_t sequence = jitter->play_sequence;
+
+	if (jitter->pcm_frames == 0) {
+		// Only switch between decoders when no audio from the old one is waiting to be played
+		jitter_offload_update(client, user);
+	}
+
+	if (jitter->ended && sequence >= jitter->end_sequence) {
+		return false;
+	}
+
+	float* out = jitter->pcm + jitter->pcm_frames * AUDIO_PLAYBACK_CHANNELS;
+	int frames;
+
+	MumbleJitterSlot* slot = &jitter->slots[sequence & (JITTER_SLOTS - 1)];
+
+	if (slot->filled && slot->sequence == sequence) {
+		slot->filled = false;
+		jitter->concealed = 0;
+
+		frames = jitter_run(client, user, slot->data, slot->length, AUDIO_RECORD_MAX_FRAMES, false, out);
+		if (frames < 0) {
+			mumble_log(LOG_WARN, "opus decoding error for user session %u: %s", user->session, opus_strerror(frames));
+			frames = jitter_conceal(client, user, out);
+		} else {
+			jitter->play_sequence += jitter_packet_frames(slot->data, slot->length);
+		}
+	} else {
+		// Find the next packet we do have
+		MumbleJitterSlot* next = NULL;
+		for (uint64_t s = sequence + 1; s < sequence + JITTER_SLOTS; s++) {
+			if (jitter->ended && s >= jitter->end_sequence) {
+				break;
+			}
+			MumbleJitterSlot* candidate = &jitter->slots[s & (JITTER_SLOTS - 1)];
+			if (candidate->filled && candidate->sequence == s) {
+				next = candidate;
+				break;
+			}
+		}
+
+		if (next == NULL && (draining || jitter->concealed >= JITTER_MAX_CONCEAL)) {
+			// The user stopped sending without a terminator
+			return false;
+		}
+
+		uint64_t gap = next != NULL ? next->sequence - sequence : 0;
+
+		if (next != NULL && (sequence < jitter->silence_until || gap > JITTER_MAX_CONCEAL)) {
+			// A pause between talk spurts, not lost audio
+			jitter_silence(client, user, out);
+			frames = JITTER_FRAME_SIZE;
+			jitter->play_sequence++;
+		} else if (next != NULL && gap * JITTER_FRAME_SIZE <= (uint64_t) opus_packet_get_samples_per_frame(next->data, AUDIO_SAMPLE_RATE)) {
+			// Recover the missing audio from the forward error correction data in the next packet
+			frames = jitter_run(client, user, next->data, next->length, gap * JITTER_FRAME_SIZE, true, out);
+			jitter->recovered++;
+			jitter->concealed = 0;
+			jitter->play_sequence += gap;
+		} else {
+			frames = jitter_conceal(client, user, out);
+		}
+
+		if (frames < 0) {
+			mumble_log(LOG_WARN, "opus concealment error for user session %u: %s", user->session, opus_strerror(frames));
+			return false;
+		}
+	}
+
+	jitter->pcm_frames += frames;
+	return true;
+}
+
+static void jitter_emit(MumbleClient* client, MumbleUser* user, size_t frames) {
+	MumbleJitter* jitter = user->jitter;
+	size_t samples = frames * AUDIO_PLAYBACK_CHANNELS;
+
+	if (jitter->offload) {
+		// The recording worker already has this audio, and nothing else wants it
+		jitter->pcm_frames -= frames;
+		return;
+	}
+
+	mumble_record_pcm(client, user, jitter->pcm, samples);
+	mumble_mixer_add(client, jitter->pcm, frames);
+
+	bool hooked = mumble_hook_active(client, HOOK_ON_USER_AUDIO);
+
+	if (hooked) {
+		// The hook gets a copy, since stopping a recording from it drains what is left of the jitter buffer
+		memcpy(client->jitter_frame, jitter->pcm, sizeof(float) * samples);
+	}
+
+	// Consume the frame before the hook runs, so a drain inside it never sees it again
+	jitter->pcm_frames -= frames;
+	memmove(jitter->pcm, jitter->pcm + samples, sizeof(float) * jitter->pcm_frames * AUDIO_PLAYBACK_CHANNELS);
+
+	if (hooked) {
+		lua_State* l = client->l;
+
+		// Drop anything the last callback wrote into the view
+		buffer_free(client->jitter_pcm);
+		buffer_init_view(client->jitter_pcm, client->jitter_frame, samples * sizeof(float));
+
+		mumble_user_raw_get(client, user->session);
+		mumble_pushref(l, client->jitter_pcm_ref);
+		mumble_hook_call(client, HOOK_ON_USER_AUDIO, 2);
+
+		if (!client->connected) {
+			// Our users were freed when the hook disconnected us
+			return;
+		}
+
+		if (client->jitter_pcm->view) {
+			buffer_init_view(client->jitter_pcm, NULL, 0);
+		}
+	}
+}
+
+// Plays a single frame for the user, returns false once their talk spurt is over
+static bool jitter_tick(MumbleClient* client, MumbleUser* user, uint64_t now) {
+	MumbleJitter* jitter = user->jitter;
+
+	if (jitter->state == JITTER_BUFFERING) {
+		if (now < jitter->play_at) {
+			return true;
+		}
+		jitter->state = JITTER_PLAYING;
+
+		// Fill any recording with silence from when the user last stopped talking
+		mumble_handle_record_silence(client, user);
+	}
+
+	bool playing = true;
+
+	while (jitter->pcm_frames < JITTER_FRAME_SIZE) {
+		if (!jitter_decode(client, user, false)) {
+			playing = false;
+			break;
+		}
+	}
+
+	size_t frames = jitter->pcm_frames < JITTER_FRAME_SIZE ? jitter->pcm_frames : JITTER_FRAME_SIZE;
+
+	if (frames > 0) {
+		jitter_emit(client, user, frames);
+		if (!client->connected || jitter->state == JITTER_IDLE) {
+			// Disconnected, or drained and idled by a hook
+			return false;
+		}
+	}
+
+	return playing || jitter->pcm_frames > 0;
+}
+
+static void jitter_clock(uv_timer_t* handle) {
+	MumbleClient* client = (MumbleClient*) handle->data;
+
+	uint64_t now = uv_now(handle->loop);
+
+	if (now - client->jitter_clock > JITTER_MAX_DEPTH * JITTER_FRAME_MS) {
+		// The loop was stalled, don't try to catch up on everything that was missed
+		client->jitter_clock = now - JITTER_FRAME_MS;
+	}
+
+	while (jitter_clock_wanted(client) && client->jitter_clock + JITTER_FRAME_MS <= now) {
+		client->jitter_clock += JITTER_FRAME_MS;
+
+		mumble_mixer_begin(client);
+
+		// Walk backwards, so users that finished talking can be removed as we go
+		for (size_t i = client->jitter_user_count; i-- > 0;) {
+			if (i >= client->jitter_user_count) {
+				// A hook removed some users from under us
+				continue;
+			}
+
+			MumbleUser* user = client->jitter_users[i];
+
+			if (user->jitter->ticked == client->jitter_clock) {
+				// A hook idled someone before us, which moved a user that already played into this spot
+				continue;
+			}
+			user->jitter->ticked = client->jitter_clock;
+
+			bool playing = jitter_tick(client, user, client->jitter_clock);
+
+			if (!client->connected) {
+				return;
+			}
+
+			if (!playing && user->jitter->state != JITTER_IDLE) {
+				jitter_idle(client, user);
+			}
+		}
+
+		mumble_mixer_end(client);
+	}
+}
+
+void mumble_jitter_drain(MumbleClient* client, MumbleUser* user) {
+	MumbleJitter* jitter = user->jitter;
+
+	if (jitter == NULL || jitter->state == JITTER_IDLE) {
+		return;
+	}
+
+	if (jitter->state == JITTER_BUFFERING) {
+		jitter->state = JITTER_PLAYING;
+		mumble_handle_record_silence(client, user);
+	}
+
+	// Only recordings get what is left, since this happens while users are being removed
+	do {
+		if (!jitter->offload) {
+			mumble_record_pcm(client, user, jitter->pcm, jitter->pcm_frames * AUDIO_PLAYBACK_CHANNELS);
+		}
+		jitter->pcm_frames = 0;
+	} while (jitter_decode(client, user, true));
+
+	jitter_idle(client, user);
+}
+
+void mumble_jitter_free(MumbleClient* client, MumbleUser* user) {
+	MumbleJitter* jitter = user->jitter;
+
+	if (jitter == NULL) {
+		return;
+	}
+
+	mumble_jitter_drain(client, user);
+
+	for (size_t i = 0; i < JITTER_SLOTS; i++) {
+		free(jitter->slots[i].data);
+	}
+
+	opus_decoder_destroy(jitter->decoder);
+	free(jitter);
+	user->jitter = NULL;
+}
+
+void mumble_jitter_shutdown(MumbleClient* client) {
+	if (!uv_is_closing((uv_handle_t*) &client->jitter_timer)) {
+		uv_timer_stop(&client->jitter_timer);
+		uv_close((uv_handle_t*) &client->jitter_timer, NULL);
+	}
+
+	free(client->jitter_users);
+	client->jitter_users = NULL;
+	client->jitter_user_count = 0;
+	client->jitter_user_capacity = 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "types.h"
+#include "hook.h"
+#include "mixer.h"
+
+void mumble_jitter_init(MumbleClient* client);
+void mumble_jitter_push(MumbleClient* client, MumbleUser* user, uint64_t sequence, const uint8_t* data, size_t length, bool speaking);
+void mumble_jitter_drain(MumbleClient* client, MumbleUser* user);
+void mumble_jitter_free(MumbleClient* client, MumbleUser* user);
+void mumble_jitter_shutdown(MumbleClient* client);
+void mumble_jitter_clock_update(MumbleClient* client);
+
+// Received voice only has to go through a jitter buffer if something consumes the decoded audio
+static inline bool mumble_jitter_wanted(MumbleClient* client, MumbleUser* user) {
+	return user->recorder != NULL || mumble_mixer_active(client) || mumble_hook_active(client, HOOK_ON_USER_AUDIO);
+}
@@ -0,0 +1,200 @@
+#include "mix.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIX_X86
+#endif
+
+/*--------------------------------
+	SCALAR
+--------------------------------*/
+
+static void mix_add_gain_scalar(float *dst, const float *src, size_t samples, float gain) {
+	for (size_t i = 0; i < samples; i++) {
+		dst[i] += src[i] * gain;
+	}
+}
+
+static void mix_add_ramp_scalar(float *dst, const float *src, size_t frames, float gain, float step) {
+	for (size_t i = 0; i < frames; i++) {
+		float volume = gain + step * (float) i;
+		dst[i * 2] += src[i * 2] * volume;
+		dst[i * 2 + 1] += src[i * 2 + 1] * volume;
+	}
+}
+
+static void mix_mono_to_stereo_scalar(float *dst, const float *src, size_t frames) {
+	for (size_t i = 0; i < frames; i++) {
+		dst[i * 2] = src[i];
+		dst[i * 2 + 1] = src[i];
+	}
+}
+
+/*--------------------------------
+	SSE2
+--------------------------------*/
+
+#if defined(MIX_X86) && defined(__SSE2__)
+
+static void mix_add_gain_sse2(float *dst, const float *src, size_t samples, float gain) {
+	__m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+	for (; i + 4 <= samples; i += 4) {
+		__m128 d = _mm_loadu_ps(dst + i);
+		__m128 s = _mm_loadu_ps(src + i);
+		_mm_storeu_ps(dst + i, _mm_add_ps(d, _mm_mul_ps(s, g)));
+	}
+	mix_add_gain_scalar(dst + i, src + i, samples - i, gain);
+}
+
+static void mix_add_ramp_sse2(float *dst, const float *src, size_t frames, float gain, float step) {
+	__m128 g = _mm_set1_ps(gain);
+	__m128 s = _mm_set1_ps(step);
+	// Frame index for each sample of two stereo frames
+	__m128 index = _mm_set_ps(1.0f, 1.0f, 0.0f, 0.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
+	size_t i = 0;
+	for (; i + 2 <= frames; i += 2) {
+		__m128 volume = _mm_add_ps(g, _mm_mul_ps(s, index));
+		__m128 d = _mm_loadu_ps(dst + i * 2);
+		__m128 in = _mm_loadu_ps(src + i * 2);
+		_mm_storeu_ps(dst + i * 2, _mm_add_ps(d, _mm_mul_ps(in, volume)));
+		index = _mm_add_ps(index, two);
+	}
+	for (; i < frames; i++) {
+		float volume = gain + step * (float) i;
+		dst[i * 2] += src[i * 2] * volume;
+		dst[i * 2 + 1] += src[i * 2 + 1] * volume;
+	}
+}
+
+static void mix_mono_to_stereo_sse2(float *dst, const float *src, size_t frames) {
+	size_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		__m128 m = _mm_loadu_ps(src + i);
+		_mm_storeu_ps(dst + i * 2, _mm_unpacklo_ps(m, m));
+		_mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(m, m));
+	}
+	mix_mono_to_stereo_scalar(dst + i * 2, src + i, frames - i);
+}
+
+#endif
+
+/*--------------------------------
+	AVX2
+--------------------------------*/
+
+#if defined(MIX_X86) && (defined(__GNUC__) || defined(__clang__))
+
+#define MIX_AVX2
+
+__attribute__((target("avx2")))
+static void mix_add_gain_avx2(float *dst, const float *src, size_t samples, float gain) {
+	__m256 g = _mm256_set1_ps(gain);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		__m256 d = _mm256_loadu_ps(dst + i);
+		__m256 s = _mm256_loadu_ps(src + i);
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(d, _mm256_mul_ps(s, g)));
+	}
+	mix_add_gain_scalar(dst + i, src + i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void mix_add_ramp_avx2(float *dst, const float *src, size_t frames, float gain, float step) {
+	__m256 g = _mm256_set1_ps(gain);
+	__m256 s = _mm256_set1_ps(step);
+	// Frame index for each sample of four stereo frames
+	__m256 index = _mm256_set_ps(3.0f, 3.0f, 2.0f, 2.0f, 1.0f, 1.0f, 0.0f, 0.0f);
+	const __m256 four = _mm256_set1_ps(4.0f);
+	size_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		__m256 volume = _mm256_add_ps(g, _mm256_mul_ps(s, index));
+		__m256 d = _mm256_loadu_ps(dst + i * 2);
+		__m256 in = _mm256_loadu_ps(src + i * 2);
+		_mm256_storeu_ps(dst + i * 2, _mm256_add_ps(d, _mm256_mul_ps(in, volume)));
+		index = _mm256_add_ps(index, four);
+	}
+	for (; i < frames; i++) {
+		float volume = gain + step * (float) i;
+		dst[i * 2] += src[i * 2] * volume;
+		dst[i * 2 + 1] += src[i * 2 + 1] * volume;
+	}
+}
+
+#endif
+
+/*--------------------------------
+	DISPATCH
+--------------------------------*/
+
+#if defined(MIX_X86) && defined(__SSE2__)
+static void (*mix_add_gain_impl)(float*, const float*, size_t, float) = mix_add_gain_sse2;
+static void (*mix_add_ramp_impl)(float*, const float*, size_t, float, float) = mix_add_ramp_sse2;
+static void (*mix_mono_to_stereo_impl)(float*, const float*, size_t) = mix_mono_to_stereo_sse2;
+#else
+static void (*mix_add_gain_impl)(float*, const float*, size_t, float) = mix_add_gain_scalar;
+static void (*mix_add_ramp_impl)(float*, const float*, size_t, float, float) = mix_add_ramp_scalar;
+static void (*mix_mono_to_stereo_impl)(float*, const float*, size_t) = mix_mono_to_stereo_scalar;
+#endif
+
+void mix_init(void) {
+#if defined(MIX_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		mumble_log(LOG_DEBUG, "using AVX2 audio mixing");
+		mix_add_gain_impl = mix_add_gain_avx2;
+		mix_add_ramp_impl = mix_add_ramp_avx2;
+		return;
+	}
+#endif
+#if defined(MIX_X86) && defined(__SSE2__)
+	mumble_log(LOG_DEBUG, "using SSE2 audio mixing");
+#endif
+}
+
+void mix_add_gain(float *dst, const float *src, size_t samples, float gain) {
+	mix_add_gain_impl(dst, src, samples, gain);
+}
+
+void mix_add_ramp(float *dst, const float *src, size_t frames, float gain, float step) {
+	mix_add_ramp_impl(dst, src, frames, gain, step);
+}
+
+void mix_mono_to_stereo(float *dst, const float *src, size_t frames) {
+	mix_mono_to_stereo_impl(dst, src, frames);
+}
+
+void mix_downmix_to_stereo(float *dst, const float *src, size_t frames, int channels) {
+	// Even channels go left, odd channels go right
+	const float scale = 1.0f / (channels / 2.0f);
+
+	for (size_t i = 0; i < frames; i++) {
+		const float *frame = src + i * channels;
+		float left = 0.0f, right = 0.0f;
+		int ch = 0;
+#if defined(MIX_X86) && defined(__SSE2__)
+		if (channels >= 4) {
+			__m128 sum = _mm_setzero_ps();
+			for (; ch + 4 <= channels; ch += 4) {
+				sum = _mm_add_ps(sum, _mm_loadu_ps(frame + ch));
+			}
+			// [L0, R0, L1, R1] + [L1, R1, ...]
+			sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+			float pair[4];
+			_mm_storeu_ps(pair, sum);
+			left = pair[0];
+			right = pair[1];
+		}
+#endif
+		for (; ch < channels; ch++) {
+			if (ch % 2 == 0)
+				left += frame[ch];
+			else
+				right += frame[ch];
+		}
+		dst[i * 2] = left * scale;
+		dst[i * 2 + 1] = right * scale;
+	}
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+// Picks the fastest kernels the CPU supports, falls back to scalar code until called
+void mix_init(void);
+
+// dst[i] += src[i] * gain
+void mix_add_gain(float *dst, const float *src, size_t samples, float gain);
+
+// Interleaved stereo: dst[i] += src[i] * (gain + step * i), with i counting frames
+void mix_add_ramp(float *dst, const float *src, size_t frames, float gain, float step);
+
+void mix_mono_to_stereo(float *dst, const float *src, size_t frames);
+void mix_downmix_to_stereo(float *dst, const float *src, size_t frames, int channels);
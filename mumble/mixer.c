@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "mumble.h"
+
+#include "mixer.h"
+#include "jitter.h"
+#include "record.h"
+#include "mix.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Every users decoded voice is summed into a single 48 kHz stereo bus, on the same 10ms clock as the jitter buffers.
+ * While the mix has a sink the clock keeps running through silence, so the output is one continuous stream.
+ */
+
+void mumble_mixer_init(MumbleClient* client) {
+	client->mix_file = NULL;
+	client->mix_pipe = -1;
+	client->mix_buffer = NULL;
+	client->mix_buffer_ref = LUA_NOREF;
+	client->mix_buffer_limit = 0;
+}
+
+static void mixer_close_file(MumbleClient* client) {
+	if (client->mix_file != NULL) {
+		mumble_record_close(client->mix_file);
+		client->mix_file = NULL;
+	}
+}
+
+static void mixer_close_pipe(MumbleClient* client) {
+	if (client->mix_pipe >= 0) {
+		close(client->mix_pipe);
+		client->mix_pipe = -1;
+	}
+}
+
+static void mixer_close_buffer(MumbleClient* client) {
+	client->mix_buffer = NULL;
+	client->mix_buffer_limit = 0;
+	mumble_unref(client->l, &client->mix_buffer_ref);
+}
+
+bool mumble_mixer_set_file(MumbleClient* client, SNDFILE* file) {
+	MumbleRecorder* recorder = mumble_record_open(client, file, client->session);
+	if (recorder == NULL) {
+		return false;
+	}
+
+	mixer_close_file(client);
+	client->mix_file = recorder;
+	mumble_jitter_clock_update(client);
+	return true;
+}
+
+int mumble_mixer_set_pipe(MumbleClient* client, const char* path) {
+	// Never block the loop on a slow reader, fails with ENXIO if nothing has the FIFO open yet
+	int fd = open(path, O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		return errno;
+	}
+
+	mixer_close_pipe(client);
+	client->mix_pipe = fd;
+	mumble_jitter_clock_update(client);
+	return 0;
+}
+
+void mumble_mixer_set_buffer(MumbleClient* client, ByteBuffer* buffer, int ref, size_t limit) {
+	mixer_close_buffer(client);
+	client->mix_buffer = buffer;
+	client->mix_buffer_ref = ref;
+	client->mix_buffer_limit = limit;
+	mumble_jitter_clock_update(client);
+}
+
+void mumble_mixer_stop(MumbleClient* client) {
+	mixer_close_file(client);
+	mixer_close_pipe(client);
+	mixer_close_buffer(client);
+	mumble_jitter_clock_update(client);
+}
+
+void mumble_mixer_begin(MumbleClient* client) {
+	memset(client->mix_bus, 0, sizeof(client->mix_bus));
+}
+
+void mumble_mixer_add(MumbleClient* client, const float* pcm, size_t frames) {
+	if (!mumble_mixer_active(client)) {
+		return;
+	}
+
+	if (frames > JITTER_FRAME_SIZE) {
+		frames = JITTER_FRAME_SIZE;
+	}
+
+	mix_add_gain((float*) client->mix_bus, pcm, frames * AUDIO_PLAYBACK_CHANNELS, 1.0f);
+}
+
+// Writes to the pipe with SIGPIPE blocked for this thread, so a reader going away only closes the sink.
+// The SIGPIPE our write raised is taken back off, and the process wide signal disposition is left alone.
+static ssize_t mixer_write_nosigpipe(int fd, const void* data, size_t bytes) {
+	sigset_t pipe_set, old_set, pending;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+	// One already pending was raised by someone else, and is theirs to handle once it's unblocked
+	sigpending(&pending);
+	bool was_pending = sigismember(&pending, SIGPIPE);
+
+	ssize_t written = write(fd, data, bytes);
+	int err = errno;
+
+	if (written < 0 && err == EPIPE && !was_pending) {
+		const struct timespec poll = {0, 0};
+		while (sigtimedwait(&pipe_set, NULL, &poll) < 0 && errno == EINTR);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	errno = err;
+	return written;
+}
+
+static void mixer_write_pipe(MumbleClient* client, const float* pcm, size_t bytes) {
+	// A single frame fits in PIPE_BUF, so it is either written whole or not at all
+	ssize_t written = mixer_write_nosigpipe(client->mix_pipe, pcm, bytes);
+	if (written >= 0) {
+		return;
+	}
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		mumble_log(LOG_TRACE, "mix pipe is full, dropping audio");
+		return;
+	}
+
+	mumble_log(LOG_WARN, "closing mix pipe (%s)", strerror(errno));
+	mixer_close_pipe(client);
+	mumble_update_recording_status(client);
+	mumble_jitter_clock_update(client);
+}
+
+static void mixer_write_buffer(MumbleClient* client, const float* pcm, size_t bytes) {
+	ByteBuffer* buffer = client->mix_buffer;
+
+	uint64_t length = buffer_length(buffer);
+	if (length + bytes > client->mix_buffer_limit) {
+		// Drop the oldest audio nobody read in time
+		uint64_t drop = length + bytes - client->mix_buffer_limit;
+		buffer->read_head += drop < length ? drop : length;
+	}
+
+	if (buffer->write_head + bytes > buffer->capacity) {
+		// Only move the unread audio to the front when we run out of room behind it
+		buffer_pack(buffer);
+	}
+
+	buffer_write(buffer, pcm, bytes);
+}
+
+void mumble_mixer_end(MumbleClient* client) {
+	if (!mumble_mixer_active(client)) {
+		return;
+	}
+
+	float* pcm = (float*) client->mix_bus;
+	const size_t samples = JITTER_FRAME_SIZE * AUDIO_PLAYBACK_CHANNELS;
+
+	// Several people talking at once can sum past full scale
+	for (size_t i = 0; i < samples; i++) {
+		if (pcm[i] > 1.0f) {
+			pcm[i] = 1.0f;
+		} else if (pcm[i] < -1.0f) {
+			pcm[i] = -1.0f;
+		}
+	}
+
+	mumble_record_write(client->mix_file, pcm, samples);
+
+	if (client->mix_pipe >= 0) {
+		mixer_write_pipe(client, pcm, samples * sizeof(float));
+	}
+
+	if (client->mix_buffer != NULL) {
+		mixer_write_buffer(client, pcm, samples * sizeof(float));
+	}
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "types.h"
+
+void mumble_mixer_init(MumbleClient* client);
+bool mumble_mixer_set_file(MumbleClient* client, SNDFILE* file);
+int mumble_mixer_set_pipe(MumbleClient* client, const char* path);
+void mumble_mixer_set_buffer(MumbleClient* client, ByteBuffer* buffer, int ref, size_t limit);
+void mumble_mixer_stop(MumbleClient* client);
+
+void mumble_mixer_begin(MumbleClient* client);
+void mumble_mixer_add(MumbleClient* client, const float* pcm, size_t frames);
+void mumble_mixer_end(MumbleClient* client);
+
+// The mix is only worth making if it has somewhere to go
+static inline bool mumble_mixer_active(MumbleClient* client) {
+	return client->mix_file != NULL || client->mix_pipe >= 0 || client->mix_buffer != NULL;
+}
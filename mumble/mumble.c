@@ -2,6 +2,8 @@
 
 #include "audio.h"
 #include "audiostream.h"
+#include "audiocache.h"
+#include "audiopool.h"
 #include "acl.h"
 #include "buffer.h"
 #include "banentry.h"
@@ -16,7 +18,13 @@
 #include "thread.h"
 #include "pipe.h"
 #include "packet.h"
+#include "record.h"
+#include "jitter.h"
+#include "mixer.h"
+#include "framecache.h"
+#include "speakevent.h"
 #include "ocb.h"
+#include "mix.h"
 #include "util.h"
 #include "log.h"
 
@@ -160,7 +168,7 @@ static void mumble_ping_tcp(MumbleClient *client) {
 	lua_setfield(l, -2, "udp_ping_avg");
 	lua_pushnumber(l, ping.udp_ping_var);
 	lua_setfield(l, -2, "udp_ping_var");
-	mumble_hook_call(client, "OnPingTCP", 1);
+	mumble_hook_call(client, HOOK_ON_PING_TCP, 1);
 
 	packet_send(client, PACKET_PING, &ping);
 }
@@ -184,7 +192,7 @@ static void mumble_ping_udp(MumbleClient* client) {
 		lua_newtable(l);
 		lua_pushinteger(l, timestamp);
 		lua_setfield(l, -2, "timestamp");
-		mumble_hook_call(client, "OnPingUDP", 1);
+		mumble_hook_call(client, HOOK_ON_PING_UDP, 1);
 
 		client->udp_ping_acc++;
 	}
@@ -228,7 +236,7 @@ static void mumble_update_ping_udp(MumbleClient* client, uint64_t timestamp, boo
 	lua_setfield(l, -2, "average");
 	lua_pushnumber(l, client->udp_ping_var);
 	lua_setfield(l, -2, "deviation");
-	mumble_hook_call(client, "OnPongUDP", 1);
+	mumble_hook_call(client, HOOK_ON_PONG_UDP, 1);
 }
 
 double mumble_update_ping_tcp(MumbleClient* client, uint64_t timestamp) {
@@ -243,6 +251,89 @@ double mumble_update_ping_tcp(MumbleClient* client, uint64_t timestamp) {
 	return delay;
 }
 
+// Reads a protobuf varint, returns false if it runs past the end of the buffer
+static bool proto_read_varint(const uint8_t** data, const uint8_t* end, uint64_t* value) {
+	uint64_t result = 0;
+
+	for (int shift = 0; shift < 64 && *data < end; shift += 7) {
+		uint8_t byte = *(*data)++;
+		result |= (uint64_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			*value = result;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Decodes a MumbleUDP.Audio message in place, with opus_data pointing into the datagram.
+// Returns false for anything unusual (positional data, unknown fields, bad encoding),
+// so the caller can fall back to the generic unpacker.
+static bool mumble_udp_audio_parse(const uint8_t* data, size_t size, MumbleUDP__Audio* audio) {
+	const uint8_t* end = data + size;
+
+	mumble_udp__audio__init(audio);
+
+	while (data < end) {
+		uint64_t tag, value;
+
+		if (!proto_read_varint(&data, end, &tag)) {
+			return false;
+		}
+
+		uint32_t field = tag >> 3;
+		uint32_t wire_type = tag & 0x07;
+
+		if (wire_type == PROTOBUF_C_WIRE_TYPE_VARINT) {
+			if (!proto_read_varint(&data, end, &value)) {
+				return false;
+			}
+
+			switch (field) {
+			case 1:
+				audio->header_case = MUMBLE_UDP__AUDIO__HEADER_TARGET;
+				audio->target = (uint32_t) value;
+				break;
+			case 2:
+				audio->header_case = MUMBLE_UDP__AUDIO__HEADER_CONTEXT;
+				audio->context = (uint32_t) value;
+				break;
+			case 3:
+				audio->sender_session = (uint32_t) value;
+				break;
+			case 4:
+				audio->frame_number = value;
+				break;
+			case 16:
+				audio->is_terminator = value != 0;
+				break;
+			default:
+				return false;
+			}
+		} else if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED && field == 5) {
+			if (!proto_read_varint(&data, end, &value) || value > (uint64_t)(end - data)) {
+				return false;
+			}
+			audio->opus_data.data = (uint8_t*) data;
+			audio->opus_data.len = value;
+			data += value;
+		} else if (wire_type == PROTOBUF_C_WIRE_TYPE_32BIT && field == 7) {
+			if (end - data < 4) {
+				return false;
+			}
+			// Little endian on the wire
+			uint32_t bits = (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+			memcpy(&audio->volume_adjustment, &bits, sizeof(bits));
+			data += 4;
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 void mumble_handle_udp_packet(MumbleClient* client, unsigned char* unencrypted, ssize_t size, bool udp) {
 	uint8_t header = unencrypted[0];
 
@@ -280,22 +371,29 @@ void mumble_handle_udp_packet(MumbleClient* client, unsigned char* unencrypted,
 	} else {
 		switch (header) {
 		case PROTO_UDP_AUDIO: {
-			MumbleUDP__Audio *audio = mumble_udp__audio__unpack(NULL, size - 1, unencrypted + 1);
+			MumbleUDP__Audio view;
+			if (mumble_udp_audio_parse(unencrypted + 1, size - 1, &view)) {
+				mumble_log(LOG_TRACE, "[UDP] Received %s: %p", view.base.descriptor->name, &view);
+				mumble_handle_speaking_hooks_protobuf(client, &view, view.sender_session);
+				return;
+			}
+
+			MumbleUDP__Audio *audio = mumble_udp__audio__unpack(&client->message_allocator, size - 1, unencrypted + 1);
 			if (audio != NULL) {
 				mumble_log(LOG_TRACE, "[UDP] Received %s: %p", audio->base.descriptor->name, audio);
 				mumble_handle_speaking_hooks_protobuf(client, audio, audio->sender_session);
-				mumble_udp__audio__free_unpacked(audio, NULL);
+				mumble_udp__audio__free_unpacked(audio, &client->message_allocator);
 			} else {
 				mumble_log(LOG_WARN, "[UDP] Error unpacking UDP audio packet");
 			}
 			return;
 		}
 		case PROTO_UDP_PING: {
-			MumbleUDP__Ping *ping = mumble_udp__ping__unpack(NULL, size - 1, unencrypted + 1);
+			MumbleUDP__Ping *ping = mumble_udp__ping__unpack(&client->message_allocator, size - 1, unencrypted + 1);
 			if (ping != NULL) {
 				mumble_log(LOG_TRACE, "[UDP] Received %s: %p", ping->base.descriptor->name, ping);
 				mumble_update_ping_udp(client, ping->timestamp, udp);
-				mumble_udp__ping__free_unpacked(ping, NULL);
+				mumble_udp__ping__free_unpacked(ping, &client->message_allocator);
 			} else {
 				mumble_log(LOG_WARN, "[UDP] Error unpacking ping packet");
 			}
@@ -312,42 +410,29 @@ void mumble_handle_udp_packet(MumbleClient* client, unsigned char* unencrypted,
 void socket_read_event_udp(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags) {
 	MumbleClient* client = (MumbleClient*) handle->data;
 
-	if (nread > 0) {
-		unsigned char unencrypted[nread];
-		memset(unencrypted, 0, sizeof(unencrypted));
+	// The receive slab is owned by the client, so there is nothing to free here
 
-		if (crypt_isValid(client->crypt) && crypt_decrypt(client->crypt, (unsigned char*) buf->base, unencrypted, nread)) {
-			mumble_handle_udp_packet(client, unencrypted, nread - 4, true);
+	if (nread > UDP_RECV_DATAGRAM_SIZE) {
+		mumble_log(LOG_ERROR, "[UDP] Dropping oversized UDP packet: %zd bytes", nread);
+	} else if (nread > 0) {
+		if (crypt_isValid(client->crypt) && crypt_decrypt(client->crypt, (unsigned char*) buf->base, client->udp_recv_decrypted, nread)) {
+			mumble_handle_udp_packet(client, client->udp_recv_decrypted, nread - 4, true);
+			mumble_message_reset(client);
 		} else {
 			mumble_log(LOG_ERROR, "[UDP] Unable to decrypt UDP packet: %x", &buf->base);
 		}
 	} else if (nread < 0) {
 		mumble_log(LOG_ERROR, "[UDP] Error receiving UDP packet: %s", uv_strerror(nread));
 	}
-
-	if (buf->base) {
-		free(buf->base);
-	}
 }
 
 void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-	buf->base = (char*) malloc(suggested_size);
-	buf->len = suggested_size;
-}
+	MumbleClient* client = (MumbleClient*) handle->data;
 
-void packet_reset(MumblePacket* packet) {
-	packet->type = 0;
-	packet->length = 0;
-	packet->header_len = 0;
-	if (packet->header) {
-		free(packet->header);
-		packet->header = NULL;
-	}
-	packet->body_len = 0;
-	if (packet->body) {
-		free(packet->body);
-		packet->body = NULL;
-	}
+	// libuv is done with the previous reads by the time it asks for a buffer again,
+	// so every read can reuse the same slab
+	buf->base = (char*) client->udp_recv_slab;
+	buf->len = UDP_RECV_DATAGRAM_SIZE * UDP_RECV_DATAGRAMS;
 }
 
 void handle_ssl_read_error(MumbleClient* client, int ret) {
@@ -360,6 +445,64 @@ void handle_ssl_read_error(MumbleClient* client, int ret) {
 	mumble_disconnect(client, mumble_ssl_error(ERR_get_error()), false);
 }
 
+// Dispatch every complete packet in the receive buffer, returns how many bytes were used up
+static size_t mumble_dispatch_tcp(MumbleClient* client, size_t *needed) {
+	lua_State* l = client->l;
+	uint8_t* data = client->tcp_recv_buffer;
+	size_t length = client->tcp_recv_length;
+	size_t offset = 0;
+
+	while (length - offset >= PACKET_HEADER_SIZE) {
+		uint16_t type;
+		uint32_t body_length;
+		memcpy(&type, data + offset, sizeof(type));
+		memcpy(&body_length, data + offset + sizeof(type), sizeof(body_length));
+		type = ntohs(type);
+		body_length = ntohl(body_length);
+
+		size_t packet_size = PACKET_HEADER_SIZE + (size_t) body_length;
+
+		if (length - offset < packet_size) {
+			// Wait for the rest of the packet
+			*needed = packet_size;
+			break;
+		}
+
+		// Handlers read the body straight out of the receive buffer
+		MumblePacket packet = {
+			.type = type,
+			.length = body_length,
+			.header_len = PACKET_HEADER_SIZE,
+			.header = data + offset,
+			.body_len = body_length,
+			.body = data + offset + PACKET_HEADER_SIZE,
+		};
+
+		offset += packet_size;
+
+		if (type >= sizeof(packet_handler) / sizeof(Packet_Handler_Func)) {
+			mumble_log(LOG_DEBUG, "received unknown packet type %u", type);
+			continue;
+		}
+
+		Packet_Handler_Func handler = packet_handler[type];
+		if (handler) {
+			lua_stackguard_entry(l);
+			handler(client, &packet);
+			lua_stackguard_exit(l);
+
+			if (!client->connected) {
+				// The handler disconnected us, our buffer is gone
+				return 0;
+			}
+
+			mumble_message_reset(client);
+		}
+	}
+
+	return offset;
+}
+
 void socket_read_event_tcp(uv_poll_t* handle, int status, int events) {
 	MumbleClient* client = (MumbleClient*) handle->data;
 	
@@ -368,84 +511,64 @@ void socket_read_event_tcp(uv_poll_t* handle, int status, int events) {
 		return;
 	}
 
-	lua_State* l = client->l;
+	if (events & client->tcp_send_waiting && client->connected) {
+		// OpenSSL can carry on writing our queued packets
+		packet_tcp_flush(client);
+	}
 
-	if (events & UV_READABLE && client->connected) {
-		// This process might take a few read events to fully complete
-		MumblePacket packet = client->tcp_read_packet;
-
-		// Setup for a new packet to be read
-		if (!packet.header) {
-			packet.header_len = 0;
-			packet.header = malloc(sizeof(uint8_t) * PACKET_HEADER_SIZE);
-			packet.body_len = 0;
-			packet.body = NULL;
-		}
-
-		// Read the header if not fully read
-		if (packet.header_len < PACKET_HEADER_SIZE) {
-			int ret = SSL_read(client->ssl,
-			                   packet.header + packet.header_len,
-			                   PACKET_HEADER_SIZE - packet.header_len);
-
-			if (ret > 0) {
-				packet.header_len += ret;
-
-				// Header complete, parse packet type and length
-				if (packet.header_len == PACKET_HEADER_SIZE) {
-					packet.type = ntohs(*(uint16_t *)packet.header);
-					packet.length = ntohl(*(uint32_t *)(packet.header + 2));
-
-					if (packet.type >= sizeof(packet_handler) / sizeof(Packet_Handler_Func)) {
-						mumble_log(LOG_DEBUG, "received unknown packet type %u", packet.type);
-						packet_reset(&packet);
-						return;
-					}
-
-					// if (packet.length > PACKET_MAX_SIZE) { // Prevent excessive allocation
-					// 	mumble_log(LOG_WARN, "packet length too large: %u", packet.length);
-					// 	packet_reset(&packet);
-					// 	return;
-					// }
-
-					// Reallocate buffer for the message body
-					packet.body = malloc(sizeof(uint8_t) * packet.length);
-					if (!packet.body) {
-						mumble_log(LOG_ERROR, "failed to create packet buffer: %s", strerror(errno));
-						packet_reset(&packet);
-						return;
-					}
-				}
-			} else {
-				handle_ssl_read_error(client, ret);
-				packet_reset(&packet);
+	if (!(events & UV_READABLE) || !client->connected) {
+		return;
+	}
+
+	// Keep reading until OpenSSL and the socket have nothing more for us
+	while (client->connected) {
+		if (client->tcp_recv_length == client->tcp_recv_size) {
+			// Buffer is full of a partial packet that is too large, grow it
+			size_t size = client->tcp_recv_size > 0 ? client->tcp_recv_size * 2 : TCP_RECV_BUFFER_SIZE;
+			uint8_t* buffer = realloc(client->tcp_recv_buffer, size);
+			if (!buffer) {
+				mumble_log(LOG_ERROR, "failed to grow packet buffer: %s", strerror(errno));
+				mumble_disconnect(client, "out of memory", false);
 				return;
 			}
+			client->tcp_recv_buffer = buffer;
+			client->tcp_recv_size = size;
 		}
 
-		// Read the message body if the header is complete
-		if (packet.header_len == PACKET_HEADER_SIZE && packet.body_len < packet.length) {
-			int ret = SSL_read(client->ssl,
-			                   packet.body + packet.body_len,
-			                   packet.length - packet.body_len);
-			if (ret > 0) {
-				packet.body_len += ret;
-
-				// Body complete, process the packet
-				if (packet.body_len == packet.length) {
-					Packet_Handler_Func handler = packet_handler[packet.type];
-					if (handler) {
-						lua_stackguard_entry(l);
-						handler(client, &packet);
-						lua_stackguard_exit(l);
-					}
-					packet_reset(&packet);
-				}
-			} else {
-				handle_ssl_read_error(client, ret);
-				packet_reset(&packet);
+		int ret = SSL_read(client->ssl,
+		                   client->tcp_recv_buffer + client->tcp_recv_length,
+		                   client->tcp_recv_size - client->tcp_recv_length);
+
+		if (ret <= 0) {
+			handle_ssl_read_error(client, ret);
+			return;
+		}
+
+		client->tcp_recv_length += ret;
+
+		size_t needed = 0;
+		size_t used = mumble_dispatch_tcp(client, &needed);
+
+		if (!client->connected) {
+			return;
+		}
+
+		// Move any partial packet to the front of the buffer
+		if (used > 0) {
+			client->tcp_recv_length -= used;
+			memmove(client->tcp_recv_buffer, client->tcp_recv_buffer + used, client->tcp_recv_length);
+		}
+
+		if (needed > client->tcp_recv_size) {
+			// Make room for the whole packet so it can be read in one go
+			uint8_t* buffer = realloc(client->tcp_recv_buffer, needed);
+			if (!buffer) {
+				mumble_log(LOG_ERROR, "failed to create packet buffer: %s", strerror(errno));
+				mumble_disconnect(client, "out of memory", false);
 				return;
 			}
+			client->tcp_recv_buffer = buffer;
+			client->tcp_recv_size = needed;
 		}
 	}
 }
@@ -474,7 +597,7 @@ void socket_write_event_tcp(uv_poll_t* handle, int status, int events) {
 			mumble_log(LOG_INFO, "%s[%d] connected to server %s:%d", METATABLE_CLIENT, client->self, address, client->port);
 
 			// Set the connected flag and trigger any connection callback
-			mumble_hook_call(client, "OnConnect", 0);
+			mumble_hook_call(client, HOOK_ON_CONNECT, 0);
 
 			uv_poll_stop(&client->ssl_poll);
 			uv_poll_start(&client->ssl_poll, UV_READABLE, socket_read_event_tcp);
@@ -506,6 +629,18 @@ void mumble_connected_tcp(uv_connect_t *req, int status) {
 	uv_poll_start(&client->ssl_poll, UV_WRITABLE, socket_write_event_tcp);
 }
 
+static void* mumble_message_alloc(void *allocator_data, size_t size) {
+	return arena_alloc(allocator_data, size);
+}
+
+static void mumble_message_free(void *allocator_data, void *pointer) {
+	// Released all at once by mumble_message_reset
+}
+
+void mumble_message_reset(MumbleClient* client) {
+	arena_reset(&client->message_arena);
+}
+
 static int mumble_client_new(lua_State *l) {
 	// The __call passes our metatable with it
 	// Remove it since we don't need it and it messes up the arument positions
@@ -527,6 +662,9 @@ static int mumble_client_new(lua_State *l) {
 
 	lua_newtable(l);
 	client->hooks = mumble_ref(l);
+	client->hook_slots = NULL;
+	client->hook_slot_count = 0;
+	client->hook_present = NULL;
 
 	lua_newtable(l);
 	client->users = mumble_ref(l);
@@ -537,6 +675,12 @@ static int mumble_client_new(lua_State *l) {
 	lua_newtable(l);
 	client->audio_streams = mumble_ref(l);
 
+	client->l = l;
+	mumble_speakevent_init(client);
+	mumble_jitter_init(client);
+	mumble_mixer_init(client);
+	mumble_framecache_init(client);
+
 	client->host = NULL;
 	client->port = 0;
 	client->self = LUA_NOREF;
@@ -555,6 +699,25 @@ static int mumble_client_new(lua_State *l) {
 	client->tcp_ping_avg = 0;
 	client->tcp_ping_var = 0;
 
+	client->udp_send_count = 0;
+	client->udp_send_free = NULL;
+	client->udp_send_free_count = 0;
+	client->udp_send_inflight = NULL;
+	client->udp_send_inflight_count = 0;
+	client->udp_recv_slab = NULL;
+	client->udp_recv_decrypted = NULL;
+
+	client->tcp_recv_buffer = NULL;
+	client->tcp_recv_size = 0;
+	client->tcp_recv_length = 0;
+
+	client->tcp_send_buffer = NULL;
+	client->tcp_send_size = 0;
+	client->tcp_send_length = 0;
+	client->tcp_send_offset = 0;
+	client->tcp_send_waiting = 0;
+	client->tcp_send_full = false;
+
 	client->udp_ping_acc = 0;
 	client->udp_packets = 0;
 	client->udp_ping_avg = 0;
@@ -568,32 +731,54 @@ static int mumble_client_new(lua_State *l) {
 	uv_mutex_init(&client->main_mutex);
 	uv_mutex_init(&client->inner_mutex);
 
-	client->user_list = NULL;
-	client->channel_list = NULL;
+	map_init(&client->user_map);
+	map_init(&client->channel_map);
+	map_init(&client->channel_users);
+	map_init(&client->channel_children);
 	client->audio_pipes = NULL;
 
 	client->recording = false;
+	client->recording_users = 0;
+	client->record_workers = NULL;
 
 	client->audio_stream_active = false;
 
-	// Create a thread that buffers the reading of open audio files
-	client->audio_buffer_thread_running = true;
-	uv_thread_create(&client->audio_buffer_thread, mumble_audio_buffer_thread, client);
+	arena_init(&client->audio_mix_arena, AUDIO_ARENA_SIZE);
+
+	arena_init(&client->message_arena, MESSAGE_ARENA_SIZE);
+	client->message_allocator.alloc = mumble_message_alloc;
+	client->message_allocator.free = mumble_message_free;
+	client->message_allocator.allocator_data = &client->message_arena;
+
+	// Clients created after mumble.useSharedAudio() leave their audio to the shared threads
+	client->audio_shared = mumble_audiopool_enabled();
+	client->audio_tasks = 0;
+
+	// Create the threads that buffer the reading of open audio files
+	mumble_audio_buffer_start(client);
 
 	// Create a thread that handles the playback of audio
 	client->audio_playback_thread_running = true;
 	client->audio_playback_async_pending = false;
 	client->audio_playback_last = uv_hrtime();
 	client->audio_playback_next = client->audio_playback_last;
-	uv_thread_create(&client->audio_playback_thread, mumble_audio_playback_thread, client);
+	if (!client->audio_shared) {
+		uv_thread_create(&client->audio_playback_thread, mumble_audio_playback_thread, client);
+	}
 
 	uv_async_init(uv_default_loop(), &client->audio_playback_async, mumble_audio_playback_async);
+	uv_async_init(uv_default_loop(), &client->audio_send_async, mumble_audio_send_async);
 
 	mumble_audio_queue_init(&client->audio_encode_queue);
 	mumble_audio_queue_init(&client->audio_send_queue);
+	mumble_audio_work_pool_init(client);
+
+	mumble_audio_encode_start(client);
 
-	client->audio_encode_thread_running = true;
-	uv_thread_create(&client->audio_encode_thread, mumble_audio_encode_thread, client);
+	if (client->audio_shared) {
+		// Everything is set up, so the shared clock can start playing our audio
+		mumble_audiopool_attach(client);
+	}
 
 	return 1;
 }
@@ -698,27 +883,40 @@ int mumble_client_connect(lua_State *l) {
 
 	client->encoder_ref = mumble_ref(l);
 
-	client->decoder = opus_decoder_create(AUDIO_SAMPLE_RATE, AUDIO_PLAYBACK_CHANNELS, &err);
-
-	if (err != OPUS_OK) {
-		mumble_client_free(client);
-		lua_pushboolean(l, false);
-		lua_pushfstring(l, "could not initialize opus decoder: %s", opus_strerror(err));
-		return 2;
-	}
-
 	opus_encoder_ctl(client->encoder, OPUS_SET_VBR(0));
 	opus_encoder_ctl(client->encoder, OPUS_SET_BITRATE(AUDIO_DEFAULT_BITRATE));
 
 	client->socket_tcp.data = (void*) client;
 	client->socket_udp.data = (void*) client;
+	client->send_flush.data = (void*) client;
+	client->send_flush_prepare.data = (void*) client;
 	client->ping_timer.data = (void*) client;
+	client->jitter_timer.data = (void*) client;
 	client->audio_playback_async.data = (void*) client;
+	client->audio_send_async.data = (void*) client;
 
 	uv_loop_t* loop = uv_default_loop();
 
 	uv_tcp_init(loop, &client->socket_tcp);
+
+#if UV_VERSION_HEX >= 0x012800
+	// Read multiple datagrams per system call
+	uv_udp_init_ex(loop, &client->socket_udp, AF_UNSPEC | UV_UDP_RECVMMSG);
+#else
 	uv_udp_init(loop, &client->socket_udp);
+#endif
+
+	if (client->udp_recv_slab == NULL) {
+		client->udp_recv_slab = malloc(UDP_RECV_DATAGRAM_SIZE * UDP_RECV_DATAGRAMS);
+		client->udp_recv_decrypted = malloc(UDP_RECV_DATAGRAM_SIZE);
+	}
+
+	if (client->udp_recv_slab == NULL || client->udp_recv_decrypted == NULL) {
+		mumble_client_free(client);
+		lua_pushboolean(l, false);
+		lua_pushfstring(l, "could not allocate udp receive buffers: %s", strerror(errno));
+		return 2;
+	}
 
 	err = uv_tcp_connect(&client->tcp_connect_req, &client->socket_tcp, client->server_host_tcp->ai_addr, mumble_connected_tcp);
 	if (err) {
@@ -737,7 +935,7 @@ int mumble_client_connect(lua_State *l) {
 	}
 
 	fcntl(client->socket_tcp_fd, F_SETFL, O_NONBLOCK);
-	SSL_set_mode(client->ssl, SSL_MODE_ASYNC | SSL_MODE_ENABLE_PARTIAL_WRITE);
+	SSL_set_mode(client->ssl, SSL_MODE_ASYNC | SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
 	if (SSL_set_fd(client->ssl, client->socket_tcp_fd) == 0) {
 		mumble_client_free(client);
@@ -756,9 +954,18 @@ int mumble_client_connect(lua_State *l) {
 
 	uv_udp_recv_start(&client->socket_udp, alloc_buffer, socket_read_event_udp);
 
+	// Flush any TCP and UDP packets we queued up, both before the loop waits for I/O and after handling it
+	uv_prepare_init(loop, &client->send_flush_prepare);
+	uv_prepare_start(&client->send_flush_prepare, packet_flush_prepare);
+	uv_check_init(loop, &client->send_flush);
+	uv_check_start(&client->send_flush, packet_flush_check);
+
 	// Create a timer to constantly send out pings to the server
 	uv_timer_init(loop, &client->ping_timer);
 
+	// Plays received voice out of each users jitter buffer, only runs while someone is talking
+	uv_timer_init(loop, &client->jitter_timer);
+
 	// Register ourself in the list of connected clients
 	lua_pushvalue(l, 1);
 	client->self = mumble_registry_ref(l, MUMBLE_CLIENTS);
@@ -818,9 +1025,16 @@ uint64_t mumble_adjust_audio_bandwidth(MumbleClient *client) {
 
 	if (bitrate != original_bitrate) {
 		mumble_log(LOG_WARN, "Server maximum network bandwidth is only %d kbit/s. Audio quality auto-adjusted to %d kbit/s (%d ms)", maxbitrate / 1000, bitrate / 1000, frames * 10);
-		client->audio_frames = frames * 10;
+		if (client->audio_shared) {
+			mumble_audiopool_set_frames(client, frames * 10);
+		} else {
+			client->audio_frames = frames * 10;
+		}
 		opus_encoder_ctl(client->encoder, OPUS_SET_BITRATE(bitrate));
 
+		// Recorded frames were encoded with settings we no longer use
+		mumble_framecache_clear(client);
+
 		if (bitrate >= 64000) {
 			opus_encoder_ctl(client->encoder, OPUS_SET_APPLICATION(OPUS_APPLICATION_AUDIO));
 			opus_encoder_ctl(client->encoder, OPUS_SET_SIGNAL(OPUS_AUTO));    // Let Opus decide dynamically
@@ -862,6 +1076,33 @@ static int mumble_stop(lua_State *l) {
 }
 
 static void mumble_client_free(MumbleClient *client) {
+	packet_udp_free_pool(client);
+
+	if (client->udp_recv_slab) {
+		free(client->udp_recv_slab);
+		client->udp_recv_slab = NULL;
+	}
+	if (client->udp_recv_decrypted) {
+		free(client->udp_recv_decrypted);
+		client->udp_recv_decrypted = NULL;
+	}
+	if (client->tcp_recv_buffer) {
+		free(client->tcp_recv_buffer);
+		client->tcp_recv_buffer = NULL;
+	}
+	client->tcp_recv_size = 0;
+	client->tcp_recv_length = 0;
+
+	if (client->tcp_send_buffer) {
+		free(client->tcp_send_buffer);
+		client->tcp_send_buffer = NULL;
+	}
+	client->tcp_send_size = 0;
+	client->tcp_send_length = 0;
+	client->tcp_send_offset = 0;
+	client->tcp_send_waiting = 0;
+	client->tcp_send_full = false;
+
 	if (client->host) {
 		free(client->host);
 		client->host = NULL;
@@ -892,18 +1133,16 @@ static void mumble_client_free(MumbleClient *client) {
 		client->server_host_tcp = NULL;
 	}
 
-	if (client->decoder != NULL) {
-		opus_decoder_destroy(client->decoder);
-	}
+	mumble_record_shutdown(client);
 
-	if (client->audio_buffer_thread) {
-		uv_mutex_lock(&client->main_mutex);
-		client->audio_buffer_thread_running = false;
-		uv_mutex_unlock(&client->main_mutex);
-		uv_thread_join(&client->audio_buffer_thread);
+	if (client->audio_shared) {
+		// Stop the shared clock, and wait on anything the shared workers are still doing for us
+		mumble_audiopool_detach(client);
 	}
 
-	if (client->audio_playback_thread) {
+	mumble_audio_buffer_shutdown(client);
+
+	if (!client->audio_shared && client->audio_playback_thread) {
 		uv_mutex_lock(&client->main_mutex);
 		client->audio_playback_thread_running = false;
 		uv_mutex_unlock(&client->main_mutex);
@@ -912,11 +1151,25 @@ static void mumble_client_free(MumbleClient *client) {
 
 	mumble_audio_queue_shutdown(client);
 
+	arena_free(&client->audio_mix_arena);
+
 	uv_mutex_destroy(&client->main_mutex);
 	uv_mutex_destroy(&client->inner_mutex);
 }
 
 static void mumble_client_cleanup(MumbleClient *client) {
+	if (uv_is_active((uv_handle_t*) &client->send_flush_prepare)) {
+		uv_prepare_stop(&client->send_flush_prepare);
+		uv_close((uv_handle_t*) &client->send_flush_prepare, NULL);
+	}
+
+	if (uv_is_active((uv_handle_t*) &client->send_flush)) {
+		uv_check_stop(&client->send_flush);
+		uv_close((uv_handle_t*) &client->send_flush, NULL);
+	}
+
+	packet_udp_discard(client);
+
 	if (uv_is_active((uv_handle_t*) &client->socket_udp)) {
 		uv_close((uv_handle_t*) &client->socket_udp, NULL);
 	}
@@ -943,6 +1196,10 @@ static void mumble_client_cleanup(MumbleClient *client) {
 		uv_close((uv_handle_t*)&client->audio_playback_async, NULL);
 	}
 
+	if (uv_is_active((uv_handle_t*) &client->audio_send_async)) {
+		uv_close((uv_handle_t*)&client->audio_send_async, NULL);
+	}
+
 	uv_mutex_lock(&client->main_mutex);
 	LinkNode* current = client->stream_list;
 
@@ -956,28 +1213,47 @@ static void mumble_client_cleanup(MumbleClient *client) {
 	}
 	uv_mutex_unlock(&client->main_mutex);
 
-	current = client->user_list;
+	size_t iter = 0;
+	void* value;
 
-	if (current) {
-		// Cleanup our user objects
-		while (current != NULL) {
-			LinkNode* next = current->next;
-			mumble_user_remove(client, current->index);
-			current = next;
+	// Finish any recordings, since the recording threads are about to be stopped
+	while (map_next(&client->user_map, &iter, NULL, &value)) {
+		MumbleUser* user = value;
+		if (user->recorder != NULL) {
+			mumble_jitter_drain(client, user);
+			mumble_handle_record_silence(client, user);
+			mumble_record_stop(client, user);
 		}
 	}
 
-	current = client->channel_list;
+	// The mix only lives as long as the connection
+	mumble_mixer_stop(client);
 
-	if (current) {
-		// Cleanup our channel objects
-		while (current != NULL) {
-			LinkNode* next = current->next;
-			mumble_channel_remove(client, current->index);
-			current = next;
+	// Frames still waiting to be encoded are thrown away, so whatever was being recorded is incomplete
+	mumble_framecache_record_abort(client);
+
+	// Cleanup our user objects
+	for (size_t i = 0; i < client->user_map.capacity; i++) {
+		// Removing an entry can shift another one back into this slot
+		while (client->user_map.values != NULL && client->user_map.values[i] != NULL) {
+			mumble_user_remove(client, client->user_map.keys[i]);
 		}
 	}
 
+	mumble_jitter_shutdown(client);
+
+	// Cleanup our channel objects
+	for (size_t i = 0; i < client->channel_map.capacity; i++) {
+		while (client->channel_map.values != NULL && client->channel_map.values[i] != NULL) {
+			mumble_channel_remove(client, client->channel_map.keys[i]);
+		}
+	}
+
+	map_free(&client->user_map);
+	map_free(&client->channel_map);
+	map_group_free(&client->channel_users);
+	map_group_free(&client->channel_children);
+
 	if (client->self > LUA_REFNIL) {
 		// Remove from the connected clients list
 		list_remove(&mumble_clients, client->self);
@@ -1002,7 +1278,7 @@ void mumble_disconnect(MumbleClient *client, const char* reason, bool garbagecol
 		// Only call "OnDisconnect" hook if we weren't garbage collected
 		mumble_log(LOG_INFO, "%s[%d] disconnected from server: %s", METATABLE_CLIENT, client->self, reason);
 		lua_pushstring(l, reason);
-		mumble_hook_call(client, "OnDisconnect", 1);
+		mumble_hook_call(client, HOOK_ON_DISCONNECT, 1);
 	}
 
 	mumble_client_cleanup(client);
@@ -1025,6 +1301,64 @@ static int mumble_getTime(lua_State *l) {
 	return 1;
 }
 
+static int mumble_setAudioCacheSize(lua_State *l) {
+	lua_Integer bytes = luaL_checkinteger(l, 1);
+	if (bytes < 0) {
+		return luaL_argerror(l, 1, "must not be negative");
+	}
+	mumble_audiocache_set_capacity((size_t) bytes);
+	return 0;
+}
+
+static int mumble_getAudioCacheSize(lua_State *l) {
+	size_t bytes, capacity, count;
+	mumble_audiocache_stats(&bytes, &capacity, &count);
+	lua_pushinteger(l, bytes);
+	lua_pushinteger(l, capacity);
+	lua_pushinteger(l, count);
+	return 3;
+}
+
+static int mumble_clearAudioCache(lua_State *l) {
+	mumble_audiocache_clear();
+	return 0;
+}
+
+static unsigned int mumble_parallelism(void) {
+#if UV_VERSION_HEX >= 0x012C00
+	return uv_available_parallelism();
+#else
+	// uv_available_parallelism was added in libuv 1.44
+	uv_cpu_info_t* cpus;
+	int count;
+	if (uv_cpu_info(&cpus, &count) != 0) {
+		return 1;
+	}
+	uv_free_cpu_info(cpus, count);
+	return count > 0 ? count : 1;
+#endif
+}
+
+static int mumble_useSharedAudio(lua_State *l) {
+	lua_Integer threads = luaL_optinteger(l, 1, mumble_parallelism());
+	if (threads < 1) {
+		return luaL_argerror(l, 1, "must be at least 1");
+	}
+	lua_pushboolean(l, mumble_audiopool_enable((unsigned int) threads));
+	return 1;
+}
+
+static int mumble_getSharedAudioThreads(lua_State *l) {
+	lua_pushinteger(l, mumble_audiopool_size());
+	return 1;
+}
+
+static int mumble_module_gc(lua_State *l) {
+	// Every client of this state was collected before us, since we were created first
+	mumble_audiopool_release();
+	return 0;
+}
+
 static int mumble_getConnections(lua_State *l) {
 	mumble_pushref(l, MUMBLE_CLIENTS);
 	return 1;
@@ -1037,22 +1371,28 @@ int mumble_traceback(lua_State *l) {
 	return 1;
 }
 
-int mumble_hook_call(MumbleClient *client, const char* hook, int nargs) {
+int mumble_hook_call(MumbleClient *client, int hook, int nargs) {
 	return mumble_hook_call_ret(client, hook, nargs, 0);
 }
 
-int mumble_hook_call_ret(MumbleClient *client, const char* hook, int nargs, int nresults) {
+int mumble_hook_call_ret(MumbleClient *client, int hook, int nargs, int nresults) {
 	//lua_stackguard_entry(l);
 
 	lua_State* l = client->l;
 
+	if (!mumble_hook_active(client, hook)) {
+		// Nobody is listening, just pop whatever we expected to get popped
+		lua_pop(l, nargs);
+		return 0;
+	}
+
 	if (client->self <= LUA_NOREF) {
 		lua_pop(l, nargs); // Just pop whatever we expected to get popped
-		mumble_log(LOG_DEBUG, "unreferenced %s: %p hook \"%s\" ignored", METATABLE_CLIENT, client, hook);
+		mumble_log(LOG_DEBUG, "unreferenced %s: %p hook \"%s\" ignored", METATABLE_CLIENT, client, mumble_hook_name(hook));
 		return 0;
 	}
 
-	mumble_log(LOG_TRACE, "%s: %p calling hook \"%s\" with %d args", METATABLE_CLIENT, client, hook, nargs);
+	mumble_log(LOG_TRACE, "%s: %p calling hook \"%s\" with %d args", METATABLE_CLIENT, client, mumble_hook_name(hook), nargs);
 
 	const int top = lua_gettop(l);
 	const int callargs = nargs + 1;
@@ -1061,92 +1401,68 @@ int mumble_hook_call_ret(MumbleClient *client, const char* hook, int nargs, int
 	int returned = false;
 	int nreturns = 0;
 
-	// Get hook table
-	mumble_pushref(l, client->hooks);
+	// A callback can add or remove callbacks, so look the slot up again every time
+	mumble_hook_dispatch_begin(client, hook);
 
-	// Get the table of callbacks
-	lua_getfield(l, -1, hook);
+	for (size_t i = 0; i < client->hook_slots[hook].count; i++) {
+		int callback = client->hook_slots[hook].callbacks[i].callback;
 
-	// Remove hook table from stack
-	lua_remove(l, -2);
-
-	// if getfield returned nil OR the returned value is NOT a table..
-	if (lua_isnil(l, -1) == 1 || lua_istable(l, -1) == 0) {
-		// Pop the nil or nontable value
-		lua_pop(l, 1);
+		if (callback == LUA_NOREF) {
+			// Removed by an earlier callback
+			continue;
+		}
 
-		// Exit if we have no hook to call
-		goto exit;
-	}
+		// Push the callback
+		mumble_pushref(l, callback);
 
-	// Push nil, needed for lua_next
-	lua_pushnil(l);
+		// Push the client the hook is for
+		mumble_client_raw_get(client);
 
-	while (lua_next(l, -2)) {
-		// Copy key..
-		lua_pushvalue(l, -2);
+		for (int i = 1; i <= nargs; i++) {
+			// Push a copy of the argument
+			lua_pushvalue(l, argpos + i);
+		}
 
-		// Check value
-		if (lua_isfunction(l, -2)) {
-			// Copy function
-			lua_pushvalue(l, -2);
+		// Call
+		if (erroring == true) {
+			// If the user errors within the OnError hook, PANIC
+			lua_call(l, callargs, 0);
+		} else {
+			// Place traceback immediately before the function we're calling
+			const int base = lua_gettop(l) - callargs; // index of function
+			lua_pushcfunction(l, mumble_traceback);
+			lua_insert(l, base); // ... err func args
+
+			// NOTE: nresults may be LUA_MULTRET
+			if (lua_pcall(l, callargs, nresults, base) != 0) {
+				// Call errored, call OnError hook
+				erroring = true;
+				mumble_log(LOG_ERROR, "%s", lua_tostring(l, -1));
+				mumble_hook_call(client, HOOK_ON_ERROR, 1);
+				erroring = false;
+
+				// Remove the traceback function
+				lua_remove(l, base);
+			} else {
+				// Success: results are on top, traceback still at 'base'
+				const int after = lua_gettop(l);
+				const int nret = after - base; // actual number of returns (works for LUA_MULTRET)
 
-			// Push the client the hook is for
-			mumble_client_raw_get(client);
+				// Remove the traceback function first
+				lua_remove(l, base);
 
-			for (int i = 1; i <= nargs; i++) {
-				// Push a copy of the argument
-				lua_pushvalue(l, argpos + i);
-			}
-
-			// Call
-			if (erroring == true) {
-				// If the user errors within the OnError hook, PANIC
-				lua_call(l, callargs, 0);
-			} else {
-				// Place traceback immediately before the function we're calling
-				const int base = lua_gettop(l) - callargs; // index of function
-				lua_pushcfunction(l, mumble_traceback);
-				lua_insert(l, base); // ... err func args
-
-				// NOTE: nresults may be LUA_MULTRET
-				if (lua_pcall(l, callargs, nresults, base) != 0) {
-					// Call errored, call OnError hook
-					erroring = true;
-					mumble_log(LOG_ERROR, "%s", lua_tostring(l, -1));
-					mumble_hook_call(client, "OnError", 1);
-					erroring = false;
-
-					// Pop error message and remove the traceback function
-					lua_pop(l, 1);
-					lua_remove(l, base);
+				if (!returned && nret > 0) {
+					nreturns = nret; // keep how many we got
+					returned = true; // results are already at TOP
 				} else {
-					// Success: results are on top, traceback still at 'base'
-					const int after = lua_gettop(l);
-					const int nret = after - base; // actual number of returns (works for LUA_MULTRET)
-
-					// Remove the traceback function first
-					lua_remove(l, base);
-
-					if (!returned && nret > 0) {
-						nreturns = nret; // keep how many we got
-						returned = true; // results are already at TOP
-					} else {
-						// ignoring returns from subsequent hooks
-						lua_pop(l, nret);
-					}
+					// ignoring returns from subsequent hooks
+					lua_pop(l, nret);
 				}
 			}
 		}
-
-		// Pop the key and value..
-		lua_pop(l, 2);
 	}
 
-	// Pop the hook table
-	lua_pop(l, 1);
-
-exit:
+	mumble_hook_dispatch_end(client, hook);
 
 	// Call exit early, since mumble_hook_call removes the function called and its arguments from the stack
 	//lua_stackguard_exit(l);
@@ -1199,12 +1515,15 @@ MumbleUser* mumble_user_get(MumbleClient* client, uint32_t session) {
 			user->texture_hash_len = 0;
 			user->hash = NULL;
 			user->listens = NULL;
-			user->recording_file = NULL;
+			user->recorder = NULL;
+			user->jitter = NULL;
 		}
 		luaL_getmetatable(l, METATABLE_USER);
 		lua_setmetatable(l, -2);
 
-		list_add(&client->user_list, session, user);
+		map_set(&client->user_map, session, user);
+		// New users start out in the root channel, until a UserState tells us otherwise
+		map_group_add(&client->channel_users, user->channel_id, session, user);
 		mumble_log(LOG_TRACE, "added user session: %u (user=%p)", session, user);
 
 		lua_pushinteger(l, session);
@@ -1246,7 +1565,21 @@ void mumble_user_remove(MumbleClient* client, uint32_t session) {
 	lua_pushnil(l);
 	lua_settable(l, -3);
 	lua_pop(l, 1);
-	list_remove(&client->user_list, session);
+
+	MumbleUser* user = map_remove(&client->user_map, session);
+	if (user != NULL) {
+		mumble_jitter_free(client, user);
+		map_group_remove(&client->channel_users, user->channel_id, session);
+	}
+}
+
+void mumble_user_set_channel(MumbleClient* client, MumbleUser* user, uint32_t channel_id) {
+	if (user->channel_id == channel_id) {
+		return;
+	}
+	map_group_remove(&client->channel_users, user->channel_id, user->session);
+	user->channel_id = channel_id;
+	map_group_add(&client->channel_users, channel_id, user->session, user);
 }
 
 void mumble_channel_raw_get(MumbleClient* client, uint32_t channel_id) {
@@ -1288,7 +1621,11 @@ MumbleChannel* mumble_channel_get(MumbleClient* client, uint32_t channel_id) {
 		lua_setmetatable(l, -2);
 
 		mumble_log(LOG_TRACE, "added channel: %u (channel=%p)", channel_id, channel);
-		list_add(&client->channel_list, channel_id, channel);
+		map_set(&client->channel_map, channel_id, channel);
+		if (channel_id != channel->parent) {
+			// New channels start out as children of the root channel, until a ChannelState tells us otherwise
+			map_group_add(&client->channel_children, channel->parent, channel_id, channel);
+		}
 
 		lua_pushinteger(l, channel_id);
 		lua_pushvalue(l, -2); // Push a copy of the new channel object
@@ -1309,7 +1646,24 @@ void mumble_channel_remove(MumbleClient* client, uint32_t channel_id) {
 	lua_pushnil(l);
 	lua_settable(l, -3);
 	lua_pop(l, 1);
-	list_remove(&client->channel_list, channel_id);
+
+	MumbleChannel* channel = map_remove(&client->channel_map, channel_id);
+	if (channel != NULL) {
+		map_group_remove(&client->channel_children, channel->parent, channel_id);
+	}
+}
+
+void mumble_channel_set_parent(MumbleClient* client, MumbleChannel* channel, uint32_t parent) {
+	if (channel->parent == parent) {
+		return;
+	}
+	if (channel->channel_id != channel->parent) {
+		map_group_remove(&client->channel_children, channel->parent, channel->channel_id);
+	}
+	channel->parent = parent;
+	if (channel->channel_id != parent) {
+		map_group_add(&client->channel_children, parent, channel->channel_id, channel);
+	}
 }
 
 int mumble_push_address(lua_State* l, ProtobufCBinaryData address) {
@@ -1360,20 +1714,8 @@ int mumble_push_address(lua_State* l, ProtobufCBinaryData address) {
 }
 
 void mumble_update_recording_status(MumbleClient* client) {
-	LinkNode* current = client->user_list;
-
-	bool isRecordingUser = false;
-
-	while (current != NULL) {
-		MumbleUser *user = current->data;
-
-		if (user->recording_file != NULL) {
-			isRecordingUser = true;
-			break;
-		}
-
-		current = current->next;
-	}
+	// Mixing everything we hear counts as recording everyone
+	bool isRecordingUser = client->recording_users > 0 || mumble_mixer_active(client);
 
 	if (client->recording != isRecordingUser) {
 		client->recording = isRecordingUser;
@@ -1391,7 +1733,7 @@ void mumble_update_recording_status(MumbleClient* client) {
 }
 
 void mumble_handle_record_silence(MumbleClient* client, MumbleUser* user) {
-	if (user->recording_file != NULL) {
+	if (user->recorder != NULL) {
 		uint64_t now = uv_now(uv_default_loop());
 		uint64_t silence_duration = now - user->last_spoke;
 
@@ -1399,41 +1741,12 @@ void mumble_handle_record_silence(MumbleClient* client, MumbleUser* user) {
 		int silence_samples = (silence_duration / 1000.0) * AUDIO_SAMPLE_RATE * AUDIO_PLAYBACK_CHANNELS;
 
 		if (silence_samples > 0) {
-			float *silence_buffer = (float *)calloc(silence_samples, sizeof(float));
-			if (silence_buffer) {
-				sf_write_float(user->recording_file, silence_buffer, silence_samples);
-				free(silence_buffer);
-			} else {
-				mumble_log(LOG_ERROR, "Failed to allocate memory for silence buffer (%d samples)", silence_samples);
-			}
+			// Written out by the recording thread
+			mumble_record_silence(client, user, silence_samples);
 		}
 	}
 }
 
-static void mumble_handle_record(MumbleClient* client, MumbleUser* user, const unsigned char* encoded, size_t endoded_len) {
-	if (user->recording_file != NULL) {
-		int samples_per_channel = opus_decoder_get_nb_samples(client->decoder, encoded, endoded_len);
-		int total_samples = samples_per_channel * AUDIO_PLAYBACK_CHANNELS;
-
-		float *pcm = (float *)malloc(sizeof(float) * total_samples);
-		if (!pcm) {
-			mumble_log(LOG_ERROR, "failed to allocate PCM buffer");
-			return;
-		}
-
-		opus_int32 pcmlen = opus_decode_float(client->decoder, encoded, endoded_len, pcm, samples_per_channel, 0);
-		if (pcmlen < 0) {
-			mumble_log(LOG_ERROR, "opus decoding error: %s", opus_strerror(pcmlen));
-			free(pcm);
-			return;
-		}
-
-		sf_write_float(user->recording_file, pcm, pcmlen * AUDIO_PLAYBACK_CHANNELS);
-
-		free(pcm);
-	}
-}
-
 void mumble_handle_speaking_hooks_protobuf(MumbleClient* client, MumbleUDP__Audio *audio, uint32_t session) {
 	lua_State* l = client->l;
 	lua_stackguard_entry(l);
@@ -1454,40 +1767,34 @@ void mumble_handle_speaking_hooks_protobuf(MumbleClient* client, MumbleUDP__Audi
 	}
 
 	if (one_frame || (state_change && speaking)) {
-		mumble_user_raw_get(client, session);
-		mumble_hook_call(client, "OnUserStartSpeaking", 1);
-		mumble_handle_record_silence(client, user);
+		if (mumble_hook_active(client, HOOK_ON_USER_START_SPEAKING)) {
+			mumble_user_raw_get(client, session);
+			mumble_hook_call(client, HOOK_ON_USER_START_SPEAKING, 1);
+		}
 	}
 
-	mumble_handle_record(client, user, audio->opus_data.data, audio->opus_data.len);
+	if (mumble_jitter_wanted(client, user)) {
+		// Reordered and decoded on the jitter buffer clock
+		mumble_jitter_push(client, user, sequence, audio->opus_data.data, audio->opus_data.len, speaking);
+	}
 
-	lua_newtable(l);
-	lua_pushnumber(l, LEGACY_UDP_OPUS);
-	lua_setfield(l, -2, "codec");
-	lua_pushnumber(l, audio->target);
-	lua_setfield(l, -2, "target");
-	lua_pushnumber(l, sequence);
-	lua_setfield(l, -2, "sequence");
-	mumble_user_raw_get(client, session);
-	lua_setfield(l, -2, "user");
-	lua_pushboolean(l, speaking);
-	lua_setfield(l, -2, "speaking");
-	lua_pushlstring(l, (char*) audio->opus_data.data, audio->opus_data.len);
-	lua_setfield(l, -2, "data");
-	lua_pushinteger(l, audio->context);
-	lua_setfield(l, -2, "context");
-	lua_pushinteger(l, opus_packet_get_nb_channels(audio->opus_data.data));
-	lua_setfield(l, -2, "channels");
-	lua_pushinteger(l, opus_packet_get_bandwidth(audio->opus_data.data));
-	lua_setfield(l, -2, "bandwidth");
-	lua_pushinteger(l, opus_packet_get_samples_per_frame(audio->opus_data.data, AUDIO_SAMPLE_RATE));
-	lua_setfield(l, -2, "samples_per_frame");
-	mumble_hook_call(client, "OnUserSpeak", 1);
+	if (mumble_hook_active(client, HOOK_ON_USER_SPEAK)) {
+		MumbleSpeakEvent* event = mumble_speakevent_push(client, session, audio->opus_data.data, audio->opus_data.len);
+		event->codec = LEGACY_UDP_OPUS;
+		event->target = audio->target;
+		event->sequence = sequence;
+		event->speaking = speaking;
+		event->has_context = true;
+		event->context = audio->context;
+		mumble_hook_call(client, HOOK_ON_USER_SPEAK, 1);
+		mumble_speakevent_release(event);
+	}
 
 	if (one_frame || (state_change && !speaking)) {
-		mumble_user_raw_get(client, session);
-		mumble_hook_call(client, "OnUserStopSpeaking", 1);
-		user->last_spoke = uv_now(uv_default_loop());
+		if (mumble_hook_active(client, HOOK_ON_USER_STOP_SPEAKING)) {
+			mumble_user_raw_get(client, session);
+			mumble_hook_call(client, HOOK_ON_USER_STOP_SPEAKING, 1);
+		}
 	}
 
 	lua_stackguard_exit(l);
@@ -1527,38 +1834,32 @@ void mumble_handle_speaking_hooks_legacy(MumbleClient* client, uint8_t buffer[],
 	}
 
 	if (one_frame || (state_change && speaking)) {
-		mumble_user_raw_get(client, session);
-		mumble_hook_call(client, "OnUserStartSpeaking", 1);
-		mumble_handle_record_silence(client, user);
+		if (mumble_hook_active(client, HOOK_ON_USER_START_SPEAKING)) {
+			mumble_user_raw_get(client, session);
+			mumble_hook_call(client, HOOK_ON_USER_START_SPEAKING, 1);
+		}
 	}
 
-	mumble_handle_record(client, user, buffer + read, payload_len);
+	if (codec == LEGACY_UDP_OPUS && mumble_jitter_wanted(client, user)) {
+		// Reordered and decoded on the jitter buffer clock
+		mumble_jitter_push(client, user, sequence, buffer + read, payload_len, speaking);
+	}
 
-	lua_newtable(l);
-	lua_pushnumber(l, codec);
-	lua_setfield(l, -2, "codec");
-	lua_pushnumber(l, target);
-	lua_setfield(l, -2, "target");
-	lua_pushnumber(l, sequence);
-	lua_setfield(l, -2, "sequence");
-	mumble_user_raw_get(client, session);
-	lua_setfield(l, -2, "user");
-	lua_pushboolean(l, speaking);
-	lua_setfield(l, -2, "speaking");
-	lua_pushlstring(l, (char*) buffer + read, payload_len);
-	lua_setfield(l, -2, "data");
-	lua_pushinteger(l, opus_packet_get_nb_channels(buffer + read));
-	lua_setfield(l, -2, "channels");
-	lua_pushinteger(l, opus_packet_get_bandwidth(buffer + read));
-	lua_setfield(l, -2, "bandwidth");
-	lua_pushinteger(l, opus_packet_get_samples_per_frame(buffer + read, AUDIO_SAMPLE_RATE));
-	lua_setfield(l, -2, "samples_per_frame");
-	mumble_hook_call(client, "OnUserSpeak", 1);
+	if (mumble_hook_active(client, HOOK_ON_USER_SPEAK)) {
+		MumbleSpeakEvent* event = mumble_speakevent_push(client, session, buffer + read, payload_len);
+		event->codec = codec;
+		event->target = target;
+		event->sequence = sequence;
+		event->speaking = speaking;
+		mumble_hook_call(client, HOOK_ON_USER_SPEAK, 1);
+		mumble_speakevent_release(event);
+	}
 
 	if (one_frame || (state_change && !speaking)) {
-		mumble_user_raw_get(client, session);
-		mumble_hook_call(client, "OnUserStopSpeaking", 1);
-		user->last_spoke = uv_now(uv_default_loop());
+		if (mumble_hook_active(client, HOOK_ON_USER_STOP_SPEAKING)) {
+			mumble_user_raw_get(client, session);
+			mumble_hook_call(client, HOOK_ON_USER_STOP_SPEAKING, 1);
+		}
 	}
 
 	lua_stackguard_exit(l);
@@ -1572,6 +1873,11 @@ const luaL_Reg mumble[] = {
 	{"getTime", mumble_getTime},
 	{"getConnections", mumble_getConnections},
 	{"getClients", mumble_getConnections},
+	{"setAudioCacheSize", mumble_setAudioCacheSize},
+	{"getAudioCacheSize", mumble_getAudioCacheSize},
+	{"clearAudioCache", mumble_clearAudioCache},
+	{"useSharedAudio", mumble_useSharedAudio},
+	{"getSharedAudioThreads", mumble_getSharedAudioThreads},
 	{NULL, NULL}
 };
 
@@ -1589,6 +1895,8 @@ int luaopen_mumble(lua_State *l) {
 	}
 #endif
 
+	mix_init();
+
 	lua_newtable(l);
 	MUMBLE_REGISTRY = luaL_ref(l, LUA_REGISTRYINDEX);
 
@@ -1607,6 +1915,15 @@ int luaopen_mumble(lua_State *l) {
 	lua_newtable(l);
 	MUMBLE_DATA_REG = mumble_ref(l);
 
+	// Collected when the state is closed, so the shared audio threads don't outlive the last state using them
+	mumble_audiopool_retain();
+	lua_newuserdata(l, 1);
+	lua_newtable(l);
+	lua_pushcfunction(l, mumble_module_gc);
+	lua_setfield(l, -2, "__gc");
+	lua_setmetatable(l, -2);
+	luaL_ref(l, LUA_REGISTRYINDEX);
+
 #if LUA_VERSION_NUM >= 502
 	luaL_newlib(l, mumble);
 #else
@@ -1759,6 +2076,11 @@ int luaopen_mumble(lua_State *l) {
 		luaL_register(l, NULL, mumble_channel);
 		lua_setfield(l, -2, "channel");
 
+		// Register speak event metatable
+		luaL_newmetatable(l, METATABLE_SPEAKEVENT);
+		luaL_register(l, NULL, mumble_speakevent);
+		lua_setfield(l, -2, "speakevent");
+
 		// Register encoder metatable
 		luaL_newmetatable(l, METATABLE_ENCODER);
 		{
@@ -4,6 +4,7 @@
 #include "proto/MumbleUDP.pb-c.h"
 
 #include "types.h"
+#include "hook.h"
 
 /*--------------------------------
 	UTIL FUNCTIONS
@@ -18,15 +19,21 @@ extern int MUMBLE_DATA_REG;
 
 extern int luaopen_mumble(lua_State *l);
 
-void mumble_audio_buffer_thread(void *arg);
+void mumble_audio_buffer_start(MumbleClient *client);
+void mumble_audio_buffer_shutdown(MumbleClient *client);
 void mumble_audio_playback_thread(void *arg);
+uint64_t mumble_audio_playback_tick(MumbleClient *client, uint64_t now);
 void mumble_audio_encode_thread(void *arg);
+void mumble_audio_encode_start(MumbleClient *client);
 void mumble_audio_playback_async(uv_async_t* handle);
+void mumble_audio_send_async(uv_async_t* handle);
 
 void mumble_audio_queue_init(audio_queue_t *q);
+void mumble_audio_work_pool_init(MumbleClient *client);
 void mumble_audio_queue_shutdown(MumbleClient *client);
 
 void mumble_ping_timer(uv_timer_t* handle);
+void socket_read_event_tcp(uv_poll_t* handle, int status, int events);
 
 uint64_t util_get_varint(uint8_t buffer[], int *len);
 
@@ -35,15 +42,18 @@ void mumble_ping(MumbleClient* client);
 uint64_t mumble_adjust_audio_bandwidth(MumbleClient *client);
 int mumble_client_connect(lua_State *l);
 void mumble_disconnect(MumbleClient *client, const char* reason, bool garbagecollected);
+void mumble_message_reset(MumbleClient* client);
 
 void mumble_client_raw_get(MumbleClient* client);
 MumbleUser* mumble_user_get(MumbleClient* client, uint32_t session);
 void mumble_user_raw_get(MumbleClient* client, uint32_t session);
 void mumble_user_remove(MumbleClient* client, uint32_t session);
+void mumble_user_set_channel(MumbleClient* client, MumbleUser* user, uint32_t channel_id);
 
 MumbleChannel* mumble_channel_get(MumbleClient* client, uint32_t channel_id);
 void mumble_channel_raw_get(MumbleClient* client, uint32_t channel_id);
 void mumble_channel_remove(MumbleClient* client, uint32_t channel_id);
+void mumble_channel_set_parent(MumbleClient* client, MumbleChannel* channel, uint32_t parent);
 
 int mumble_push_address(lua_State* l, ProtobufCBinaryData address);
 
@@ -56,8 +66,8 @@ void mumble_handle_speaking_hooks_legacy(MumbleClient* client, uint8_t buffer[],
 void mumble_handle_speaking_hooks_protobuf(MumbleClient* client, MumbleUDP__Audio *audio, uint32_t session);
 
 int mumble_traceback(lua_State *l);
-int mumble_hook_call(MumbleClient *client, const char* hook, int nargs);
-int mumble_hook_call_ret(MumbleClient *client, const char* hook, int nargs, int nresults);
+int mumble_hook_call(MumbleClient *client, int hook, int nargs);
+int mumble_hook_call_ret(MumbleClient *client, int hook, int nargs, int nresults);
 
 void mumble_weak_table(lua_State *l);
 int mumble_ref(lua_State *l);
@@ -17,6 +17,19 @@
 #include <stdint.h>
 #include <string.h>
 
+static void crypt_setupKey(mumble_crypt *crypt) {
+	// Expand the AES key schedule once per key instead of once per block.
+	// EVP will pick the AES-NI implementation when the CPU supports it.
+	EVP_EncryptInit_ex(crypt->enc_ctx_ocb_enc, EVP_aes_128_ecb(), NULL, crypt->raw_key, NULL);
+	EVP_CIPHER_CTX_set_padding(crypt->enc_ctx_ocb_enc, 0);
+	EVP_DecryptInit_ex(crypt->dec_ctx_ocb_enc, EVP_aes_128_ecb(), NULL, crypt->raw_key, NULL);
+	EVP_CIPHER_CTX_set_padding(crypt->dec_ctx_ocb_enc, 0);
+	EVP_EncryptInit_ex(crypt->enc_ctx_ocb_dec, EVP_aes_128_ecb(), NULL, crypt->raw_key, NULL);
+	EVP_CIPHER_CTX_set_padding(crypt->enc_ctx_ocb_dec, 0);
+	EVP_DecryptInit_ex(crypt->dec_ctx_ocb_dec, EVP_aes_128_ecb(), NULL, crypt->raw_key, NULL);
+	EVP_CIPHER_CTX_set_padding(crypt->dec_ctx_ocb_dec, 0);
+}
+
 mumble_crypt* crypt_new() {
 	mumble_crypt* crypt = malloc(sizeof(mumble_crypt));
 	if (crypt == NULL) return crypt;
@@ -38,6 +51,8 @@ void crypt_init(mumble_crypt *crypt) {
 	crypt->dec_ctx_ocb_enc = EVP_CIPHER_CTX_new();
 	crypt->enc_ctx_ocb_dec = EVP_CIPHER_CTX_new();
 	crypt->dec_ctx_ocb_dec = EVP_CIPHER_CTX_new();
+
+	crypt_setupKey(crypt);
 }
 
 void crypt_uninitialize(mumble_crypt *crypt) {
@@ -61,6 +76,7 @@ void crypt_genKey(mumble_crypt *crypt) {
 	RAND_bytes(crypt->raw_key, AES_KEY_SIZE_BYTES);
 	RAND_bytes(crypt->encrypt_iv, AES_BLOCK_SIZE);
 	RAND_bytes(crypt->decrypt_iv, AES_BLOCK_SIZE);
+	crypt_setupKey(crypt);
 	crypt->bInit = true;
 }
 
@@ -71,6 +87,7 @@ bool crypt_setKey(mumble_crypt *crypt, const uint8_t *rkey, size_t rkey_len,
 		memcpy(crypt->raw_key, rkey, AES_KEY_SIZE_BYTES);
 		memcpy(crypt->encrypt_iv, eiv, AES_BLOCK_SIZE);
 		memcpy(crypt->decrypt_iv, div, AES_BLOCK_SIZE);
+		crypt_setupKey(crypt);
 		crypt->bInit = true;
 		return true;
 	}
@@ -80,6 +97,7 @@ bool crypt_setKey(mumble_crypt *crypt, const uint8_t *rkey, size_t rkey_len,
 bool crypt_setRawKey(mumble_crypt *crypt, const uint8_t *rkey, size_t rkey_len) {
 	if (rkey_len == AES_KEY_SIZE_BYTES) {
 		memcpy(crypt->raw_key, rkey, AES_KEY_SIZE_BYTES);
+		crypt_setupKey(crypt);
 		return true;
 	}
 	return false;
@@ -289,27 +307,41 @@ static void inline ZERO(keyblock *block) {
 	memset(block, 0, BLOCKSIZE * sizeof(block));
 }
 
+// The contexts are keyed once in crypt_setupKey, so each block is a single ECB update
 #define AESencrypt_ctx(src, dst, key, enc_ctx)                                                      \
 	{                                                                                               \
 		int outlen = 0;                                                                             \
-		EVP_EncryptInit_ex(enc_ctx, EVP_aes_128_ecb(), NULL, key, NULL);                            \
-		EVP_CIPHER_CTX_set_padding(enc_ctx, 0);                                                     \
-		EVP_EncryptUpdate(enc_ctx, (uint8_t*)dst, &outlen,               \
-						  (const uint8_t*)src, AES_BLOCK_SIZE);          \
-		EVP_EncryptFinal_ex(enc_ctx, ((uint8_t*)dst + outlen), &outlen); \
+		EVP_EncryptUpdate(enc_ctx, (uint8_t*)dst, &outlen,                                          \
+						  (const uint8_t*)src, AES_BLOCK_SIZE);                                     \
 	}
 #define AESdecrypt_ctx(src, dst, key, dec_ctx)                                                      \
 	{                                                                                               \
 		int outlen = 0;                                                                             \
-		EVP_DecryptInit_ex(dec_ctx, EVP_aes_128_ecb(), NULL, key, NULL);                            \
-		EVP_CIPHER_CTX_set_padding(dec_ctx, 0);                                                     \
-		EVP_DecryptUpdate(dec_ctx, (uint8_t*)dst, &outlen,               \
-						  (const uint8_t*)src, AES_BLOCK_SIZE);          \
-		EVP_DecryptFinal_ex(dec_ctx, ((uint8_t*)dst + outlen), &outlen); \
+		EVP_DecryptUpdate(dec_ctx, (uint8_t*)dst, &outlen,                                          \
+						  (const uint8_t*)src, AES_BLOCK_SIZE);                                     \
+	}
+
+#define AESencrypt_blocks_ctx(src, dst, count, enc_ctx)                                             \
+	{                                                                                               \
+		int outlen = 0;                                                                             \
+		EVP_EncryptUpdate(enc_ctx, (uint8_t*)dst, &outlen,                                          \
+						  (const uint8_t*)src, (count) * AES_BLOCK_SIZE);                           \
+	}
+#define AESdecrypt_blocks_ctx(src, dst, count, dec_ctx)                                             \
+	{                                                                                               \
+		int outlen = 0;                                                                             \
+		EVP_DecryptUpdate(dec_ctx, (uint8_t*)dst, &outlen,                                          \
+						  (const uint8_t*)src, (count) * AES_BLOCK_SIZE);                           \
 	}
 
+// Number of full blocks handed to AES in one go, set to 1 to only use the block-at-a-time path
+#ifndef OCB_PARALLEL_BLOCKS
+#define OCB_PARALLEL_BLOCKS 8
+#endif
+
 #define AESencrypt(src, dst, key) AESencrypt_ctx(src, dst, key, crypt->enc_ctx_ocb_enc)
 #define AESdecrypt(src, dst, key) AESdecrypt_ctx(src, dst, key, crypt->dec_ctx_ocb_enc)
+#define AESencrypt_blocks(src, dst, count) AESencrypt_blocks_ctx(src, dst, count, crypt->enc_ctx_ocb_enc)
 
 bool crypt_ocb_encrypt(mumble_crypt *crypt, const uint8_t *plain, uint8_t *encrypted, size_t len, const uint8_t *nonce, uint8_t *tag, bool modifyPlainOnXEXStarAttack) {
 	keyblock checksum, delta, tmp, pad;
@@ -319,6 +351,37 @@ bool crypt_ocb_encrypt(mumble_crypt *crypt, const uint8_t *plain, uint8_t *encry
 	AESencrypt(nonce, delta, crypt->raw_key);
 	ZERO(&checksum);
 
+#if OCB_PARALLEL_BLOCKS > 1
+	// Batch every full block except the last one before the final block, which needs the
+	// XEX* check below. The offsets are precomputed so the AES calls no longer wait on each other.
+	while (len > AES_BLOCK_SIZE * 2) {
+		keyblock deltas[OCB_PARALLEL_BLOCKS];
+		keyblock blocks[OCB_PARALLEL_BLOCKS];
+
+		size_t count = (len - AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+		if (count > OCB_PARALLEL_BLOCKS)
+			count = OCB_PARALLEL_BLOCKS;
+
+		for (size_t i = 0; i < count; i++) {
+			const subblock *block = (const subblock*)(plain + i * AES_BLOCK_SIZE);
+			S2(delta);
+			memcpy(deltas[i], delta, AES_BLOCK_SIZE);
+			XOR(blocks[i], delta, block);
+			XOR(checksum, checksum, block);
+		}
+
+		AESencrypt_blocks(blocks, blocks, count);
+
+		for (size_t i = 0; i < count; i++) {
+			XOR((subblock*)(encrypted + i * AES_BLOCK_SIZE), deltas[i], blocks[i]);
+		}
+
+		len -= count * AES_BLOCK_SIZE;
+		plain += count * AES_BLOCK_SIZE;
+		encrypted += count * AES_BLOCK_SIZE;
+	}
+#endif
+
 	while (len > AES_BLOCK_SIZE) {
 		// Counter-cryptanalysis described in section 9 of https://eprint.iacr.org/2019/311
 		// For an attack, the second to last block (i.e. the last iteration of this loop)
@@ -382,8 +445,11 @@ bool crypt_ocb_encrypt(mumble_crypt *crypt, const uint8_t *plain, uint8_t *encry
 #undef AESencrypt
 #undef AESdecrypt
 
+#undef AESencrypt_blocks
+
 #define AESencrypt(src, dst, key) AESencrypt_ctx(src, dst, key, crypt->enc_ctx_ocb_dec)
 #define AESdecrypt(src, dst, key) AESdecrypt_ctx(src, dst, key, crypt->dec_ctx_ocb_dec)
+#define AESdecrypt_blocks(src, dst, count) AESdecrypt_blocks_ctx(src, dst, count, crypt->dec_ctx_ocb_dec)
 
 bool crypt_ocb_decrypt(mumble_crypt *crypt, const uint8_t *encrypted, uint8_t *plain, size_t len, const uint8_t *nonce, uint8_t *tag) {
 	keyblock checksum, delta, tmp, pad;
@@ -393,6 +459,35 @@ bool crypt_ocb_decrypt(mumble_crypt *crypt, const uint8_t *encrypted, uint8_t *p
 	AESencrypt(nonce, delta, crypt->raw_key);
 	ZERO(&checksum);
 
+#if OCB_PARALLEL_BLOCKS > 1
+	while (len > AES_BLOCK_SIZE) {
+		keyblock deltas[OCB_PARALLEL_BLOCKS];
+		keyblock blocks[OCB_PARALLEL_BLOCKS];
+
+		size_t count = (len - 1) / AES_BLOCK_SIZE;
+		if (count > OCB_PARALLEL_BLOCKS)
+			count = OCB_PARALLEL_BLOCKS;
+
+		for (size_t i = 0; i < count; i++) {
+			S2(delta);
+			memcpy(deltas[i], delta, AES_BLOCK_SIZE);
+			XOR(blocks[i], delta, (const subblock*)(encrypted + i * AES_BLOCK_SIZE));
+		}
+
+		AESdecrypt_blocks(blocks, blocks, count);
+
+		for (size_t i = 0; i < count; i++) {
+			subblock *block = (subblock*)(plain + i * AES_BLOCK_SIZE);
+			XOR(block, deltas[i], blocks[i]);
+			XOR(checksum, checksum, block);
+		}
+
+		len -= count * AES_BLOCK_SIZE;
+		plain += count * AES_BLOCK_SIZE;
+		encrypted += count * AES_BLOCK_SIZE;
+	}
+#endif
+
 	while (len > AES_BLOCK_SIZE) {
 		S2(delta);
 		XOR(tmp, delta, (const subblock*)encrypted);
@@ -433,6 +528,7 @@ bool crypt_ocb_decrypt(mumble_crypt *crypt, const uint8_t *encrypted, uint8_t *p
 
 #undef AESencrypt
 #undef AESdecrypt
+#undef AESdecrypt_blocks
 #undef BLOCKSIZE
 #undef SHIFTBITS
 #undef SWAPPED
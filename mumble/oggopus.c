@@ -0,0 +1,169 @@
+#include "oggopus.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Just enough of an Ogg demuxer to pull the packets out of the first Opus stream in a file.
+ * Decoding is left to libsndfile, this only exists so already encoded audio can be sent as is.
+ */
+
+#define OGG_PAGE_HEADER_SIZE 27
+
+static uint16_t oggopus_le16(const uint8_t* data) {
+	return (uint16_t) data[0] | ((uint16_t) data[1] << 8);
+}
+
+static uint32_t oggopus_le32(const uint8_t* data) {
+	return (uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static bool oggopus_read_page(OggOpusReader* reader) {
+	uint8_t header[OGG_PAGE_HEADER_SIZE];
+
+	while (true) {
+		if (fread(header, 1, OGG_PAGE_HEADER_SIZE, reader->file) != OGG_PAGE_HEADER_SIZE) {
+			return false;
+		}
+
+		if (memcmp(header, "OggS", 4) != 0) {
+			mumble_log(LOG_WARN, "invalid ogg page header");
+			return false;
+		}
+
+		int segment_count = header[26];
+		if (fread(reader->segments, 1, segment_count, reader->file) != (size_t) segment_count) {
+			return false;
+		}
+
+		size_t body_length = 0;
+		for (int i = 0; i < segment_count; i++) {
+			body_length += reader->segments[i];
+		}
+
+		if (fread(reader->body, 1, body_length, reader->file) != body_length) {
+			return false;
+		}
+
+		uint32_t serial = oggopus_le32(header + 14);
+
+		if (!reader->has_serial) {
+			reader->serial = serial;
+			reader->has_serial = true;
+		} else if (serial != reader->serial) {
+			// Some other stream multiplexed into the same file
+			continue;
+		}
+
+		reader->segment_count = segment_count;
+		reader->segment_index = 0;
+		reader->body_offset = 0;
+		return true;
+	}
+}
+
+bool oggopus_next_packet(OggOpusReader* reader, const uint8_t** data, size_t* length) {
+	reader->packet_length = 0;
+
+	while (true) {
+		if (reader->segment_index >= reader->segment_count) {
+			if (!oggopus_read_page(reader)) {
+				return false;
+			}
+			continue;
+		}
+
+		uint8_t lace = reader->segments[reader->segment_index++];
+
+		if (reader->packet_length + lace > reader->packet_capacity) {
+			size_t capacity = reader->packet_capacity > 0 ? reader->packet_capacity * 2 : 1024;
+			while (capacity < reader->packet_length + lace) {
+				capacity *= 2;
+			}
+			uint8_t* packet = realloc(reader->packet, capacity);
+			if (packet == NULL) {
+				mumble_log(LOG_ERROR, "failed to allocate ogg packet");
+				return false;
+			}
+			reader->packet = packet;
+			reader->packet_capacity = capacity;
+		}
+
+		memcpy(reader->packet + reader->packet_length, reader->body + reader->body_offset, lace);
+		reader->packet_length += lace;
+		reader->body_offset += lace;
+
+		// A lacing value under 255 ends the packet, otherwise it carries on into the next segment
+		if (lace < 255) {
+			*data = reader->packet;
+			*length = reader->packet_length;
+			return true;
+		}
+	}
+}
+
+OggOpusReader* oggopus_open(const char* path) {
+	OggOpusReader* reader = calloc(1, sizeof(OggOpusReader));
+	if (reader == NULL) {
+		return NULL;
+	}
+
+	reader->file = fopen(path, "rb");
+	if (reader->file == NULL) {
+		free(reader);
+		return NULL;
+	}
+
+	const uint8_t* packet;
+	size_t length;
+
+	// Only channel mapping family 0 can be sent as is, since that's all Mumble understands
+	if (!oggopus_next_packet(reader, &packet, &length) || length < 19 || memcmp(packet, "OpusHead", 8) != 0 || packet[18] != 0) {
+		oggopus_close(reader);
+		return NULL;
+	}
+
+	reader->channels = packet[9];
+	reader->pre_skip = oggopus_le16(packet + 10);
+
+	// The comment header has to end its page, so audio starts on the next one
+	if (!oggopus_next_packet(reader, &packet, &length) || length < 8 || memcmp(packet, "OpusTags", 8) != 0 ||
+		reader->segment_index != reader->segment_count) {
+		oggopus_close(reader);
+		return NULL;
+	}
+
+	reader->data_offset = ftell(reader->file);
+
+	reader->repacketizer = opus_repacketizer_create();
+	if (reader->repacketizer == NULL) {
+		oggopus_close(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+void oggopus_rewind(OggOpusReader* reader) {
+	fseek(reader->file, reader->data_offset, SEEK_SET);
+	reader->segment_count = 0;
+	reader->segment_index = 0;
+	reader->body_offset = 0;
+	reader->packet_length = 0;
+	reader->scratch_length = 0;
+	reader->pending_length = 0;
+	reader->position = 0;
+	reader->ahead = 0;
+}
+
+void oggopus_close(OggOpusReader* reader) {
+	if (reader->repacketizer != NULL) {
+		opus_repacketizer_destroy(reader->repacketizer);
+	}
+	if (reader->file != NULL) {
+		fclose(reader->file);
+	}
+	free(reader->packet);
+	free(reader);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <opus/opus.h>
+#include <sndfile.h>
+
+#include "defines.h"
+
+typedef struct OggOpusReader OggOpusReader;
+
+// Reads the packets of an Ogg Opus file as is, so they can be sent without decoding them
+struct OggOpusReader {
+	FILE* file;
+	long data_offset;
+	uint32_t serial;
+	bool has_serial;
+	int channels;
+	uint16_t pre_skip;
+
+	// The page being read
+	uint8_t segments[255];
+	int segment_count;
+	int segment_index;
+	uint8_t body[255 * 255];
+	size_t body_offset;
+
+	// The packet being put back together from its segments
+	uint8_t* packet;
+	size_t packet_length;
+	size_t packet_capacity;
+
+	// Passthrough playback state
+	OpusRepacketizer* repacketizer;
+	uint8_t scratch[PAYLOAD_SIZE_MAX];
+	size_t scratch_length;
+	uint8_t pending[PAYLOAD_SIZE_MAX];
+	size_t pending_length;
+	sf_count_t position;
+	sf_count_t ahead;
+};
+
+// Returns NULL if the file isn't a mono or stereo Ogg Opus file
+OggOpusReader* oggopus_open(const char* path);
+bool oggopus_next_packet(OggOpusReader* reader, const uint8_t** data, size_t* length);
+void oggopus_rewind(OggOpusReader* reader);
+void oggopus_close(OggOpusReader* reader);
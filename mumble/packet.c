@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "mumble.h"
 
 #include "packet.h"
@@ -8,7 +9,13 @@
 #include "log.h"
 
 #include <openssl/ssl.h>
+#include <openssl/err.h>
 #include <math.h>
+#include <limits.h>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
 
 #define SAFE_STRDUP(dest, src) \
 	do { \
@@ -26,220 +33,370 @@
 		(dest) = (src) ? strndup((char*)(src), (n)) : NULL; \
 	} while (0)
 
+static MumbleUdpSend* udp_send_acquire(MumbleClient* client, size_t length) {
+	MumbleUdpSend* send = NULL;
+
+	if (length <= UDP_SEND_BUFFER_SIZE) {
+		send = client->udp_send_free;
+		if (send != NULL) {
+			client->udp_send_free = send->next;
+			client->udp_send_free_count--;
+		} else {
+			send = malloc(sizeof(MumbleUdpSend) + UDP_SEND_BUFFER_SIZE);
+			if (!send) {
+				return NULL;
+			}
+		}
+		send->pooled = true;
+	} else {
+		// Too big for a pooled buffer
+		send = malloc(sizeof(MumbleUdpSend) + length);
+		if (!send) {
+			return NULL;
+		}
+		send->pooled = false;
+	}
+
+	send->client = client;
+	send->length = length;
+	send->req.data = send;
+	return send;
+}
+
+static void udp_send_release(MumbleUdpSend* send) {
+	MumbleClient* client = send->client;
+
+	if (send->pooled && client->udp_send_free_count < UDP_SEND_POOL_SIZE) {
+		send->next = client->udp_send_free;
+		client->udp_send_free = send;
+		client->udp_send_free_count++;
+	} else {
+		free(send);
+	}
+}
+
+static void udp_send_track(MumbleClient* client, MumbleUdpSend* send) {
+	send->prev = NULL;
+	send->next = client->udp_send_inflight;
+	if (send->next != NULL) {
+		send->next->prev = send;
+	}
+	client->udp_send_inflight = send;
+	client->udp_send_inflight_count++;
+}
+
+static void udp_send_untrack(MumbleClient* client, MumbleUdpSend* send) {
+	if (send->prev != NULL) {
+		send->prev->next = send->next;
+	} else {
+		client->udp_send_inflight = send->next;
+	}
+	if (send->next != NULL) {
+		send->next->prev = send->prev;
+	}
+	client->udp_send_inflight_count--;
+}
+
 void on_send(uv_udp_send_t* req, int status) {
-	uint8_t* encrypted = (uint8_t*) req->data;
+	MumbleUdpSend* send = (MumbleUdpSend*) req->data;
+
+	if (status == UV_ECANCELED || send->client == NULL) {
+		// The socket was closed under us, and the client may already be gone
+		free(send);
+		return;
+	}
 
 	if (status < 0) {
 		mumble_log(LOG_ERROR, "[UDP] Error sending UDP packet: %s", uv_strerror(status));
 	}
 
-	free(encrypted);
-	free(req);
+	udp_send_untrack(send->client, send);
+	udp_send_release(send);
 }
 
-int packet_sendudp(MumbleClient* client, const void *message, const int length) {
-	uint8_t* encrypted = malloc(length + 4);
+void packet_udp_flush(MumbleClient* client) {
+	size_t count = client->udp_send_count;
+	size_t sent = 0;
 
-	if (!encrypted) {
-		mumble_log(LOG_ERROR, "failed to malloc encrypted data buffer: %s", strerror(errno));
-		return 0;
+	if (count == 0) {
+		return;
 	}
 
-	if (crypt_isValid(client->crypt) && crypt_encrypt(client->crypt, message, encrypted, length)) {
-		uv_buf_t buf = uv_buf_init((char*)encrypted, length + 4);
+	client->udp_send_count = 0;
+
+#if defined(__linux__)
+	// The socket is connected, so everything can go out in one sendmmsg call,
+	// as long as libuv doesn't have older datagrams still waiting to be written
+	uv_os_fd_t fd;
+	if (client->socket_udp.send_queue_count == 0 && uv_fileno((uv_handle_t*) &client->socket_udp, &fd) == 0) {
+		struct mmsghdr msgs[UDP_SEND_BATCH];
+		struct iovec iov[UDP_SEND_BATCH];
 
-		uv_udp_send_t* req = malloc(sizeof(uv_udp_send_t));
+		memset(msgs, 0, sizeof(struct mmsghdr) * count);
 
-		if (!req) {
-			mumble_log(LOG_ERROR, "failed to malloc send request: %s", strerror(errno));
-			free(encrypted);
-			return 0;
+		for (size_t i = 0; i < count; i++) {
+			iov[i].iov_base = client->udp_send_batch[i]->data;
+			iov[i].iov_len = client->udp_send_batch[i]->length;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
 		}
 
-		req->data = encrypted;
+		int ret = sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+		if (ret > 0) {
+			sent = ret;
+		}
+	}
+#endif
+
+	for (size_t i = 0; i < sent; i++) {
+		udp_send_release(client->udp_send_batch[i]);
+	}
+
+	// Anything left over goes through libuv, which will queue it if the socket is busy
+	for (size_t i = sent; i < count; i++) {
+		MumbleUdpSend* send = client->udp_send_batch[i];
+		uv_buf_t buf = uv_buf_init((char*) send->data, send->length);
 
-		int ret = uv_udp_send(req, &client->socket_udp, &buf, 1, NULL, on_send);
+		int ret = uv_udp_try_send(&client->socket_udp, &buf, 1, NULL);
+
+		if (ret == UV_EAGAIN) {
+			ret = uv_udp_send(&send->req, &client->socket_udp, &buf, 1, NULL, on_send);
+			if (ret == 0) {
+				// Released in on_send
+				udp_send_track(client, send);
+				continue;
+			}
+		}
 
 		if (ret < 0) {
 			mumble_log(LOG_ERROR, "[UDP] Unable to send UDP packet: %s", uv_strerror(ret));
-			free(encrypted);
-			free(req);
-			return 0;
 		}
 
-		return ret;
-	} else {
+		udp_send_release(send);
+	}
+}
+
+static bool tcp_send_reserve(MumbleClient* client, size_t size) {
+	size_t needed = client->tcp_send_length + size;
+
+	if (needed <= client->tcp_send_size) {
+		return true;
+	}
+
+	if (client->tcp_send_offset > 0) {
+		// Reclaim the space taken up by data that was already written
+		client->tcp_send_length -= client->tcp_send_offset;
+		memmove(client->tcp_send_buffer, client->tcp_send_buffer + client->tcp_send_offset, client->tcp_send_length);
+		client->tcp_send_offset = 0;
+		needed = client->tcp_send_length + size;
+
+		if (needed <= client->tcp_send_size) {
+			return true;
+		}
+	}
+
+	size_t new_size = client->tcp_send_size > 0 ? client->tcp_send_size : TCP_SEND_BUFFER_SIZE;
+	while (new_size < needed) {
+		new_size *= 2;
+	}
+
+	uint8_t* buffer = realloc(client->tcp_send_buffer, new_size);
+	if (!buffer) {
+		return false;
+	}
+
+	client->tcp_send_buffer = buffer;
+	client->tcp_send_size = new_size;
+	return true;
+}
+
+static void tcp_send_wait(MumbleClient* client, int events) {
+	if (client->tcp_send_waiting == events) {
+		return;
+	}
+
+	// Only wake up for a writable socket while a write is waiting on it, we always want to know when it is readable
+	client->tcp_send_waiting = events;
+	uv_poll_start(&client->ssl_poll, UV_READABLE | events, socket_read_event_tcp);
+}
+
+void packet_tcp_flush(MumbleClient* client) {
+	while (client->tcp_send_offset < client->tcp_send_length) {
+		size_t remaining = client->tcp_send_length - client->tcp_send_offset;
+		int ret = SSL_write(client->ssl, client->tcp_send_buffer + client->tcp_send_offset, remaining > INT_MAX ? INT_MAX : (int) remaining);
+
+		if (ret > 0) {
+			client->tcp_send_offset += ret;
+			continue;
+		}
+
+		int err = SSL_get_error(client->ssl, ret);
+
+		if (err == SSL_ERROR_WANT_WRITE) {
+			// Resume where we left off once the socket is writable again
+			tcp_send_wait(client, UV_WRITABLE);
+			break;
+		}
+
+		if (err == SSL_ERROR_WANT_READ) {
+			// OpenSSL needs to hear from the server first, an idle socket is always writable so waiting on that would spin
+			tcp_send_wait(client, UV_READABLE);
+			break;
+		}
+
+		mumble_log(LOG_ERROR, "[TCP] Unable to send packets: %s", ERR_reason_error_string(ERR_get_error()));
+		mumble_disconnect(client, "unable to write to server", false);
+		return;
+	}
+
+	size_t queued = client->tcp_send_length - client->tcp_send_offset;
+
+	if (queued == 0) {
+		client->tcp_send_offset = 0;
+		client->tcp_send_length = 0;
+		tcp_send_wait(client, 0);
+	}
+
+	lua_State* l = client->l;
+	lua_stackguard_entry(l);
+
+	if (!client->tcp_send_full && queued >= TCP_SEND_HIGH_WATER) {
+		client->tcp_send_full = true;
+		mumble_log(LOG_WARN, "[TCP] Send queue is backed up with %zu bytes", queued);
+		lua_pushinteger(l, queued);
+		mumble_hook_call(client, HOOK_ON_SEND_QUEUE_FULL, 1);
+	} else if (client->tcp_send_full && queued == 0) {
+		client->tcp_send_full = false;
+		mumble_hook_call(client, HOOK_ON_SEND_QUEUE_DRAINED, 0);
+	}
+
+	lua_stackguard_exit(l);
+}
+
+static void packet_flush(MumbleClient* client) {
+	packet_udp_flush(client);
+
+	if (client->connected && !client->tcp_send_waiting) {
+		packet_tcp_flush(client);
+	}
+}
+
+// Runs right before the loop waits for I/O, so packets queued by timers don't have to wait for it to wake up again
+void packet_flush_prepare(uv_prepare_t* handle) {
+	packet_flush((MumbleClient*) handle->data);
+}
+
+// Runs right after I/O callbacks, for packets queued while handling them
+void packet_flush_check(uv_check_t* handle) {
+	packet_flush((MumbleClient*) handle->data);
+}
+
+void packet_udp_discard(MumbleClient* client) {
+	for (size_t i = 0; i < client->udp_send_count; i++) {
+		udp_send_release(client->udp_send_batch[i]);
+	}
+	client->udp_send_count = 0;
+
+	// Anything libuv still has queued gets cancelled once the socket closes, which can be after the client is freed
+	MumbleUdpSend* send = client->udp_send_inflight;
+	while (send != NULL) {
+		MumbleUdpSend* next = send->next;
+		send->client = NULL;
+		send = next;
+	}
+	client->udp_send_inflight = NULL;
+	client->udp_send_inflight_count = 0;
+}
+
+void packet_udp_free_pool(MumbleClient* client) {
+	if (client->udp_send_inflight_count > 0) {
+		// on_send still hands these back to the pool
+		return;
+	}
+
+	MumbleUdpSend* send = client->udp_send_free;
+	while (send != NULL) {
+		MumbleUdpSend* next = send->next;
+		free(send);
+		send = next;
+	}
+	client->udp_send_free = NULL;
+	client->udp_send_free_count = 0;
+}
+
+int packet_sendudp(MumbleClient* client, const void *message, const int length) {
+	if (!crypt_isValid(client->crypt)) {
+		mumble_log(LOG_ERROR, "[UDP] Unable to encrypt UDP packet");
+		return 0;
+	}
+
+	MumbleUdpSend* send = udp_send_acquire(client, length + 4);
+
+	if (!send) {
+		mumble_log(LOG_ERROR, "failed to malloc encrypted data buffer: %s", strerror(errno));
+		return 0;
+	}
+
+	if (!crypt_encrypt(client->crypt, message, send->data, length)) {
 		mumble_log(LOG_ERROR, "[UDP] Unable to encrypt UDP packet");
-		free(encrypted);
+		udp_send_release(send);
 		return 0;
 	}
+
+	// Datagrams are sent together by packet_flush_prepare or packet_flush_check, whichever runs first
+	client->udp_send_batch[client->udp_send_count++] = send;
+
+	if (client->udp_send_count >= UDP_SEND_BATCH) {
+		packet_udp_flush(client);
+	}
+
+	return 0;
 }
 
 int packet_sendex(MumbleClient* client, int type, const void *message, const ProtobufCMessage* base, const int length) {
-	uint8_t *packet_out;
-	size_t payload_size = 0;
-	size_t total_size = 0;
-	switch (type) {
-	case PACKET_VERSION:
-		payload_size = mumble_proto__version__get_packed_size(message);
-		break;
-	case PACKET_UDPTUNNEL:
+	size_t payload_size;
+
+	if (type == PACKET_UDPTUNNEL) {
+		// Raw voice data
 		payload_size = length;
-		break;
-	case PACKET_AUTHENTICATE:
-		payload_size = mumble_proto__authenticate__get_packed_size(message);
-		break;
-	case PACKET_PING:
-		payload_size = mumble_proto__ping__get_packed_size(message);
-		break;
-	case PACKET_CHANNELREMOVE:
-		payload_size = mumble_proto__channel_remove__get_packed_size(message);
-		break;
-	case PACKET_CHANNELSTATE:
-		payload_size = mumble_proto__channel_state__get_packed_size(message);
-		break;
-	case PACKET_USERREMOVE:
-		payload_size = mumble_proto__user_remove__get_packed_size(message);
-		break;
-	case PACKET_USERSTATE:
-		payload_size = mumble_proto__user_state__get_packed_size(message);
-		break;
-	case PACKET_BANLIST:
-		payload_size = mumble_proto__ban_list__get_packed_size(message);
-		break;
-	case PACKET_TEXTMESSAGE:
-		payload_size = mumble_proto__text_message__get_packed_size(message);
-		break;
-	case PACKET_ACL:
-		payload_size = mumble_proto__acl__get_packed_size(message);
-		break;
-	case PACKET_QUERYUSERS:
-		payload_size = mumble_proto__query_users__get_packed_size(message);
-		break;
-	case PACKET_CRYPTSETUP:
-		payload_size = mumble_proto__crypt_setup__get_packed_size(message);
-		break;
-	case PACKET_CONTEXTACTION:
-		payload_size = mumble_proto__context_action__get_packed_size(message);
-		break;
-	case PACKET_PERMISSIONQUERY:
-		payload_size = mumble_proto__permission_query__get_packed_size(message);
-		break;
-	case PACKET_USERLIST:
-		payload_size = mumble_proto__user_list__get_packed_size(message);
-		break;
-	case PACKET_VOICETARGET:
-		payload_size = mumble_proto__voice_target__get_packed_size(message);
-		break;
-	case PACKET_CODECVERSION:
-		payload_size = mumble_proto__codec_version__get_packed_size(message);
-		break;
-	case PACKET_USERSTATS:
-		payload_size = mumble_proto__user_stats__get_packed_size(message);
-		break;
-	case PACKET_REQUESTBLOB:
-		payload_size = mumble_proto__request_blob__get_packed_size(message);
-		break;
-	case PACKET_PLUGINDATA:
-		payload_size = mumble_proto__plugin_data_transmission__get_packed_size(message);
-		break;
-	default:
+	} else if (base != NULL) {
+		// Every other packet is a protobuf message, which knows how to pack itself
+		payload_size = protobuf_c_message_get_packed_size(base);
+	} else {
 		mumble_log(LOG_WARN, "unable to get payload size for packet #%i", type);
 		return 1;
 	}
 
-	total_size = PACKET_HEADER_SIZE + payload_size;
-	packet_out = malloc(sizeof(uint8_t) * total_size);
+	size_t total_size = PACKET_HEADER_SIZE + payload_size;
 
-	if (packet_out == NULL) {
-		mumble_log(LOG_ERROR, "failed to malloc packet buffer: %s", strerror(errno));
+	// Pack straight into the send queue, it is written out before the loop next waits for I/O or right after handling it
+	if (!tcp_send_reserve(client, total_size)) {
+		mumble_log(LOG_ERROR, "failed to grow packet buffer: %s", strerror(errno));
 		return 2;
 	}
 
-	if (payload_size > 0) {
-		switch (type) {
-		case PACKET_VERSION:
-			mumble_proto__version__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_UDPTUNNEL:
-			memmove(packet_out + PACKET_HEADER_SIZE, message, length);
-			break;
-		case PACKET_AUTHENTICATE:
-			mumble_proto__authenticate__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_PING:
-			mumble_proto__ping__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_CHANNELREMOVE:
-			mumble_proto__channel_remove__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_CHANNELSTATE:
-			mumble_proto__channel_state__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_USERREMOVE:
-			mumble_proto__user_remove__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_USERSTATE:
-			mumble_proto__user_state__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_BANLIST:
-			mumble_proto__ban_list__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_TEXTMESSAGE:
-			mumble_proto__text_message__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_ACL:
-			mumble_proto__acl__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_QUERYUSERS:
-			mumble_proto__query_users__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_CRYPTSETUP:
-			mumble_proto__crypt_setup__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_CONTEXTACTION:
-			mumble_proto__context_action__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_PERMISSIONQUERY:
-			mumble_proto__permission_query__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_USERLIST:
-			mumble_proto__user_list__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_VOICETARGET:
-			mumble_proto__voice_target__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_CODECVERSION:
-			mumble_proto__codec_version__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_USERSTATS:
-			mumble_proto__user_stats__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_REQUESTBLOB:
-			mumble_proto__request_blob__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		case PACKET_PLUGINDATA:
-			mumble_proto__plugin_data_transmission__pack(message, packet_out + PACKET_HEADER_SIZE);
-			break;
-		default:
-			mumble_log(LOG_WARN, "attempted to pack unspported packet #%i", type);
-			break;
-		}
+	uint8_t *packet_out = client->tcp_send_buffer + client->tcp_send_length;
+
+	if (type == PACKET_UDPTUNNEL) {
+		memcpy(packet_out + PACKET_HEADER_SIZE, message, length);
+	} else if (payload_size > 0) {
+		protobuf_c_message_pack(base, packet_out + PACKET_HEADER_SIZE);
 	}
-	*(uint16_t *)packet_out = htons(type);
-	*(uint32_t *)(packet_out + 2) = htonl(payload_size);
 
-	mumble_log(LOG_TRACE, "[TCP] Sending %s: %p", base != NULL ? base->descriptor->name : "MumbleProto.UDPTunnel", message);
+	uint16_t header_type = htons(type);
+	uint32_t header_length = htonl(payload_size);
+	memcpy(packet_out, &header_type, sizeof(header_type));
+	memcpy(packet_out + sizeof(header_type), &header_length, sizeof(header_length));
 
-	int written = SSL_write(client->ssl, packet_out, total_size);
+	client->tcp_send_length += total_size;
 
-	free(packet_out);
+	mumble_log(LOG_TRACE, "[TCP] Queued %s: %p", base != NULL ? base->descriptor->name : "MumbleProto.UDPTunnel", message);
 
-	return written == total_size ? 0 : -1;
+	return 0;
 }
 
 void packet_server_version(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__Version *version =  mumble_proto__version__unpack(NULL, packet->length, packet->body);
+	MumbleProto__Version *version =  mumble_proto__version__unpack(&client->message_allocator, packet->length, packet->body);
 	if (version == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking server version packet");
 		return;
@@ -271,9 +428,9 @@ void packet_server_version(MumbleClient *client, MumblePacket *packet) {
 	lua_setfield(l, -2, "os");
 	lua_pushstring(l, version->os_version);
 	lua_setfield(l, -2, "os_version");
-	mumble_hook_call(client, "OnServerVersion", 1);
+	mumble_hook_call(client, HOOK_ON_SERVER_VERSION, 1);
 
-	mumble_proto__version__free_unpacked(version, NULL);
+	mumble_proto__version__free_unpacked(version, &client->message_allocator);
 }
 
 void packet_tcp_udp_tunnel(MumbleClient *client, MumblePacket *packet) {
@@ -281,7 +438,7 @@ void packet_tcp_udp_tunnel(MumbleClient *client, MumblePacket *packet) {
 }
 
 void packet_server_ping(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__Ping *ping = mumble_proto__ping__unpack(NULL, packet->length, packet->body);
+	MumbleProto__Ping *ping = mumble_proto__ping__unpack(&client->message_allocator, packet->length, packet->body);
 	if (ping == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking TCP ping packet");
 		return;
@@ -343,13 +500,13 @@ void packet_server_ping(MumbleClient *client, MumblePacket *packet) {
 		lua_pushnumber(l, ping->tcp_ping_var);
 		lua_setfield(l, -2, "tcp_ping_var");
 	}
-	mumble_hook_call(client, "OnPongTCP", 1);
+	mumble_hook_call(client, HOOK_ON_PONG_TCP, 1);
 
-	mumble_proto__ping__free_unpacked(ping, NULL);
+	mumble_proto__ping__free_unpacked(ping, &client->message_allocator);
 }
 
 void packet_server_reject(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__Reject *reject = mumble_proto__reject__unpack(NULL, packet->length, packet->body);
+	MumbleProto__Reject *reject = mumble_proto__reject__unpack(&client->message_allocator, packet->length, packet->body);
 	if (reject == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking server reject packet");
 		return;
@@ -368,13 +525,13 @@ void packet_server_reject(MumbleClient *client, MumblePacket *packet) {
 	}
 	lua_pushstring(l, reject->reason);
 	lua_setfield(l, -2, "reason");
-	mumble_hook_call(client, "OnServerReject", 1);
+	mumble_hook_call(client, HOOK_ON_SERVER_REJECT, 1);
 
-	mumble_proto__reject__free_unpacked(reject, NULL);
+	mumble_proto__reject__free_unpacked(reject, &client->message_allocator);
 }
 
 void packet_server_sync(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__ServerSync *sync = mumble_proto__server_sync__unpack(NULL, packet->length, packet->body);
+	MumbleProto__ServerSync *sync = mumble_proto__server_sync__unpack(&client->message_allocator, packet->length, packet->body);
 	if (sync == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking server sync packet");
 		return;
@@ -412,13 +569,13 @@ void packet_server_sync(MumbleClient *client, MumblePacket *packet) {
 		MumbleChannel* root = mumble_channel_get(client, 0);
 		root->permissions = sync->permissions;
 	}
-	mumble_hook_call(client, "OnServerSync", 1);
+	mumble_hook_call(client, HOOK_ON_SERVER_SYNC, 1);
 
-	mumble_proto__server_sync__free_unpacked(sync, NULL);
+	mumble_proto__server_sync__free_unpacked(sync, &client->message_allocator);
 }
 
 void packet_channel_remove(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__ChannelRemove *channel = mumble_proto__channel_remove__unpack(NULL, packet->length, packet->body);
+	MumbleProto__ChannelRemove *channel = mumble_proto__channel_remove__unpack(&client->message_allocator, packet->length, packet->body);
 	if (channel == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking channel remove packet");
 		return;
@@ -427,14 +584,14 @@ void packet_channel_remove(MumbleClient *client, MumblePacket *packet) {
 	mumble_log(LOG_TRACE, "[TCP] Received %s: %p", channel->base.descriptor->name, channel);
 
 	mumble_channel_raw_get(client, channel->channel_id);
-	mumble_hook_call(client, "OnChannelRemove", 1);
+	mumble_hook_call(client, HOOK_ON_CHANNEL_REMOVE, 1);
 	mumble_channel_remove(client, channel->channel_id);
 
-	mumble_proto__channel_remove__free_unpacked(channel, NULL);
+	mumble_proto__channel_remove__free_unpacked(channel, &client->message_allocator);
 }
 
 void packet_channel_state(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__ChannelState *state = mumble_proto__channel_state__unpack(NULL, packet->length, packet->body);
+	MumbleProto__ChannelState *state = mumble_proto__channel_state__unpack(&client->message_allocator, packet->length, packet->body);
 	if (state == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking channel state packet");
 		return;
@@ -444,13 +601,63 @@ void packet_channel_state(MumbleClient *client, MumblePacket *packet) {
 
 	if (!state->has_channel_id) {
 		mumble_log(LOG_WARN, "[TCP] Received a channel state packet without a channel id");
-		mumble_proto__channel_state__free_unpacked(state, NULL);
+		mumble_proto__channel_state__free_unpacked(state, &client->message_allocator);
 		return;
 	}
 
 	lua_State* l = client->l;
 	MumbleChannel* channel = mumble_channel_get(client, state->channel_id);
 
+	// Update our channel state first, the event table is only built if someone is listening for it
+	if (state->has_parent) {
+		mumble_channel_set_parent(client, channel, state->parent);
+	}
+	if (state->name != NULL) {
+		SAFE_STRDUP(channel->name, state->name);
+	}
+	if (state->description != NULL) {
+		SAFE_STRDUP(channel->description, state->description);
+	}
+	if (state->has_temporary) {
+		channel->temporary = state->temporary;
+	}
+	if (state->has_position) {
+		channel->position = state->position;
+	}
+	if (state->has_description_hash) {
+		SAFE_STRNDUP(channel->description_hash, state->description_hash.data, state->description_hash.len);
+		channel->description_hash_len = state->description_hash.len;
+	}
+	if (state->has_max_users) {
+		channel->max_users = state->max_users;
+	}
+	for (uint32_t i = 0; i < state->n_links_add; i++) {
+		// Add the new entries to the head of the list
+		list_add(&channel->links, state->links_add[i], NULL);
+	}
+	for (uint32_t i = 0; i < state->n_links_remove; i++) {
+		list_remove(&channel->links, state->links_remove[i]);
+	}
+	if (state->n_links > 0) {
+		list_clear(&channel->links);
+
+		// Store links in new list
+		for (uint32_t i = 0; i < state->n_links; i++) {
+			list_add(&channel->links, state->links[i], NULL);
+		}
+	}
+	if (state->has_is_enter_restricted) {
+		channel->is_enter_restricted = state->is_enter_restricted;
+	}
+	if (state->has_can_enter) {
+		channel->can_enter = state->can_enter;
+	}
+
+	if (!mumble_hook_active(client, HOOK_ON_CHANNEL_STATE)) {
+		mumble_proto__channel_state__free_unpacked(state, &client->message_allocator);
+		return;
+	}
+
 	lua_newtable(l);
 	mumble_channel_raw_get(client, channel->channel_id);
 	lua_setfield(l , -2, "channel");
@@ -459,34 +666,26 @@ void packet_channel_state(MumbleClient *client, MumblePacket *packet) {
 	lua_setfield(l , -2, "channel_id");
 
 	if (state->has_parent) {
-		channel->parent = state->parent;
 		mumble_channel_raw_get(client, channel->parent);
 		lua_setfield(l , -2, "parent");
 	}
 	if (state->name != NULL) {
-		SAFE_STRDUP(channel->name, state->name);
 		lua_pushstring(l, channel->name);
 		lua_setfield(l , -2, "name");
 	}
 	if (state->description != NULL) {
-		SAFE_STRDUP(channel->description, state->description);
 		lua_pushstring(l, channel->description);
 		lua_setfield(l , -2, "description");
 	}
 	if (state->has_temporary) {
-		channel->temporary = state->temporary;
 		lua_pushboolean(l, channel->temporary);
 		lua_setfield(l , -2, "temporary");
 	}
 	if (state->has_position) {
-		channel->position = state->position;
 		lua_pushinteger(l, channel->position);
 		lua_setfield(l , -2, "position");
 	}
 	if (state->has_description_hash) {
-		SAFE_STRNDUP(channel->description_hash, state->description_hash.data, state->description_hash.len);
-		channel->description_hash_len = state->description_hash.len;
-
 		char* result;
 		bin_to_strhex((char*) channel->description_hash, channel->description_hash_len, &result);
 		lua_pushstring(l, result);
@@ -494,15 +693,12 @@ void packet_channel_state(MumbleClient *client, MumblePacket *packet) {
 		free(result);
 	}
 	if (state->has_max_users) {
-		channel->max_users = state->max_users;
 		lua_pushinteger(l, channel->max_users);
 		lua_setfield(l , -2, "max_users");
 	}
 	if (state->n_links_add > 0) {
-		// Add the new entries to the head of the list
 		lua_newtable(l);
 		for (uint32_t i = 0; i < state->n_links_add; i++) {
-			list_add(&channel->links, state->links_add[i], NULL);
 			lua_pushinteger(l, i + 1);
 			mumble_channel_raw_get(client, state->links_add[i]);
 			lua_settable(l, -3);
@@ -512,7 +708,6 @@ void packet_channel_state(MumbleClient *client, MumblePacket *packet) {
 	if (state->n_links_remove > 0) {
 		lua_newtable(l);
 		for (uint32_t i = 0; i < state->n_links_remove; i++) {
-			list_remove(&channel->links, state->links_remove[i]);
 			lua_pushinteger(l, i + 1);
 			mumble_channel_raw_get(client, state->links_remove[i]);
 			lua_settable(l, -3);
@@ -520,12 +715,8 @@ void packet_channel_state(MumbleClient *client, MumblePacket *packet) {
 		lua_setfield(l , -2, "links_remove");
 	}
 	if (state->n_links > 0) {
-		list_clear(&channel->links);
-
 		lua_newtable(l);
-		// Store links in new list
 		for (uint32_t i = 0; i < state->n_links; i++) {
-			list_add(&channel->links, state->links[i], NULL);
 			lua_pushinteger(l, i + 1);
 			mumble_channel_raw_get(client, state->links[i]);
 			lua_settable(l, -3);
@@ -533,23 +724,21 @@ void packet_channel_state(MumbleClient *client, MumblePacket *packet) {
 		lua_setfield(l , -2, "links");
 	}
 	if (state->has_is_enter_restricted) {
-		channel->is_enter_restricted = state->is_enter_restricted;
 		lua_pushboolean(l, channel->is_enter_restricted);
 		lua_setfield(l , -2, "is_enter_restricted");
 	}
 	if (state->has_can_enter) {
-		channel->can_enter = state->can_enter;
 		lua_pushboolean(l, channel->can_enter);
 		lua_setfield(l , -2, "can_enter");
 	}
 
-	mumble_hook_call(client, "OnChannelState", 1);
+	mumble_hook_call(client, HOOK_ON_CHANNEL_STATE, 1);
 
-	mumble_proto__channel_state__free_unpacked(state, NULL);
+	mumble_proto__channel_state__free_unpacked(state, &client->message_allocator);
 }
 
 void packet_user_remove(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__UserRemove *user = mumble_proto__user_remove__unpack(NULL, packet->length, packet->body);
+	MumbleProto__UserRemove *user = mumble_proto__user_remove__unpack(&client->message_allocator, packet->length, packet->body);
 	if (user == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking user remove packet");
 		return;
@@ -574,7 +763,7 @@ void packet_user_remove(MumbleClient *client, MumblePacket *packet) {
 		lua_pushboolean(l, user->ban);
 		lua_setfield(l, -2, "ban");
 	}
-	mumble_hook_call(client, "OnUserRemove", 1);
+	mumble_hook_call(client, HOOK_ON_USER_REMOVE, 1);
 
 	if (client->session == user->session) {
 		char* type = (user->has_ban && user->ban) ? "banned" : "kicked";
@@ -595,11 +784,11 @@ void packet_user_remove(MumbleClient *client, MumblePacket *packet) {
 		mumble_user_remove(client, user->session);
 	}
 
-	mumble_proto__user_remove__free_unpacked(user, NULL);
+	mumble_proto__user_remove__free_unpacked(user, &client->message_allocator);
 }
 
 void packet_user_state(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__UserState *state = mumble_proto__user_state__unpack(NULL, packet->length, packet->body);
+	MumbleProto__UserState *state = mumble_proto__user_state__unpack(&client->message_allocator, packet->length, packet->body);
 	if (state == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking user state packet");
 		return;
@@ -610,29 +799,20 @@ void packet_user_state(MumbleClient *client, MumblePacket *packet) {
 	lua_State* l = client->l;
 
 	if (!state->has_session) {
-		mumble_proto__user_state__free_unpacked(state, NULL);
+		mumble_proto__user_state__free_unpacked(state, &client->message_allocator);
 		return;
 	}
 
 	MumbleUser* user = mumble_user_get(client, state->session);
 
-	lua_newtable(l);
-	if (state->has_actor) {
-		mumble_user_raw_get(client, state->actor);
-		lua_setfield(l, -2, "actor");
-	}
-
+	// Update our user state first, the event tables are only built if someone is listening for them
 	user->session = state->session;
-	lua_pushinteger(l, user->session);
-	lua_setfield(l, -2, "session");
 
 	if (state->name != NULL) {
 		SAFE_STRDUP(user->name, state->name);
-		lua_pushstring(l, user->name);
-		lua_setfield(l, -2, "name");
 	}
 	if (state->has_channel_id) {
-		if (user->connected == true && client->synced == true && user->channel_id != state->channel_id) {
+		if (user->connected == true && client->synced == true && user->channel_id != state->channel_id && mumble_hook_active(client, HOOK_ON_USER_CHANNEL)) {
 			lua_newtable(l);
 			if (state->has_actor) {
 				mumble_user_raw_get(client, state->actor);
@@ -644,71 +824,137 @@ void packet_user_state(MumbleClient *client, MumblePacket *packet) {
 			lua_setfield(l, -2, "to");
 			mumble_user_raw_get(client, state->session);
 			lua_setfield(l, -2, "user");
-			mumble_hook_call(client, "OnUserChannel", 1);
+			mumble_hook_call(client, HOOK_ON_USER_CHANNEL, 1);
 		}
-		user->channel_id = state->channel_id;
+		mumble_user_set_channel(client, user, state->channel_id);
+	}
+	if (state->has_user_id) {
+		user->user_id = state->user_id;
+	}
+	if (state->has_mute) {
+		user->mute = state->mute;
+	}
+	if (state->has_deaf) {
+		user->deaf = state->deaf;
+	}
+	if (state->has_self_mute) {
+		user->self_mute = state->self_mute;
+	}
+	if (state->has_self_deaf) {
+		user->self_deaf = state->self_deaf;
+	}
+	if (state->has_suppress) {
+		user->suppress = state->suppress;
+	}
+	if (state->comment != NULL) {
+		SAFE_STRDUP(user->comment, state->comment);
+	}
+	if (state->has_recording) {
+		user->recording = state->recording;
+	}
+	if (state->has_priority_speaker) {
+		user->priority_speaker = state->priority_speaker;
+	}
+	if (state->has_texture) {
+		SAFE_STRNDUP(user->texture, state->texture.data, state->texture.len);
+	}
+	if (state->hash != NULL) {
+		SAFE_STRDUP(user->hash, state->hash);
+	}
+	if (state->has_comment_hash) {
+		SAFE_STRNDUP(user->comment_hash, state->comment_hash.data, state->comment_hash.len);
+		user->comment_hash_len = state->comment_hash.len;
+	}
+	if (state->has_texture_hash) {
+		SAFE_STRNDUP(user->texture_hash, state->texture_hash.data, state->texture_hash.len);
+		user->texture_hash_len = state->texture_hash.len;
+	}
+	for (uint32_t i = 0; i < state->n_listening_channel_add; i++) {
+		// Add the new entries to the head of the list
+		list_add(&user->listens, state->listening_channel_add[i], NULL);
+	}
+	for (uint32_t i = 0; i < state->n_listening_channel_remove; i++) {
+		list_remove(&user->listens, state->listening_channel_remove[i]);
+	}
+	for (uint32_t i = 0; i < state->n_listening_volume_adjustment; i++) {
+		MumbleChannel* chan = mumble_channel_get(client, state->listening_volume_adjustment[i]->listening_channel);
+		chan->listening_volume_adjustment = state->listening_volume_adjustment[i]->volume_adjustment;
+	}
+
+	bool connecting = false;
+
+	if (user->connected == false) {
+		user->connected = true;
+		connecting = client->synced == true && mumble_hook_active(client, HOOK_ON_USER_CONNECT);
+	}
+
+	if (!connecting && !mumble_hook_active(client, HOOK_ON_USER_STATE)) {
+		mumble_proto__user_state__free_unpacked(state, &client->message_allocator);
+		return;
+	}
+
+	lua_newtable(l);
+	if (state->has_actor) {
+		mumble_user_raw_get(client, state->actor);
+		lua_setfield(l, -2, "actor");
+	}
+
+	lua_pushinteger(l, user->session);
+	lua_setfield(l, -2, "session");
+
+	if (state->name != NULL) {
+		lua_pushstring(l, user->name);
+		lua_setfield(l, -2, "name");
+	}
+	if (state->has_channel_id) {
 		mumble_channel_raw_get(client, user->channel_id);
 		lua_setfield(l, -2, "channel");
 	}
 	if (state->has_user_id) {
-		user->user_id = state->user_id;
 		lua_pushinteger(l, user->user_id);
 		lua_setfield(l, -2, "user_id");
 	}
 	if (state->has_mute) {
-		user->mute = state->mute;
 		lua_pushboolean(l, user->mute);
 		lua_setfield(l, -2, "mute");
 	}
 	if (state->has_deaf) {
-		user->deaf = state->deaf;
 		lua_pushboolean(l, user->deaf);
 		lua_setfield(l, -2, "deaf");
 	}
 	if (state->has_self_mute) {
-		user->self_mute = state->self_mute;
 		lua_pushboolean(l, user->self_mute);
 		lua_setfield(l, -2, "self_mute");
 	}
 	if (state->has_self_deaf) {
-		user->self_deaf = state->self_deaf;
 		lua_pushboolean(l, user->self_deaf);
 		lua_setfield(l, -2, "self_deaf");
 	}
 	if (state->has_suppress) {
-		user->suppress = state->suppress;
 		lua_pushboolean(l, user->suppress);
 		lua_setfield(l, -2, "suppress");
 	}
 	if (state->comment != NULL) {
-		SAFE_STRDUP(user->comment, state->comment);
 		lua_pushstring(l, user->comment);
 		lua_setfield(l, -2, "comment");
 	}
 	if (state->has_recording) {
-		user->recording = state->recording;
 		lua_pushboolean(l, user->recording);
 		lua_setfield(l, -2, "recording");
 	}
 	if (state->has_priority_speaker) {
-		user->priority_speaker = state->priority_speaker;
 		lua_pushboolean(l, user->priority_speaker);
 		lua_setfield(l, -2, "priority_speaker");
 	}
 	if (state->has_texture) {
-		SAFE_STRNDUP(user->texture, state->texture.data, state->texture.len);
 		lua_pushlstring(l, user->texture, state->texture.len);
 		lua_setfield(l, -2, "texture");
 	}
 	if (state->hash != NULL) {
-		SAFE_STRDUP(user->hash, state->hash);
 		lua_pushstring(l, user->hash);
 		lua_setfield(l, -2, "hash");
 	}
 	if (state->has_comment_hash) {
-		SAFE_STRNDUP(user->comment_hash, state->comment_hash.data, state->comment_hash.len);
-		user->comment_hash_len = state->comment_hash.len;
-
 		char* result;
 		bin_to_strhex((char*) user->comment_hash, user->comment_hash_len, &result);
 		lua_pushstring(l, result);
@@ -716,9 +962,6 @@ void packet_user_state(MumbleClient *client, MumblePacket *packet) {
 		free(result);
 	}
 	if (state->has_texture_hash) {
-		SAFE_STRNDUP(user->texture_hash, state->texture_hash.data, state->texture_hash.len);
-		user->texture_hash_len = state->texture_hash.len;
-
 		char* result;
 		bin_to_strhex((char*) user->texture_hash, user->texture_hash_len, &result);
 		lua_pushstring(l, result);
@@ -726,10 +969,8 @@ void packet_user_state(MumbleClient *client, MumblePacket *packet) {
 		free(result);
 	}
 	if (state->n_listening_channel_add > 0) {
-		// Add the new entries to the head of the list
 		lua_newtable(l);
 		for (uint32_t i = 0; i < state->n_listening_channel_add; i++) {
-			list_add(&user->listens, state->listening_channel_add[i], NULL);
 			lua_pushinteger(l, i + 1);
 			mumble_channel_raw_get(client, state->listening_channel_add[i]);
 			lua_settable(l, -3);
@@ -739,7 +980,6 @@ void packet_user_state(MumbleClient *client, MumblePacket *packet) {
 	if (state->n_listening_channel_remove > 0) {
 		lua_newtable(l);
 		for (uint32_t i = 0; i < state->n_listening_channel_remove; i++) {
-			list_remove(&user->listens, state->listening_channel_remove[i]);
 			lua_pushinteger(l, i + 1);
 			mumble_channel_raw_get(client, state->listening_channel_remove[i]);
 			lua_settable(l, -3);
@@ -749,15 +989,9 @@ void packet_user_state(MumbleClient *client, MumblePacket *packet) {
 	if (state->n_listening_volume_adjustment > 0) {
 		lua_newtable(l);
 		for (uint32_t i = 0; i < state->n_listening_volume_adjustment; i++) {
-			uint32_t channel_id = state->listening_volume_adjustment[i]->listening_channel;
-			float volume_adjustment = state->listening_volume_adjustment[i]->volume_adjustment;
-
-			lua_pushinteger(l, channel_id);
-			lua_pushnumber(l, volume_adjustment);
+			lua_pushinteger(l, state->listening_volume_adjustment[i]->listening_channel);
+			lua_pushnumber(l, state->listening_volume_adjustment[i]->volume_adjustment);
 			lua_settable(l, -3);
-
-			MumbleChannel* chan = mumble_channel_get(client, channel_id);
-			chan->listening_volume_adjustment = volume_adjustment;
 		}
 		lua_setfield(l , -2, "listening_volume_adjustment");
 	}
@@ -765,21 +999,21 @@ void packet_user_state(MumbleClient *client, MumblePacket *packet) {
 	mumble_user_raw_get(client, state->session);
 	lua_setfield(l, -2, "user");
 
-	if (user->connected == false) {
-		user->connected = true;
-
-		if (client->synced == true) {
-			lua_pushvalue(l, -1); // Push a copy of the event table we will send to the 'OnUserState' hook
-			mumble_hook_call(client, "OnUserConnect", 1);
-		}
+	if (connecting) {
+		lua_pushvalue(l, -1); // Push a copy of the event table we will send to the 'OnUserState' hook
+		mumble_hook_call(client, HOOK_ON_USER_CONNECT, 1);
 	}
-	mumble_hook_call(client, "OnUserState", 1);
+	mumble_hook_call(client, HOOK_ON_USER_STATE, 1);
 
-	mumble_proto__user_state__free_unpacked(state, NULL);
+	mumble_proto__user_state__free_unpacked(state, &client->message_allocator);
 }
 
 void packet_ban_list(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__BanList *list = mumble_proto__ban_list__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_BAN_LIST)) {
+		return;
+	}
+
+	MumbleProto__BanList *list = mumble_proto__ban_list__unpack(&client->message_allocator, packet->length, packet->body);
 	if (list == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking ban list packet");
 		return;
@@ -824,13 +1058,17 @@ void packet_ban_list(MumbleClient *client, MumblePacket *packet) {
 			lua_settable(l, -3);
 		}
 	}
-	mumble_hook_call(client, "OnBanList", 1);
+	mumble_hook_call(client, HOOK_ON_BAN_LIST, 1);
 
-	mumble_proto__ban_list__free_unpacked(list, NULL);
+	mumble_proto__ban_list__free_unpacked(list, &client->message_allocator);
 }
 
 void packet_text_message(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__TextMessage *msg = mumble_proto__text_message__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_MESSAGE)) {
+		return;
+	}
+
+	MumbleProto__TextMessage *msg = mumble_proto__text_message__unpack(&client->message_allocator, packet->length, packet->body);
 	if (msg == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking text message packet");
 		return;
@@ -870,13 +1108,17 @@ void packet_text_message(MumbleClient *client, MumblePacket *packet) {
 		lua_pushboolean(l, true);
 		lua_setfield(l, -2, "direct");
 	}
-	mumble_hook_call(client, "OnMessage", 1);
+	mumble_hook_call(client, HOOK_ON_MESSAGE, 1);
 
-	mumble_proto__text_message__free_unpacked(msg, NULL);
+	mumble_proto__text_message__free_unpacked(msg, &client->message_allocator);
 }
 
 void packet_permission_denied(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__PermissionDenied *proto = mumble_proto__permission_denied__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_PERMISSION_DENIED)) {
+		return;
+	}
+
+	MumbleProto__PermissionDenied *proto = mumble_proto__permission_denied__unpack(&client->message_allocator, packet->length, packet->body);
 	if (proto == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking permission denied packet");
 		return;
@@ -911,13 +1153,17 @@ void packet_permission_denied(MumbleClient *client, MumblePacket *packet) {
 		lua_pushstring(l, proto->name);
 		lua_setfield(l, -2, "name");
 	}
-	mumble_hook_call(client, "OnPermissionDenied", 1);
+	mumble_hook_call(client, HOOK_ON_PERMISSION_DENIED, 1);
 
-	mumble_proto__permission_denied__free_unpacked(proto, NULL);
+	mumble_proto__permission_denied__free_unpacked(proto, &client->message_allocator);
 }
 
 void packet_acl(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__ACL *acl = mumble_proto__acl__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_ACL)) {
+		return;
+	}
+
+	MumbleProto__ACL *acl = mumble_proto__acl__unpack(&client->message_allocator, packet->length, packet->body);
 	if (acl == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking ACL packet");
 		return;
@@ -1025,13 +1271,17 @@ void packet_acl(MumbleClient *client, MumblePacket *packet) {
 		lua_pushboolean(l, acl->query);
 		lua_setfield(l, -2, "query");
 	}
-	mumble_hook_call(client, "OnACL", 1);
+	mumble_hook_call(client, HOOK_ON_ACL, 1);
 
-	mumble_proto__acl__free_unpacked(acl, NULL);
+	mumble_proto__acl__free_unpacked(acl, &client->message_allocator);
 }
 
 void packet_query_users(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__QueryUsers *users = mumble_proto__query_users__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_QUERY_USERS)) {
+		return;
+	}
+
+	MumbleProto__QueryUsers *users = mumble_proto__query_users__unpack(&client->message_allocator, packet->length, packet->body);
 	if (users == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking query users packet");
 		return;
@@ -1052,13 +1302,17 @@ void packet_query_users(MumbleClient *client, MumblePacket *packet) {
 			lua_settable(l, -3);
 		}
 	}
-	mumble_hook_call(client, "OnQueryUsers", 1);
+	mumble_hook_call(client, HOOK_ON_QUERY_USERS, 1);
 
-	mumble_proto__query_users__free_unpacked(users, NULL);
+	mumble_proto__query_users__free_unpacked(users, &client->message_allocator);
 }
 
 void packet_context_action_modify(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__ContextActionModify *modify = mumble_proto__context_action_modify__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_CONTEXT_ACTION_MODIFY)) {
+		return;
+	}
+
+	MumbleProto__ContextActionModify *modify = mumble_proto__context_action_modify__unpack(&client->message_allocator, packet->length, packet->body);
 	if (modify == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking context action modify packet");
 		return;
@@ -1087,13 +1341,13 @@ void packet_context_action_modify(MumbleClient *client, MumblePacket *packet) {
 			lua_setfield(l, -2, "operation");
 		}
 	}
-	mumble_hook_call(client, "OnContextActionModify", 1);
+	mumble_hook_call(client, HOOK_ON_CONTEXT_ACTION_MODIFY, 1);
 
-	mumble_proto__context_action_modify__free_unpacked(modify, NULL);
+	mumble_proto__context_action_modify__free_unpacked(modify, &client->message_allocator);
 }
 
 void packet_crypt_setup(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__CryptSetup *crypt = mumble_proto__crypt_setup__unpack(NULL, packet->length, packet->body);
+	MumbleProto__CryptSetup *crypt = mumble_proto__crypt_setup__unpack(&client->message_allocator, packet->length, packet->body);
 	if (crypt == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking crypt setup packet");
 		return;
@@ -1155,13 +1409,17 @@ void packet_crypt_setup(MumbleClient *client, MumblePacket *packet) {
 		lua_setfield(l, -2, "server_nonce");
 		free(result);
 	}
-	mumble_hook_call(client, "OnCryptSetup", 1);
+	mumble_hook_call(client, HOOK_ON_CRYPT_SETUP, 1);
 
-	mumble_proto__crypt_setup__free_unpacked(crypt, NULL);
+	mumble_proto__crypt_setup__free_unpacked(crypt, &client->message_allocator);
 }
 
 void packet_user_list(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__UserList *list = mumble_proto__user_list__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_USER_LIST)) {
+		return;
+	}
+
+	MumbleProto__UserList *list = mumble_proto__user_list__unpack(&client->message_allocator, packet->length, packet->body);
 	if (list == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking user list packet");
 		return;
@@ -1194,13 +1452,13 @@ void packet_user_list(MumbleClient *client, MumblePacket *packet) {
 			lua_settable(l, -3);
 		}
 	}
-	mumble_hook_call(client, "OnUserList", 1);
+	mumble_hook_call(client, HOOK_ON_USER_LIST, 1);
 
-	mumble_proto__user_list__free_unpacked(list, NULL);
+	mumble_proto__user_list__free_unpacked(list, &client->message_allocator);
 }
 
 void packet_permission_query(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__PermissionQuery *query = mumble_proto__permission_query__unpack(NULL, packet->length, packet->body);
+	MumbleProto__PermissionQuery *query = mumble_proto__permission_query__unpack(&client->message_allocator, packet->length, packet->body);
 	if (query == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking permission query packet");
 		return;
@@ -1240,13 +1498,13 @@ void packet_permission_query(MumbleClient *client, MumblePacket *packet) {
 		lua_pushinteger(l, query->flush);
 		lua_setfield(l, -2, "flush");
 	}
-	mumble_hook_call(client, "OnPermissionQuery", 1);
+	mumble_hook_call(client, HOOK_ON_PERMISSION_QUERY, 1);
 
-	mumble_proto__permission_query__free_unpacked(query, NULL);
+	mumble_proto__permission_query__free_unpacked(query, &client->message_allocator);
 }
 
 void packet_codec_version(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__CodecVersion *codec = mumble_proto__codec_version__unpack(NULL, packet->length, packet->body);
+	MumbleProto__CodecVersion *codec = mumble_proto__codec_version__unpack(&client->message_allocator, packet->length, packet->body);
 	if (codec == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking codec version packet");
 		return;
@@ -1267,13 +1525,17 @@ void packet_codec_version(MumbleClient *client, MumblePacket *packet) {
 		lua_pushboolean(l, codec->opus);
 		lua_setfield(l, -2, "opus");
 	}
-	mumble_hook_call(client, "OnCodecVersion", 1);
+	mumble_hook_call(client, HOOK_ON_CODEC_VERSION, 1);
 
-	mumble_proto__codec_version__free_unpacked(codec, NULL);
+	mumble_proto__codec_version__free_unpacked(codec, &client->message_allocator);
 }
 
 void packet_user_stats(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__UserStats *stats = mumble_proto__user_stats__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_USER_STATS)) {
+		return;
+	}
+
+	MumbleProto__UserStats *stats = mumble_proto__user_stats__unpack(&client->message_allocator, packet->length, packet->body);
 	if (stats == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking user stats packet");
 		return;
@@ -1470,13 +1732,17 @@ void packet_user_stats(MumbleClient *client, MumblePacket *packet) {
 		lua_setfield(l, -2, "rolling_stats");
 	}
 
-	mumble_hook_call(client, "OnUserStats", 1);
+	mumble_hook_call(client, HOOK_ON_USER_STATS, 1);
 
-	mumble_proto__user_stats__free_unpacked(stats, NULL);
+	mumble_proto__user_stats__free_unpacked(stats, &client->message_allocator);
 }
 
 void packet_server_config(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__ServerConfig *config = mumble_proto__server_config__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_SERVER_CONFIG)) {
+		return;
+	}
+
+	MumbleProto__ServerConfig *config = mumble_proto__server_config__unpack(&client->message_allocator, packet->length, packet->body);
 	if (config == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking server config packet");
 		return;
@@ -1513,13 +1779,13 @@ void packet_server_config(MumbleClient *client, MumblePacket *packet) {
 		lua_pushinteger(l, config->recording_allowed);
 		lua_setfield(l , -2, "recording_allowed");
 	}
-	mumble_hook_call(client, "OnServerConfig", 1);
+	mumble_hook_call(client, HOOK_ON_SERVER_CONFIG, 1);
 
-	mumble_proto__server_config__free_unpacked(config, NULL);
+	mumble_proto__server_config__free_unpacked(config, &client->message_allocator);
 }
 
 void packet_suggest_config(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__SuggestConfig *config = mumble_proto__suggest_config__unpack(NULL, packet->length, packet->body);
+	MumbleProto__SuggestConfig *config = mumble_proto__suggest_config__unpack(&client->message_allocator, packet->length, packet->body);
 	if (config == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking suggested config packet");
 		return;
@@ -1548,13 +1814,17 @@ void packet_suggest_config(MumbleClient *client, MumblePacket *packet) {
 		lua_pushboolean(l, config->push_to_talk);
 		lua_setfield(l, -2, "push_to_talk");
 	}
-	mumble_hook_call(client, "OnSuggestConfig", 1);
+	mumble_hook_call(client, HOOK_ON_SUGGEST_CONFIG, 1);
 
-	mumble_proto__suggest_config__free_unpacked(config, NULL);
+	mumble_proto__suggest_config__free_unpacked(config, &client->message_allocator);
 }
 
 void packet_plugin_data(MumbleClient *client, MumblePacket *packet) {
-	MumbleProto__PluginDataTransmission *transmission = mumble_proto__plugin_data_transmission__unpack(NULL, packet->length, packet->body);
+	if (!mumble_hook_active(client, HOOK_ON_PLUGIN_DATA)) {
+		return;
+	}
+
+	MumbleProto__PluginDataTransmission *transmission = mumble_proto__plugin_data_transmission__unpack(&client->message_allocator, packet->length, packet->body);
 	if (transmission == NULL) {
 		mumble_log(LOG_WARN, "[TCP] Error unpacking data transmission packet");
 		return;
@@ -1588,9 +1858,9 @@ void packet_plugin_data(MumbleClient *client, MumblePacket *packet) {
 		lua_pushstring(l, transmission->dataid);
 		lua_setfield(l, -2, "id");
 	}
-	mumble_hook_call(client, "OnPluginData", 1);
+	mumble_hook_call(client, HOOK_ON_PLUGIN_DATA, 1);
 
-	mumble_proto__plugin_data_transmission__free_unpacked(transmission, NULL);
+	mumble_proto__plugin_data_transmission__free_unpacked(transmission, &client->message_allocator);
 }
 
 const Packet_Handler_Func packet_handler[NUM_PACKETS] = {
@@ -42,6 +42,12 @@ enum {
 #define packet_send(client, type, message) packet_sendex(client, type, message, message.base, 0)
 int packet_sendex(MumbleClient* client, const int type, const void *message, const ProtobufCMessage* base, const int length);
 int packet_sendudp(MumbleClient* client, const void *message, const int length);
+void packet_udp_flush(MumbleClient* client);
+void packet_tcp_flush(MumbleClient* client);
+void packet_flush_prepare(uv_prepare_t* handle);
+void packet_flush_check(uv_check_t* handle);
+void packet_udp_discard(MumbleClient* client);
+void packet_udp_free_pool(MumbleClient* client);
 
 typedef void (*Packet_Handler_Func)(MumbleClient *client, MumblePacket *packet);
 
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "record.h"
+#include "log.h"
+
+// Used to write silence into a recording without having to allocate a buffer for it
+static const float record_silence[AUDIO_RECORD_MAX_FRAMES * AUDIO_PLAYBACK_CHANNELS];
+
+static bool record_job_push(MumbleRecordWorker *worker, MumbleRecordJob *job) {
+	size_t head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&worker->tail, memory_order_acquire);
+
+	if (head - tail >= AUDIO_RECORD_QUEUE_SIZE) {
+		// Full
+		return false;
+	}
+
+	worker->jobs[head & (AUDIO_RECORD_QUEUE_SIZE - 1)] = job;
+	atomic_store_explicit(&worker->head, head + 1, memory_order_release);
+	uv_sem_post(&worker->wakeup);
+	return true;
+}
+
+static MumbleRecordJob* record_job_pop(MumbleRecordWorker *worker) {
+	size_t tail = atomic_load_explicit(&worker->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&worker->head, memory_order_acquire);
+
+	if (tail == head) {
+		// Empty
+		return NULL;
+	}
+
+	MumbleRecordJob *job = worker->jobs[tail & (AUDIO_RECORD_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&worker->tail, tail + 1, memory_order_release);
+	return job;
+}
+
+// Hands a finished job back to the main loop, or frees it when it can't be reused
+static void record_job_recycle(MumbleRecordWorker *worker, MumbleRecordJob *job) {
+	if (!job->pooled) {
+		free(job);
+		return;
+	}
+
+	size_t head = atomic_load_explicit(&worker->pool_head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&worker->pool_tail, memory_order_acquire);
+
+	if (head - tail >= AUDIO_RECORD_QUEUE_SIZE) {
+		free(job);
+		return;
+	}
+
+	worker->pool[head & (AUDIO_RECORD_QUEUE_SIZE - 1)] = job;
+	atomic_store_explicit(&worker->pool_head, head + 1, memory_order_release);
+}
+
+static MumbleRecordJob* record_job_reuse(MumbleRecordWorker *worker) {
+	size_t tail = atomic_load_explicit(&worker->pool_tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&worker->pool_head, memory_order_acquire);
+
+	if (tail == head) {
+		return NULL;
+	}
+
+	MumbleRecordJob *job = worker->pool[tail & (AUDIO_RECORD_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&worker->pool_tail, tail + 1, memory_order_release);
+	return job;
+}
+
+static void record_close(MumbleRecorder *recorder) {
+	sf_close(recorder->file);
+	if (recorder->decoder) {
+		opus_decoder_destroy(recorder->decoder);
+	}
+	free(recorder);
+}
+
+static void record_decode(MumbleRecordWorker *worker, MumbleRecordJob *job) {
+	MumbleRecorder *recorder = job->recorder;
+
+	if (job->reset) {
+		opus_decoder_ctl(recorder->decoder, OPUS_RESET_STATE);
+	}
+
+	const uint8_t *data = job->length > 0 ? job->data : NULL;
+	int frames = opus_decode_float(recorder->decoder, data, job->length, worker->pcm, job->frames, job->fec);
+
+	if (frames < 0 && data != NULL) {
+		// Conceal a packet we can't decode, like the main loop would have
+		frames = opus_decode_float(recorder->decoder, NULL, 0, worker->pcm, JITTER_FRAME_SIZE, 0);
+	}
+
+	if (frames > 0) {
+		sf_write_float(recorder->file, worker->pcm, frames * AUDIO_PLAYBACK_CHANNELS);
+	}
+}
+
+static void record_job_process(MumbleRecordWorker *worker, MumbleRecordJob *job) {
+	MumbleRecorder *recorder = job->recorder;
+
+	switch (job->type) {
+	case RECORD_JOB_PCM:
+		sf_write_float(recorder->file, (const float*) job->data, job->length);
+		break;
+	case RECORD_JOB_SILENCE: {
+		size_t remaining = job->length;
+		while (remaining > 0) {
+			size_t chunk = remaining;
+			if (chunk > AUDIO_RECORD_MAX_FRAMES * AUDIO_PLAYBACK_CHANNELS) {
+				chunk = AUDIO_RECORD_MAX_FRAMES * AUDIO_PLAYBACK_CHANNELS;
+			}
+			sf_write_float(recorder->file, record_silence, chunk);
+			remaining -= chunk;
+		}
+		break;
+	}
+	case RECORD_JOB_DECODE:
+		record_decode(worker, job);
+		break;
+	case RECORD_JOB_CLOSE:
+		record_close(recorder);
+		break;
+	}
+}
+
+static void mumble_record_thread(void *arg) {
+	pthread_setname_np(pthread_self(), "record");
+
+	MumbleRecordWorker *worker = (MumbleRecordWorker *)arg;
+
+	while (true) {
+		uv_sem_wait(&worker->wakeup);
+
+		// Read the flag before draining, so every job pushed before shutdown is handled
+		bool running = atomic_load(&worker->running);
+
+		// Every job for these recordings was queued before they were closed, so it is in the ring by now
+		MumbleRecordJob *closing = atomic_exchange(&worker->closing, NULL);
+
+		MumbleRecordJob *job;
+		while ((job = record_job_pop(worker)) != NULL) {
+			record_job_process(worker, job);
+			record_job_recycle(worker, job);
+		}
+
+		while (closing != NULL) {
+			job = closing;
+			closing = job->next;
+			record_job_process(worker, job);
+			free(job);
+		}
+
+		if (!running) {
+			break;
+		}
+	}
+}
+
+static bool record_workers_start(MumbleClient *client) {
+	if (client->record_workers != NULL) {
+		return true;
+	}
+
+	MumbleRecordWorker *workers = malloc(sizeof(MumbleRecordWorker) * AUDIO_RECORD_THREADS);
+	if (workers == NULL) {
+		mumble_log(LOG_ERROR, "failed to allocate recording workers");
+		return false;
+	}
+
+	for (int i = 0; i < AUDIO_RECORD_THREADS; i++) {
+		MumbleRecordWorker *worker = &workers[i];
+		atomic_init(&worker->head, 0);
+		atomic_init(&worker->tail, 0);
+		atomic_init(&worker->pool_head, 0);
+		atomic_init(&worker->pool_tail, 0);
+		atomic_init(&worker->closing, NULL);
+		atomic_init(&worker->running, true);
+		uv_sem_init(&worker->wakeup, 0);
+		uv_thread_create(&worker->thread, mumble_record_thread, worker);
+	}
+
+	client->record_workers = workers;
+	return true;
+}
+
+void mumble_record_shutdown(MumbleClient *client) {
+	MumbleRecordWorker *workers = client->record_workers;
+
+	if (workers == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < AUDIO_RECORD_THREADS; i++) {
+		MumbleRecordWorker *worker = &workers[i];
+		atomic_store(&worker->running, false);
+		uv_sem_post(&worker->wakeup);
+		uv_thread_join(&worker->thread);
+		uv_sem_destroy(&worker->wakeup);
+
+		MumbleRecordJob *job;
+		while ((job = record_job_reuse(worker)) != NULL) {
+			free(job);
+		}
+	}
+
+	free(workers);
+	client->record_workers = NULL;
+}
+
+static MumbleRecordJob* record_job_new(MumbleRecordJobType type, MumbleRecorder *recorder, size_t length, size_t data_len) {
+	MumbleRecordJob *job = NULL;
+	bool pooled = data_len <= AUDIO_RECORD_JOB_SIZE && type != RECORD_JOB_CLOSE;
+
+	if (pooled) {
+		job = record_job_reuse(recorder->worker);
+		if (job == NULL) {
+			// Every pooled job is made big enough to be reused for any of them
+			job = malloc(sizeof(MumbleRecordJob) + AUDIO_RECORD_JOB_SIZE);
+		}
+	} else {
+		job = malloc(sizeof(MumbleRecordJob) + data_len);
+	}
+
+	if (job == NULL) {
+		mumble_log(LOG_ERROR, "failed to allocate recording job");
+		return NULL;
+	}
+	job->type = type;
+	job->recorder = recorder;
+	job->length = length;
+	job->pooled = pooled;
+	return job;
+}
+
+MumbleRecorder* mumble_record_open(MumbleClient *client, SNDFILE *file, uint32_t key) {
+	if (!record_workers_start(client)) {
+		return NULL;
+	}
+
+	MumbleRecorder *recorder = malloc(sizeof(MumbleRecorder));
+	if (recorder == NULL) {
+		return NULL;
+	}
+
+	// Allocated up front, so closing a recording can never fail
+	recorder->close_job = record_job_new(RECORD_JOB_CLOSE, recorder, 0, 0);
+	if (recorder->close_job == NULL) {
+		free(recorder);
+		return NULL;
+	}
+
+	recorder->file = file;
+	recorder->decoder = NULL;
+	// Pin each recording to a single worker, so its audio is always written in order
+	recorder->worker = &client->record_workers[key % AUDIO_RECORD_THREADS];
+	return recorder;
+}
+
+void mumble_record_write(MumbleRecorder *recorder, const float *pcm, size_t samples) {
+	if (recorder == NULL || samples == 0) {
+		return;
+	}
+
+	MumbleRecordJob *job = record_job_new(RECORD_JOB_PCM, recorder, samples, samples * sizeof(float));
+	if (job == NULL) {
+		return;
+	}
+
+	memcpy(job->data, pcm, samples * sizeof(float));
+
+	if (!record_job_push(recorder->worker, job)) {
+		mumble_log(LOG_WARN, "recording queue full, dropping audio");
+		free(job);
+	}
+}
+
+void mumble_record_close(MumbleRecorder *recorder) {
+	MumbleRecordWorker *worker = recorder->worker;
+	MumbleRecordJob *job = recorder->close_job;
+
+	// The worker closes the file after the jobs already in its ring, however full it is
+	job->next = atomic_load(&worker->closing);
+	while (!atomic_compare_exchange_weak(&worker->closing, &job->next, job));
+
+	uv_sem_post(&worker->wakeup);
+}
+
+int mumble_record_start(MumbleClient *client, MumbleUser *user, SNDFILE *file) {
+	MumbleRecorder *recorder = mumble_record_open(client, file, user->session);
+	if (recorder == NULL) {
+		return OPUS_ALLOC_FAIL;
+	}
+
+	int err;
+	recorder->decoder = opus_decoder_create(AUDIO_SAMPLE_RATE, AUDIO_PLAYBACK_CHANNELS, &err);
+	if (err != OPUS_OK) {
+		free(recorder->close_job);
+		free(recorder);
+		return err;
+	}
+
+	user->recorder = recorder;
+	client->recording_users++;
+	return OPUS_OK;
+}
+
+void mumble_record_pcm(MumbleClient *client, MumbleUser *user, const float *pcm, size_t samples) {
+	mumble_record_write(user->recorder, pcm, samples);
+}
+
+void mumble_record_decode(MumbleClient *client, MumbleUser *user, const uint8_t *data, size_t length, int frames, bool fec, bool reset) {
+	MumbleRecorder *recorder = user->recorder;
+
+	if (recorder == NULL) {
+		return;
+	}
+
+	MumbleRecordJob *job = record_job_new(RECORD_JOB_DECODE, recorder, length, length);
+	if (job == NULL) {
+		return;
+	}
+
+	if (length > 0) {
+		memcpy(job->data, data, length);
+	}
+	job->frames = frames;
+	job->fec = fec;
+	job->reset = reset;
+
+	if (!record_job_push(recorder->worker, job)) {
+		mumble_log(LOG_WARN, "recording queue full, dropping voice for user session: %u", user->session);
+		free(job);
+	}
+}
+
+void mumble_record_silence(MumbleClient *client, MumbleUser *user, size_t samples) {
+	MumbleRecorder *recorder = user->recorder;
+
+	if (recorder == NULL || samples == 0) {
+		return;
+	}
+
+	MumbleRecordJob *job = record_job_new(RECORD_JOB_SILENCE, recorder, samples, 0);
+	if (job == NULL) {
+		return;
+	}
+
+	if (!record_job_push(recorder->worker, job)) {
+		mumble_log(LOG_WARN, "recording queue full, dropping silence for user session: %u", user->session);
+		free(job);
+	}
+}
+
+void mumble_record_stop(MumbleClient *client, MumbleUser *user) {
+	MumbleRecorder *recorder = user->recorder;
+
+	if (recorder == NULL) {
+		return;
+	}
+
+	user->recorder = NULL;
+	client->recording_users--;
+
+	mumble_record_close(recorder);
+}
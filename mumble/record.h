@@ -0,0 +1,15 @@
+#pragma once
+
+#include "types.h"
+
+MumbleRecorder* mumble_record_open(MumbleClient *client, SNDFILE *file, uint32_t key);
+void mumble_record_write(MumbleRecorder *recorder, const float *pcm, size_t samples);
+void mumble_record_close(MumbleRecorder *recorder);
+
+int mumble_record_start(MumbleClient *client, MumbleUser *user, SNDFILE *file);
+void mumble_record_stop(MumbleClient *client, MumbleUser *user);
+void mumble_record_pcm(MumbleClient *client, MumbleUser *user, const float *pcm, size_t samples);
+// Decodes an opus packet on the recording worker, a missing packet is concealed
+void mumble_record_decode(MumbleClient *client, MumbleUser *user, const uint8_t *data, size_t length, int frames, bool fec, bool reset);
+void mumble_record_silence(MumbleClient *client, MumbleUser *user, size_t samples);
+void mumble_record_shutdown(MumbleClient *client);
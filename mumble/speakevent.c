@@ -0,0 +1,142 @@
+#include "mumble.h"
+
+#include "buffer.h"
+#include "speakevent.h"
+
+// Leaves the new event on the stack
+static MumbleSpeakEvent* speakevent_new(MumbleClient* client) {
+	lua_State* l = client->l;
+
+	MumbleSpeakEvent* event = lua_newuserdata(l, sizeof(MumbleSpeakEvent));
+	memset(event, 0, sizeof(MumbleSpeakEvent));
+	event->client = client;
+	event->buffer_ref = LUA_NOREF;
+	luaL_getmetatable(l, METATABLE_SPEAKEVENT);
+	lua_setmetatable(l, -2);
+
+	event->buffer = luabuffer_new(l);
+	buffer_init_view(event->buffer, NULL, 0);
+	event->buffer_ref = mumble_ref(l);
+	return event;
+}
+
+void mumble_speakevent_init(MumbleClient* client) {
+	client->speak_event = speakevent_new(client);
+	client->speak_event_ref = mumble_ref(client->l);
+}
+
+MumbleSpeakEvent* mumble_speakevent_push(MumbleClient* client, uint32_t session, const uint8_t* data, size_t length) {
+	MumbleSpeakEvent* event = client->speak_event;
+
+	if (event->busy) {
+		// A callback transmitted voice of its own, don't change the event it is still looking at
+		event = speakevent_new(client);
+	} else {
+		mumble_pushref(client->l, client->speak_event_ref);
+	}
+
+	event->busy = true;
+	event->session = session;
+	event->data = data;
+	event->length = length;
+	event->has_context = false;
+
+	// Point the data view at the payload, dropping anything a previous callback wrote into it
+	buffer_free(event->buffer);
+	buffer_init_view(event->buffer, data, length);
+	return event;
+}
+
+void mumble_speakevent_release(MumbleSpeakEvent* event) {
+	// The payload is about to be reused, so anything still holding the view sees an empty buffer
+	if (event->buffer->view) {
+		buffer_init_view(event->buffer, NULL, 0);
+	}
+	event->data = NULL;
+	event->length = 0;
+	event->busy = false;
+}
+
+static void speakevent_push_field(lua_State* l, MumbleSpeakEvent* event, const char* key) {
+	MumbleClient* client = event->client;
+
+	if (strcmp(key, "user") == 0) {
+		mumble_user_raw_get(client, event->session);
+	} else if (strcmp(key, "codec") == 0) {
+		lua_pushinteger(l, event->codec);
+	} else if (strcmp(key, "target") == 0) {
+		lua_pushinteger(l, event->target);
+	} else if (strcmp(key, "sequence") == 0) {
+		lua_pushnumber(l, event->sequence);
+	} else if (strcmp(key, "speaking") == 0) {
+		lua_pushboolean(l, event->speaking);
+	} else if (strcmp(key, "context") == 0 && event->has_context) {
+		lua_pushinteger(l, event->context);
+	} else if (strcmp(key, "data") == 0 && event->data != NULL) {
+		mumble_pushref(l, event->buffer_ref);
+	} else if (strcmp(key, "channels") == 0 && event->data != NULL) {
+		lua_pushinteger(l, opus_packet_get_nb_channels(event->data));
+	} else if (strcmp(key, "bandwidth") == 0 && event->data != NULL) {
+		lua_pushinteger(l, opus_packet_get_bandwidth(event->data));
+	} else if (strcmp(key, "samples_per_frame") == 0 && event->data != NULL) {
+		lua_pushinteger(l, opus_packet_get_samples_per_frame(event->data, AUDIO_SAMPLE_RATE));
+	} else {
+		lua_pushnil(l);
+	}
+}
+
+static const char* speakevent_fields[] = {
+	"user", "codec", "target", "sequence", "speaking", "context", "channels", "bandwidth", "samples_per_frame", NULL
+};
+
+static int speakevent_copy(lua_State *l) {
+	MumbleSpeakEvent *event = luaL_checkudata(l, 1, METATABLE_SPEAKEVENT);
+
+	lua_newtable(l);
+	for (int i = 0; speakevent_fields[i] != NULL; i++) {
+		speakevent_push_field(l, event, speakevent_fields[i]);
+		lua_setfield(l, -2, speakevent_fields[i]);
+	}
+
+	if (event->data != NULL) {
+		// The copy owns its payload, so it's safe to keep after the hook returns
+		lua_pushlstring(l, (const char*) event->data, event->length);
+		lua_setfield(l, -2, "data");
+	}
+	return 1;
+}
+
+static int speakevent_index(lua_State *l) {
+	MumbleSpeakEvent *event = luaL_checkudata(l, 1, METATABLE_SPEAKEVENT);
+	const char* key = luaL_checkstring(l, 2);
+
+	// Metatable lookups
+	lua_getmetatable(l, 1);
+	lua_getfield(l, -1, key);
+	if (!lua_isnil(l, -1)) {
+		return 1;
+	}
+	lua_pop(l, 2);
+
+	speakevent_push_field(l, event, key);
+	return 1;
+}
+
+static int speakevent_gc(lua_State *l) {
+	MumbleSpeakEvent *event = luaL_checkudata(l, 1, METATABLE_SPEAKEVENT);
+	mumble_unref(l, &event->buffer_ref);
+	return 0;
+}
+
+static int speakevent_tostring(lua_State *l) {
+	lua_pushfstring(l, "%s: %p", METATABLE_SPEAKEVENT, lua_topointer(l, 1));
+	return 1;
+}
+
+const luaL_Reg mumble_speakevent[] = {
+	{"copy", speakevent_copy},
+	{"__index", speakevent_index},
+	{"__tostring", speakevent_tostring},
+	{"__gc", speakevent_gc},
+	{NULL, NULL}
+};
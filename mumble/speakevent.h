@@ -0,0 +1,13 @@
+#pragma once
+
+#include <lauxlib.h>
+
+#include "types.h"
+
+#define METATABLE_SPEAKEVENT	"mumble.speakevent"
+
+void mumble_speakevent_init(MumbleClient* client);
+MumbleSpeakEvent* mumble_speakevent_push(MumbleClient* client, uint32_t session, const uint8_t* data, size_t length);
+void mumble_speakevent_release(MumbleSpeakEvent* event);
+
+extern const luaL_Reg mumble_speakevent[];
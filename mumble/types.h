@@ -9,6 +9,7 @@
 #include <openssl/evp.h>
 #include <samplerate.h>
 #include <stdatomic.h>
+#include <protobuf-c/protobuf-c.h>
 
 #include <stdbool.h>
 
@@ -23,9 +24,14 @@ typedef struct MumbleClient MumbleClient;
 typedef struct AudioStream AudioStream;
 typedef struct AudioBuffer AudioBuffer;
 typedef struct AudioFrame AudioFrame;
+typedef struct AudioClip AudioClip;
+typedef struct EncodedClip EncodedClip;
+typedef struct OggOpusReader OggOpusReader;
 typedef struct MumbleChannel MumbleChannel;
 typedef struct MumbleUser MumbleUser;
 typedef struct LinkNode LinkNode;
+typedef struct IndexMap IndexMap;
+typedef struct MumbleUdpSend MumbleUdpSend;
 typedef struct MumbleTimer MumbleTimer;
 typedef struct mumble_crypt mumble_crypt;
 typedef struct MumbleThreadWorker MumbleThreadWorker;
@@ -35,6 +41,12 @@ typedef struct QueueNode QueueNode;
 typedef struct LinkQueue LinkQueue;
 typedef struct MumbleOpusDecoder MumbleOpusDecoder;
 typedef struct MumblePacket MumblePacket;
+typedef struct MumbleRecorder MumbleRecorder;
+typedef struct MumbleRecordJob MumbleRecordJob;
+typedef struct MumbleRecordWorker MumbleRecordWorker;
+typedef struct MumbleBufferWorker MumbleBufferWorker;
+typedef struct MumbleAudioTask MumbleAudioTask;
+typedef struct MumbleJitter MumbleJitter;
 
 struct MumbleTimer {
 	uv_timer_t timer;
@@ -72,9 +84,70 @@ struct MumbleOpusDecoder {
 	int channels;
 };
 
+// Which version of a file on disk something was made from, so caches keyed by its path notice when it changes
+typedef struct {
+	uint64_t size;
+	// Nanoseconds since the epoch
+	int64_t mtime;
+} FileStamp;
+
+// A whole audio file decoded and resampled to 48 kHz stereo, shared through the audio cache
+struct AudioClip {
+	char* path;
+	int quality;
+	uint32_t hash;
+	FileStamp stamp;
+	SF_INFO info;
+	char* strings[SF_STR_COMMENT + 1];
+	float* pcm;
+	sf_count_t frames;
+	size_t bytes;
+	int refs;
+	bool cached;
+	AudioClip* prev;
+	AudioClip* next;
+	AudioClip* hash_next;
+};
+
+// The opus packets of one solo playback, kept in a clients encoded frame cache so the same playback can be sent again without encoding it
+struct EncodedClip {
+	char* path;
+	int quality;
+	uint32_t hash;
+	FileStamp stamp;
+	float volume;
+	opus_int32 bitrate;
+	uint32_t frame_size;
+	uint8_t* data;
+	size_t data_length;
+	size_t data_capacity;
+	uint16_t* lengths;
+	uint32_t packets;
+	uint32_t packets_capacity;
+	size_t bytes;
+	int refs;
+	bool cached;
+	EncodedClip* prev;
+	EncodedClip* next;
+	EncodedClip* hash_next;
+};
+
 struct AudioStream {
 	MumbleClient *client;
 	SNDFILE *file;
+	AudioClip *clip;
+	sf_count_t clip_position;
+	OggOpusReader *opus;
+	bool passthrough;
+	char *path;
+	int quality;
+	FileStamp stamp;
+	EncodedClip *replay;
+	uint32_t replay_packet;
+	size_t replay_offset;
+	bool fresh;
+	_Atomic bool refilling;
+	AudioStream *refill_failed;
 	bool closed;
 	bool playing;
 	float volume;
@@ -145,7 +218,7 @@ struct MumbleThreadController {
 	LinkQueue*	message_queue;
 };
 
-typedef struct {
+typedef struct audio_work_s {
 	MumbleClient* client;
 	sf_count_t frame_size;
 	bool end_frame;
@@ -154,19 +227,19 @@ typedef struct {
 	opus_int32 encoded_len;
 	float encode_time;
 	uint32_t audio_sequence;
+	bool passthrough; // Already encoded, so the encode thread only has to pass it along
+	uint32_t record; // Id of the encoded frame cache recording this frame belongs to, or 0
+	bool pooled;
+	struct audio_work_s *next;
 } audio_work_t;
 
-typedef struct audio_queue_node_s {
-	audio_work_t *work;
-	struct audio_queue_node_s *next;
-} audio_queue_node_t;
-
+// Single producer, single consumer ring of audio work
 typedef struct audio_queue_s {
-	audio_queue_node_t *front;
-	audio_queue_node_t *rear;
+	audio_work_t *items[AUDIO_QUEUE_SIZE];
+	_Atomic size_t head;
+	_Atomic size_t tail;
 
-	uv_mutex_t mutex;
-	uv_cond_t cond;
+	uv_sem_t wakeup;
 } audio_queue_t;
 
 typedef struct {
@@ -174,6 +247,177 @@ typedef struct {
 	audio_work_t *work;
 } audio_send_event_t;
 
+// Scratch memory that is handed out with a pointer bump and released all at once.
+// Anything that doesn't fit is malloc'd and the arena grows to fit on the next reset,
+// so a steady stream of same sized allocations stops allocating after the first one.
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t used;
+	size_t peak;
+	void *overflow;
+} Arena;
+
+struct MumbleRecorder {
+	SNDFILE *file;
+	MumbleRecordWorker *worker;
+	MumbleRecordJob *close_job;
+	// Only used by the worker, for voice that is decoded there instead of on the main loop
+	OpusDecoder *decoder;
+};
+
+typedef enum {
+	RECORD_JOB_PCM,
+	RECORD_JOB_SILENCE,
+	RECORD_JOB_DECODE,
+	RECORD_JOB_CLOSE,
+} MumbleRecordJobType;
+
+struct MumbleRecordJob {
+	MumbleRecordJobType type;
+	MumbleRecorder *recorder;
+	size_t length;
+	// Decode jobs only, the opus packet is in data, or missing when length is 0
+	int frames;
+	bool fec;
+	bool reset;
+	// Taken from the workers job pool, rather than allocated for this job alone
+	bool pooled;
+	// Close jobs only, the next recording the worker has to close
+	MumbleRecordJob *next;
+	uint8_t data[];
+};
+
+struct MumbleRecordWorker {
+	uv_thread_t thread;
+	uv_sem_t wakeup;
+	_Atomic bool running;
+	// Single producer (main loop), single consumer (worker) ring of pending jobs
+	MumbleRecordJob *jobs[AUDIO_RECORD_QUEUE_SIZE];
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	// Recordings to close once every job queued before them is done, kept out of the ring so closing never has to wait for room
+	MumbleRecordJob *_Atomic closing;
+	// Single producer (worker), single consumer (main loop) ring of finished jobs to reuse
+	MumbleRecordJob *pool[AUDIO_RECORD_QUEUE_SIZE];
+	_Atomic size_t pool_head;
+	_Atomic size_t pool_tail;
+	float pcm[AUDIO_RECORD_MAX_FRAMES * AUDIO_PLAYBACK_CHANNELS];
+};
+
+// Decodes audio files into the ring buffers of whichever streams are closest to running out
+struct MumbleBufferWorker {
+	MumbleClient* client;
+	uv_thread_t thread;
+	Arena arena;
+};
+
+// A piece of a clients audio work, run by the shared audio workers when the client uses them
+struct MumbleAudioTask {
+	void (*run)(MumbleAudioTask* task, Arena* arena);
+	MumbleClient* client;
+	_Atomic bool queued;
+	MumbleAudioTask* next;
+};
+
+typedef struct {
+	char* name;
+	int callback;
+} MumbleHookCallback;
+
+// Every callback registered to one hook, in the order they were added
+typedef struct {
+	MumbleHookCallback* callbacks;
+	size_t count;
+	size_t capacity;
+	// How many dispatches of this hook are running, callbacks removed during one are only compacted after it
+	uint32_t dispatching;
+	bool removed;
+} MumbleHookSlot;
+
+typedef struct {
+	uint64_t sequence;
+	uint8_t* data;
+	size_t length;
+	size_t capacity;
+	bool filled;
+} MumbleJitterSlot;
+
+typedef enum {
+	JITTER_IDLE,
+	JITTER_BUFFERING,
+	JITTER_PLAYING,
+} MumbleJitterState;
+
+struct MumbleJitter {
+	OpusDecoder* decoder;
+	MumbleJitterState state;
+	MumbleJitterSlot slots[JITTER_SLOTS];
+	// The next 10ms frame to be played
+	uint64_t play_sequence;
+	// The frame after the last one of a talk spurt, once its terminator arrived
+	uint64_t end_sequence;
+	bool ended;
+	// Frames before this one are a pause between talk spurts, and are played as silence
+	uint64_t silence_until;
+	// When buffering, the loop time playback starts at
+	uint64_t play_at;
+	// How many frames are buffered before a talk spurt starts playing
+	uint32_t depth;
+	// Smoothed inter-arrival jitter in milliseconds
+	double jitter;
+	int64_t last_transit;
+	bool has_transit;
+	uint32_t concealed;
+	uint64_t late;
+	uint64_t lost;
+	uint64_t recovered;
+	// Decoded audio waiting to be played
+	float pcm[(AUDIO_RECORD_MAX_FRAMES + JITTER_FRAME_SIZE) * AUDIO_PLAYBACK_CHANNELS];
+	size_t pcm_frames;
+	// Only the users recording wants the audio, so it is decoded by the recording worker and pcm is left empty
+	bool offload;
+	// The recording workers decoder missed some packets, and has to start over
+	bool offload_reset;
+	// The clock tick this user last played a frame on
+	uint64_t ticked;
+};
+
+// The voice packet passed to OnUserSpeak, reused for every packet
+typedef struct {
+	MumbleClient* client;
+	uint32_t session;
+	uint8_t codec;
+	uint32_t target;
+	uint64_t sequence;
+	bool speaking;
+	bool has_context;
+	uint32_t context;
+	const uint8_t* data;
+	size_t length;
+	ByteBuffer* buffer;
+	int buffer_ref;
+	bool busy;
+} MumbleSpeakEvent;
+
+// An encrypted datagram waiting to be sent
+struct MumbleUdpSend {
+	uv_udp_send_t req;
+	MumbleClient *client;
+	MumbleUdpSend *next;
+	MumbleUdpSend *prev;
+	bool pooled;
+	size_t length;
+	uint8_t data[];
+};
+
+struct IndexMap {
+	uint32_t* keys;
+	void** values;
+	size_t count;
+	size_t capacity;
+};
+
 struct MumbleClient {
 	lua_State*			l;
 	int					self;
@@ -186,6 +430,16 @@ struct MumbleClient {
 	uv_tcp_t			socket_tcp;
 	uv_os_fd_t			socket_tcp_fd;
 	uv_udp_t			socket_udp;
+	uv_check_t			send_flush;
+	uv_prepare_t		send_flush_prepare;
+	MumbleUdpSend*		udp_send_batch[UDP_SEND_BATCH];
+	size_t				udp_send_count;
+	MumbleUdpSend*		udp_send_free;
+	size_t				udp_send_free_count;
+	MumbleUdpSend*		udp_send_inflight;
+	size_t				udp_send_inflight_count;
+	uint8_t*			udp_recv_slab;
+	uint8_t*			udp_recv_decrypted;
 	uv_poll_t			ssl_poll;
 
 	struct addrinfo*	server_host_udp;
@@ -201,6 +455,9 @@ struct MumbleClient {
 	char*				host;
 	uint16_t			port;
 	int					hooks;
+	MumbleHookSlot*		hook_slots;
+	size_t				hook_slot_count;
+	uint64_t*			hook_present;
 	int					commands;
 	int					users;
 	int					channels;
@@ -221,11 +478,53 @@ struct MumbleClient {
 	OpusEncoder*		encoder;
 	int					encoder_ref;
 
-	OpusDecoder*		decoder;
+	MumbleSpeakEvent*	speak_event;
+	int					speak_event_ref;
+
+	uv_timer_t			jitter_timer;
+	uint64_t			jitter_clock;
+	MumbleUser**		jitter_users;
+	size_t				jitter_user_count;
+	size_t				jitter_user_capacity;
+	ByteBuffer*			jitter_pcm;
+	int					jitter_pcm_ref;
+	float				jitter_frame[JITTER_FRAME_SIZE * AUDIO_PLAYBACK_CHANNELS];
+
+	AudioFrame			mix_bus[JITTER_FRAME_SIZE];
+	MumbleRecorder*		mix_file;
+	int					mix_pipe;
+	ByteBuffer*			mix_buffer;
+	int					mix_buffer_ref;
+	size_t				mix_buffer_limit;
+
+	EncodedClip*		frame_cache_buckets[FRAME_CACHE_BUCKETS];
+	EncodedClip*		frame_cache_head;
+	EncodedClip*		frame_cache_tail;
+	size_t				frame_cache_bytes;
+	size_t				frame_cache_count;
+	size_t				frame_cache_capacity;
+	EncodedClip*		frame_recording;
+	AudioStream*		frame_recording_stream;
+	uint32_t			frame_recording_id;
+	uint32_t			frame_recording_pending;
+	bool				frame_recording_finishing;
+	bool				frame_recording_sealed;
+
+	MumbleRecordWorker*	record_workers;
 
 	uint8_t				audio_target;
 
-	MumblePacket		tcp_read_packet;
+	uint8_t*			tcp_recv_buffer;
+	size_t				tcp_recv_size;
+	size_t				tcp_recv_length;
+
+	uint8_t*			tcp_send_buffer;
+	size_t				tcp_send_size;
+	size_t				tcp_send_length;
+	size_t				tcp_send_offset;
+	// The poll event a blocked write is waiting on, or 0 if it isn't blocked
+	int					tcp_send_waiting;
+	bool				tcp_send_full;
 
 	uint32_t			tcp_packets;
 	double				tcp_ping_avg;
@@ -244,14 +543,26 @@ struct MumbleClient {
 	LinkNode*			stream_list;
 	LinkNode*			reclaim_list;
 
-	LinkNode*			channel_list;
-	LinkNode*			user_list;
+	IndexMap			channel_map;
+	IndexMap			user_map;
+	IndexMap			channel_users;
+	IndexMap			channel_children;
 	LinkNode*			audio_pipes;
 
 	bool				recording;
+	uint32_t			recording_users;
+
+	MumbleBufferWorker	audio_buffer_workers[AUDIO_BUFFER_THREADS];
+	uv_mutex_t			audio_buffer_mutex;
+	uv_cond_t			audio_buffer_cond;
+	uint32_t			audio_buffer_pending;
+	bool				audio_buffer_running;
 
-	uv_thread_t			audio_buffer_thread;
-	bool				audio_buffer_thread_running;
+	// Set when the client was created after mumble.useSharedAudio(), and runs its audio on the shared threads
+	bool				audio_shared;
+	MumbleAudioTask		audio_encode_task;
+	MumbleAudioTask		audio_buffer_tasks[AUDIO_BUFFER_THREADS];
+	uint32_t			audio_tasks;
 
 	uv_thread_t			audio_playback_thread;
 	uv_async_t			audio_playback_async;
@@ -262,9 +573,20 @@ struct MumbleClient {
 
 	audio_queue_t		audio_encode_queue;
 	uv_thread_t			audio_encode_thread;
-	bool				audio_encode_thread_running;
+	_Atomic bool		audio_encode_thread_running;
 
 	audio_queue_t		audio_send_queue;
+	uv_async_t			audio_send_async;
+
+	audio_work_t*		audio_work_pool;
+	audio_work_t*		audio_work_free;
+	uint32_t			audio_work_inflight;
+
+	Arena				audio_mix_arena;
+
+	// Everything unpacked from a server message lives here until the message is handled
+	Arena				message_arena;
+	ProtobufCAllocator	message_allocator;
 
 	bool				audio_stream_active;
 	
@@ -321,6 +643,7 @@ struct MumbleUser {
 	size_t			texture_hash_len;
 	char*			hash;
 	LinkNode*		listens;
-	SNDFILE*		recording_file;
+	MumbleRecorder*	recorder;
+	MumbleJitter*	jitter;
 	uint64_t		last_spoke;
 };
\ No newline at end of file
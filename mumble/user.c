@@ -3,6 +3,8 @@
 #include "channel.h"
 #include "user.h"
 #include "packet.h"
+#include "jitter.h"
+#include "record.h"
 #include "util.h"
 #include "log.h"
 
@@ -511,10 +513,10 @@ static int user_requestCommentBlob(lua_State *l) {
 static int user_startRecord(lua_State *l) {
 	MumbleUser *user = luaL_checkudata(l, 1, METATABLE_USER);
 
-	if (user->recording_file != NULL) {
+	if (user->recorder != NULL) {
 		lua_pushnil(l);
 		lua_pushstring(l, "user is already being recorded");
-		return 1;
+		return 2;
 	}
 
 	const char *filepath = luaL_checkstring(l, 2);
@@ -531,9 +533,16 @@ static int user_startRecord(lua_State *l) {
 		return 2;
 	}
 
+	int err = mumble_record_start(user->client, user, outfile);
+	if (err != OPUS_OK) {
+		sf_close(outfile);
+		lua_pushnil(l);
+		lua_pushfstring(l, "could not start recording: %s", opus_strerror(err));
+		return 2;
+	}
+
 	// Start recording at current timestamp
 	user->last_spoke = uv_now(uv_default_loop());
-	user->recording_file = outfile;
 
 	mumble_update_recording_status(user->client);
 
@@ -542,16 +551,17 @@ static int user_startRecord(lua_State *l) {
 }
 
 static void user_handle_stop_recording(lua_State *l, MumbleUser *user) {
+	// Write out whatever is still waiting in the users jitter buffer
+	mumble_jitter_drain(user->client, user);
 	// Handle any silence, from the time the user last stopped talking, until the end of the recording
 	mumble_handle_record_silence(user->client, user);
-	sf_close(user->recording_file);
-	user->recording_file = NULL;
+	mumble_record_stop(user->client, user);
 }
 
 static int user_stopRecord(lua_State *l) {
 	MumbleUser *user = luaL_checkudata(l, 1, METATABLE_USER);
 
-	if (user->recording_file != NULL) {
+	if (user->recorder != NULL) {
 		user_handle_stop_recording(l, user);
 		mumble_update_recording_status(user->client);
 		lua_pushboolean(l, true);
@@ -564,7 +574,7 @@ static int user_stopRecord(lua_State *l) {
 
 static int user_isBeingRecorded(lua_State *l) {
 	MumbleUser *user = luaL_checkudata(l, 1, METATABLE_USER);
-	lua_pushboolean(l, user->recording_file != NULL);
+	lua_pushboolean(l, user->recorder != NULL);
 	return 1;
 }
 
@@ -585,7 +595,7 @@ static int user_contextAction(lua_State *l) {
 static int user_gc(lua_State *l) {
 	MumbleUser *user = luaL_checkudata(l, 1, METATABLE_USER);
 	mumble_log(LOG_DEBUG, "%s: %p garbage collected", METATABLE_USER, user);
-	if (user->recording_file) {
+	if (user->recorder) {
 		user_handle_stop_recording(l, user);
 	}
 	if (user->name) {
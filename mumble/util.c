@@ -395,3 +395,292 @@ void* list_get(LinkNode* current, uint32_t index) {
 	return NULL;
 }
 
+
+/* Open addressing hash map of uint32_t keys to non NULL pointers.
+	Uses linear probing, with backward shift deletion so no tombstones are needed. */
+
+#define MAP_MIN_CAPACITY 16
+
+static inline size_t map_slot(const IndexMap *map, uint32_t key) {
+	// murmur3 finalizer, so sequential ids spread over the table
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+	return key & (map->capacity - 1);
+}
+
+void map_init(IndexMap *map) {
+	map->keys = NULL;
+	map->values = NULL;
+	map->count = 0;
+	map->capacity = 0;
+}
+
+void map_free(IndexMap *map) {
+	free(map->keys);
+	free(map->values);
+	map_init(map);
+}
+
+static bool map_resize(IndexMap *map, size_t capacity) {
+	uint32_t *keys = malloc(sizeof(uint32_t) * capacity);
+	void **values = calloc(capacity, sizeof(void*));
+
+	if (keys == NULL || values == NULL) {
+		free(keys);
+		free(values);
+		mumble_log(LOG_ERROR, "failed to resize map to %zu entries", capacity);
+		return false;
+	}
+
+	uint32_t *old_keys = map->keys;
+	void **old_values = map->values;
+	size_t old_capacity = map->capacity;
+
+	map->keys = keys;
+	map->values = values;
+	map->capacity = capacity;
+
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (old_values[i] != NULL) {
+			size_t slot = map_slot(map, old_keys[i]);
+			while (map->values[slot] != NULL) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			map->keys[slot] = old_keys[i];
+			map->values[slot] = old_values[i];
+		}
+	}
+
+	free(old_keys);
+	free(old_values);
+	return true;
+}
+
+void* map_get(const IndexMap *map, uint32_t key) {
+	if (map->count == 0) {
+		return NULL;
+	}
+
+	size_t slot = map_slot(map, key);
+
+	while (map->values[slot] != NULL) {
+		if (map->keys[slot] == key) {
+			return map->values[slot];
+		}
+		slot = (slot + 1) & (map->capacity - 1);
+	}
+
+	return NULL;
+}
+
+bool map_set(IndexMap *map, uint32_t key, void *value) {
+	// Keep the load factor under 75%
+	if ((map->count + 1) * 4 > map->capacity * 3) {
+		size_t capacity = map->capacity ? map->capacity * 2 : MAP_MIN_CAPACITY;
+		if (!map_resize(map, capacity)) {
+			return false;
+		}
+	}
+
+	size_t slot = map_slot(map, key);
+
+	while (map->values[slot] != NULL) {
+		if (map->keys[slot] == key) {
+			map->values[slot] = value;
+			return true;
+		}
+		slot = (slot + 1) & (map->capacity - 1);
+	}
+
+	map->keys[slot] = key;
+	map->values[slot] = value;
+	map->count++;
+	return true;
+}
+
+void* map_remove(IndexMap *map, uint32_t key) {
+	if (map->count == 0) {
+		return NULL;
+	}
+
+	size_t mask = map->capacity - 1;
+	size_t slot = map_slot(map, key);
+
+	while (map->values[slot] != NULL && map->keys[slot] != key) {
+		slot = (slot + 1) & mask;
+	}
+
+	void *value = map->values[slot];
+
+	if (value == NULL) {
+		// Key was not present
+		return NULL;
+	}
+
+	// Shift following entries of the cluster back into the hole
+	size_t hole = slot;
+	size_t next = (hole + 1) & mask;
+
+	while (map->values[next] != NULL) {
+		size_t home = map_slot(map, map->keys[next]);
+		// Only move the entry if its home slot is not between the hole and where it sits now
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			map->keys[hole] = map->keys[next];
+			map->values[hole] = map->values[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+
+	map->values[hole] = NULL;
+	map->count--;
+	return value;
+}
+
+bool map_next(const IndexMap *map, size_t *iter, uint32_t *key, void **value) {
+	for (size_t i = *iter; i < map->capacity; i++) {
+		if (map->values[i] != NULL) {
+			if (key != NULL) *key = map->keys[i];
+			if (value != NULL) *value = map->values[i];
+			*iter = i + 1;
+			return true;
+		}
+	}
+	*iter = map->capacity;
+	return false;
+}
+
+/* A map of maps, used to index entries by a group id (a channel id for example) */
+
+bool map_group_add(IndexMap *groups, uint32_t group, uint32_t key, void *value) {
+	IndexMap *map = map_get(groups, group);
+
+	if (map == NULL) {
+		map = malloc(sizeof(IndexMap));
+		if (map == NULL) {
+			mumble_log(LOG_ERROR, "failed to allocate map group %u", group);
+			return false;
+		}
+		map_init(map);
+		if (!map_set(groups, group, map)) {
+			free(map);
+			return false;
+		}
+	}
+
+	return map_set(map, key, value);
+}
+
+void map_group_remove(IndexMap *groups, uint32_t group, uint32_t key) {
+	IndexMap *map = map_get(groups, group);
+
+	if (map == NULL) {
+		return;
+	}
+
+	map_remove(map, key);
+
+	if (map->count == 0) {
+		// Don't keep empty groups around
+		map_remove(groups, group);
+		map_free(map);
+		free(map);
+	}
+}
+
+IndexMap* map_group_get(const IndexMap *groups, uint32_t group) {
+	return map_get(groups, group);
+}
+
+void map_group_free(IndexMap *groups) {
+	size_t iter = 0;
+	void *value;
+
+	while (map_next(groups, &iter, NULL, &value)) {
+		IndexMap *map = value;
+		map_free(map);
+		free(map);
+	}
+
+	map_free(groups);
+}
+
+#define ARENA_ALIGN 16
+
+void arena_init(Arena *arena, size_t size) {
+	arena->data = malloc(size);
+	arena->size = arena->data ? size : 0;
+	arena->used = 0;
+	arena->peak = 0;
+	arena->overflow = NULL;
+}
+
+static void arena_free_overflow(Arena *arena) {
+	void *block = arena->overflow;
+	while (block != NULL) {
+		void *next = *(void**) block;
+		free(block);
+		block = next;
+	}
+	arena->overflow = NULL;
+}
+
+void arena_free(Arena *arena) {
+	arena_free_overflow(arena);
+	free(arena->data);
+	arena->data = NULL;
+	arena->size = 0;
+	arena->used = 0;
+	arena->peak = 0;
+}
+
+void arena_reset(Arena *arena) {
+	if (arena->overflow != NULL) {
+		arena_free_overflow(arena);
+
+		// Grow to fit everything needed since the last reset, so we don't overflow again
+		uint8_t *data = realloc(arena->data, arena->peak);
+		if (data != NULL) {
+			arena->data = data;
+			arena->size = arena->peak;
+		}
+	}
+	arena->used = 0;
+	arena->peak = 0;
+}
+
+int file_stamp(const char *path, FileStamp *stamp) {
+	uv_fs_t req;
+	int err = uv_fs_stat(NULL, &req, path, NULL);
+	if (err == 0) {
+		stamp->size = req.statbuf.st_size;
+		stamp->mtime = req.statbuf.st_mtim.tv_sec * 1000000000LL + req.statbuf.st_mtim.tv_nsec;
+	}
+	uv_fs_req_cleanup(&req);
+	return err;
+}
+
+void* arena_alloc(Arena *arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	arena->peak += size;
+
+	if (arena->used + size <= arena->size) {
+		void *ptr = arena->data + arena->used;
+		arena->used += size;
+		return ptr;
+	}
+
+	// Doesn't fit, hand out a temporary block until the next reset
+	uint8_t *block = malloc(ARENA_ALIGN + size);
+	if (block == NULL) {
+		mumble_log(LOG_ERROR, "failed to allocate %zu bytes of scratch memory", size);
+		return NULL;
+	}
+	*(void**) block = arena->overflow;
+	arena->overflow = block;
+	return block + ARENA_ALIGN;
+}
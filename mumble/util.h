@@ -28,4 +28,27 @@ void list_remove(LinkNode **head_ref, uint32_t index);
 void list_remove_data(LinkNode **head_ref, void *data);
 void list_clear(LinkNode** head_ref);
 size_t list_count(LinkNode** head_ref);
-void* list_get(LinkNode* current, uint32_t index);
\ No newline at end of file
+void* list_get(LinkNode* current, uint32_t index);
+
+void map_init(IndexMap *map);
+void map_free(IndexMap *map);
+void* map_get(const IndexMap *map, uint32_t key);
+bool map_set(IndexMap *map, uint32_t key, void *value);
+void* map_remove(IndexMap *map, uint32_t key);
+bool map_next(const IndexMap *map, size_t *iter, uint32_t *key, void **value);
+
+bool map_group_add(IndexMap *groups, uint32_t group, uint32_t key, void *value);
+void map_group_remove(IndexMap *groups, uint32_t group, uint32_t key);
+IndexMap* map_group_get(const IndexMap *groups, uint32_t group);
+void map_group_free(IndexMap *groups);
+
+// Returns 0, or a libuv error code when the file can't be looked at
+int file_stamp(const char *path, FileStamp *stamp);
+static inline bool file_stamp_equal(const FileStamp *a, const FileStamp *b) {
+	return a->size == b->size && a->mtime == b->mtime;
+}
+
+void arena_init(Arena *arena, size_t size);
+void arena_free(Arena *arena);
+void arena_reset(Arena *arena);
+void* arena_alloc(Arena *arena, size_t size);
\ No newline at end of file
@@ -0,0 +1,51 @@
+local mumble = require("mumble")
+
+-- Rough throughput benchmark for the OCB2-AES128 voice crypt.
+-- Run it before and after a change to compare packets per second.
+
+local PACKETS = tonumber(arg and arg[1]) or 100000
+
+local server = mumble.crypt()
+local client = mumble.crypt()
+
+server:genKey()
+
+assert(client:setKey(server:getRawKey(), server:getDecryptIV(), server:getEncryptIV()),
+	"CryptState: Cipher resync failed: Invalid key/nonce from the server")
+
+-- Typical opus voice payload sizes (10ms @ 40kbps up to 60ms @ 96kbps)
+local SIZES = { 60, 120, 480, 720 }
+
+local function bench(size)
+	local payload = string.rep("\x5a", size)
+
+	local encrypted = {}
+
+	local start = os.clock()
+	for i = 1, PACKETS do
+		encrypted[i] = client:encrypt(payload)
+	end
+	local encrypt_time = os.clock() - start
+
+	start = os.clock()
+	for i = 1, PACKETS do
+		assert(server:decrypt(encrypted[i]), "failed to decrypt data encrypted by client")
+	end
+	local decrypt_time = os.clock() - start
+
+	print(string.format("%5d bytes\tencrypt: %10.0f packets/sec\tdecrypt: %10.0f packets/sec",
+		size, PACKETS / encrypt_time, PACKETS / decrypt_time))
+end
+
+print(string.format("Encrypting and decrypting %d packets per size", PACKETS))
+
+for _, size in ipairs(SIZES) do
+	bench(size)
+end
+
+print("SERVER")
+print("\tGood:", server:getGood())
+print("\tLate:", server:getLate())
+print("\tLost:", server:getLost())
+
+print("PASSED")